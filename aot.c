@@ -0,0 +1,15 @@
+#include "aot.h"
+#include "main.h"
+
+// Runs compiled microwords until end or halt. Due events and microwords without compiled code go
+// through step().
+void run_aot(struct vm *vm, __uint64_t end) {
+  while (vm->running && vm->tick_count < end) {
+    aot_microword compiled = aot_microcode[eeprom_index(vm)];
+    if (compiled == NULL || vm->tick_count >= vm->next_event) {
+      step(vm);
+    } else {
+      compiled(vm);
+    }
+  }
+}
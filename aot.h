@@ -0,0 +1,21 @@
+#include <stdlib.h>
+#include "microcode.h"
+
+#ifndef VM_AOT_H
+#define VM_AOT_H
+
+// Microcode compiled ahead of time by vm_aotgen, only linked into vm_aot. Each entry runs one
+// whole tick of the microword at that EEPROM index. Microwords that weren't compiled (unreachable
+// ones, and those that only end in an error) are NULL and get stepped instead.
+
+struct vm;
+
+typedef void (*aot_microword)(struct vm *vm);
+
+extern const aot_microword aot_microcode[EEPROM_SIZE];
+// eeprom_checksum() of the image the table was generated from
+extern const __uint64_t aot_checksum;
+
+void run_aot(struct vm *vm, __uint64_t end);
+
+#endif //VM_AOT_H
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "microcode.h"
+#include "eeprom.h"
+#include "verify.h"
+
+// Translates an EEPROM image into C for vm_aot. Every reachable microword becomes a function that
+// does exactly what step() would do for it, with the decoding done here: only the asserted
+// transfers are emitted, the single bus driver is a local that readers use directly, and the ALU
+// operation, carry, shifts and segment are constants. Microwords with identical decodings share a
+// function.
+//
+// Microwords whose only outcome is an error (two bus drivers, both shifts into the bus) are left
+// to the interpreter, so the messages stay where they are.
+
+#define BUS_DRIVERS (action_bit(ACT_MEM_R) | action_bit(ACT_SEG_R) | action_bit(ACT_REG_R) | action_bit(ACT_FLAG_R) |\
+    action_bit(ACT_ALU_RE) | action_bit(ACT_INT_RE))
+
+static bool compilable(const struct u_op *op) {
+  __uint32_t drivers = op->actions & BUS_DRIVERS;
+  bool both_shifts = (op->modifiers & (MOD_SHL | MOD_SHR)) == (MOD_SHL | MOD_SHR);
+  return (drivers & (drivers - 1)) == 0 && !((op->actions & action_bit(ACT_ALU_RE)) && both_shifts);
+}
+
+// The result of get_alu_result() for a fixed operation, carry and shift
+static void emit_alu(FILE *out, const struct u_op *op) {
+  static const char *operations[] = {
+      NULL, "vm->alu_a + !vm->alu_b", "!vm->alu_a + vm->alu_b", "vm->alu_a + vm->alu_b",
+      "vm->alu_a ^ vm->alu_b", "vm->alu_a | vm->alu_b", "vm->alu_a & vm->alu_b", NULL
+  };
+  bool carry = op->modifiers & MOD_CIN;
+  bool shl = op->modifiers & MOD_SHL;
+  bool shr = op->modifiers & MOD_SHR;
+  if (operations[op->alu_operation] == NULL) {
+    // 0 and 7 don't depend on A or B
+    __uint16_t value = op->alu_operation == 0 ? 0 : 0xFFFF;
+    value = (__uint16_t) (value + carry);
+    value = shl ? (__uint16_t) (value << 1) : shr ? (__uint16_t) (value >> 1) : value;
+    fprintf(out, "0x%04x", value);
+    return;
+  }
+  // Written straight out, so the nesting costs no intermediate buffers
+  const char *operation = operations[op->alu_operation];
+  if (shl || shr) {
+    fprintf(out, "(__uint16_t) (");
+  }
+  if (carry) {
+    fprintf(out, "(__uint16_t) ((__uint16_t) (%s) + 1)", operation);
+  } else {
+    fprintf(out, "(__uint16_t) (%s)", operation);
+  }
+  if (shl || shr) {
+    fprintf(out, " %s 1)", shl ? "<<" : ">>");
+  }
+}
+
+static const char *register_index(const struct u_op *op) {
+  return op->modifiers & MOD_REG_SRC ? "ir_src_reg(vm)" : "ir_dst_reg(vm)";
+}
+
+// Unclocked actions, in the order non_tick() applies them
+static void emit_unclocked(FILE *out, const struct u_op *op) {
+  __uint32_t pending = op->actions & UNCLOCKED_ACTIONS;
+  while (pending) {
+    enum u_action action = (enum u_action) __builtin_ctz(pending);
+    pending &= pending - 1;
+    switch (action) {
+      case ACT_MEM_R:
+        fprintf(out, "  __uint16_t bus = read_memory(vm, memory_address(vm, 0x%02x, %u));\n", op->modifiers,
+                op->segment);
+        break;
+      case ACT_SEG_R:
+        fprintf(out, "  __uint16_t bus = vm->segments[%u];\n", op->segment);
+        break;
+      case ACT_REG_R:
+        fprintf(out, "  __uint16_t bus = vm->registers[%s];\n", register_index(op));
+        break;
+      case ACT_FLAG_R:
+        fprintf(out, "  __uint16_t bus = read_flags(vm);\n");
+        break;
+      case ACT_ALU_RE:
+        fprintf(out, "  __uint16_t bus = ");
+        emit_alu(out, op);
+        fprintf(out, ";\n");
+        break;
+      case ACT_JMP_RE:
+        fprintf(out, "  if (jump_taken(read_flags(vm), %u)) {\n    vm->u_program_counter++;\n  }\n", op->jump_select);
+        break;
+      case ACT_INT_RE:
+        fprintf(out, "  __uint16_t bus = interrupt_vector(vm);\n");
+        break;
+      case ACT_DECODE_R:
+        fprintf(out, "  vm->u_instruction_register = vm->interrupts_pending ? INTERRUPT_UIR : "
+                     "(__uint8_t) (vm->instruction_register >> 11);\n");
+        break;
+      case ACT_INTA:
+        fprintf(out, "  acknowledge_interrupt(vm);\n");
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+// Clocked actions, in the order tick() applies them. bus is what they latch.
+static void emit_clocked(FILE *out, const struct u_op *op, const char *bus) {
+  __uint32_t pending = op->actions & CLOCKED_ACTIONS;
+  while (pending) {
+    enum u_action action = (enum u_action) __builtin_ctz(pending);
+    pending &= pending - 1;
+    switch (action) {
+      case ACT_UIP_W:
+        fprintf(out, "  vm->u_instruction_register = (__uint8_t) (vm->instruction_register >> 10);\n");
+        break;
+      case ACT_OUT_W:
+        fprintf(out, "  if (vm->io && vm->io->out) {\n    vm->io->out(%s);\n  }\n", bus);
+        break;
+      case ACT_MEM_W:
+        fprintf(out, "  write_memory(vm, memory_address(vm, 0x%02x, %u), %s);\n", op->modifiers, op->segment,
+                bus);
+        break;
+      case ACT_MAR_W:
+        fprintf(out, "  vm->mar = %s;\n", bus);
+        break;
+      case ACT_SEG_W:
+        fprintf(out, "  write_segment(vm, %u, %s);\n", op->segment, bus);
+        break;
+      case ACT_REG_W:
+        fprintf(out, "  vm->registers[%s] = %s;\n", register_index(op), bus);
+        break;
+      case ACT_FLAG_W:
+        if (op->modifiers & MOD_FLAG_SEL_BUS) {
+          fprintf(out, "  write_flags(vm, %s);\n", bus);
+        } else {
+          fprintf(out, "  record_alu_flags(vm, %u, 0x%02x);\n", op->alu_operation, op->modifiers);
+        }
+        break;
+      case ACT_ALU_A_W:
+        fprintf(out, "  vm->alu_a = %s;\n", bus);
+        break;
+      case ACT_ALU_B_W:
+        fprintf(out, "  vm->alu_b = %s;\n", bus);
+        break;
+      case ACT_IR_W:
+        fprintf(out, "  vm->instruction_register = %s;\n", bus);
+        break;
+      case ACT_HALT:
+        fprintf(out, "  vm->running = false;\n");
+        break;
+      default: // uPC clear is folded into the increment
+        break;
+    }
+  }
+}
+
+static void emit_microword(FILE *out, unsigned index, const struct u_op *op, __uint64_t word) {
+  bool driven = (op->actions & BUS_DRIVERS) != 0;
+  fprintf(out, "// uIR %02x uPC %u: %010llx\n", index >> 7, index & 0x7F, (unsigned long long) word);
+  fprintf(out, "static void aot_%04x(struct vm *vm) {\n", index);
+  emit_unclocked(out, op);
+  if (driven) {
+    fprintf(out, "  vm->bus = bus;\n  vm->bus_floating = false;\n");
+  } else {
+    fprintf(out, "  vm->bus = 0;\n  vm->bus_floating = true;\n");
+  }
+  emit_clocked(out, op, driven ? "bus" : "0");
+  if (op->actions & action_bit(ACT_UPC_CLEAR)) {
+    fprintf(out, "  vm->u_program_counter = 1;\n");
+  } else {
+    fprintf(out, "  vm->u_program_counter++;\n");
+  }
+  fprintf(out, "  vm->tick_count++;\n}\n\n");
+}
+
+static int generate(const char *eeprom_path, const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    printf("Could not create %s\n", path);
+    return EXIT_FAILURE;
+  }
+  bool *reached = calloc(EEPROM_SIZE, sizeof(bool));
+  // The index whose function each microword runs, EEPROM_SIZE for none
+  unsigned *function = malloc(EEPROM_SIZE * sizeof(unsigned));
+  reachable_microwords(&loaded_microcode, reached);
+
+  fprintf(out, "// Generated by vm_aotgen from %s, do not edit\n", eeprom_path);
+  fprintf(out, "#include \"aot.h\"\n#include \"main.h\"\n#include \"io.h\"\n#include \"interrupts.h\"\n\n");
+  fprintf(out, "const __uint64_t aot_checksum = 0x%016llxULL;\n\n",
+          (unsigned long long) eeprom_checksum(loaded_microcode.words, EEPROM_SIZE));
+  int functions = 0;
+  for (unsigned index = 0; index < EEPROM_SIZE; ++index) {
+    const struct u_op *op = &loaded_microcode.decoded[index];
+    function[index] = EEPROM_SIZE;
+    if (!reached[index] || !compilable(op)) {
+      continue;
+    }
+    for (unsigned earlier = 0; earlier < index && function[index] == EEPROM_SIZE; ++earlier) {
+      if (function[earlier] == earlier && memcmp(&loaded_microcode.decoded[earlier], op, sizeof(*op)) == 0) {
+        function[index] = earlier;
+      }
+    }
+    if (function[index] == EEPROM_SIZE) {
+      function[index] = index;
+      emit_microword(out, index, op, loaded_microcode.words[index]);
+      ++functions;
+    }
+  }
+  fprintf(out, "const aot_microword aot_microcode[EEPROM_SIZE] = {\n");
+  int compiled = 0;
+  for (unsigned index = 0; index < EEPROM_SIZE; ++index) {
+    if (function[index] != EEPROM_SIZE) {
+      fprintf(out, "    [0x%04x] = aot_%04x,\n", index, function[index]);
+      ++compiled;
+    }
+  }
+  fprintf(out, "};\n");
+  free(function);
+  free(reached);
+  if (fclose(out) != 0) {
+    printf("Could not write %s\n", path);
+    return EXIT_FAILURE;
+  }
+  printf("%d microwords compiled into %d functions\n", compiled, functions);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    printf("Usage: ./vm_aotgen EEPROM_file output.c\n");
+    return EXIT_FAILURE;
+  }
+  if (load_microcode(argv[1], &loaded_microcode) == EXIT_FAILURE) {
+    printf("EEPROM file provided was invalid.\n");
+    return EXIT_FAILURE;
+  }
+  return generate(argv[1], argv[2]);
+}
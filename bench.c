@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "main.h"
+#include "microcode.h"
+#include "fused.h"
+#include "lockstep.h"
+#include "fastforward.h"
+
+// Times the core on synthetic microcode without the UI. Every opcode runs BODY_LENGTH microwords
+// of the workload's kind, then a two microword tail that computes the next IR with the ALU and
+// decodes it, so the run walks through the opcodes instead of spinning on one.
+
+#define BODY_LENGTH 10
+// Ticks per macro-instruction once running: the body and the two tail microwords
+#define INSTRUCTION_LENGTH (BODY_LENGTH + 2)
+#define OPCODES 32
+
+#define DEFAULT_TICKS 20000000
+#define DEFAULT_REPEAT 5
+
+#define assert_low(word, mask) ((word) & ~(mask))
+#define with_alu(word, operation) (((word) & ~(alu_s | neg_alu_re)) | (__uint64_t) (operation) << 17)
+#define with_segment(word, segment) (((word) & ~seg_sel) | (__uint64_t) (segment) << 36)
+#define with_address_mode(word, mode) (((word) & ~addr_mode) | (__uint64_t) (mode) << 22)
+#define with_jump(word, condition) (((word) & ~(jsel | neg_jmp_re)) | (__uint64_t) (condition) << 32)
+
+// Nothing asserted
+#define NOP do_nothing_bits
+
+struct workload {
+  const char *name;
+  __uint64_t (*body)(int opcode, int position);
+};
+
+// ALU result into B, cycling through operations and shifts
+static __uint64_t alu_body(int opcode, int position) {
+  __uint64_t word = with_alu(assert_low(NOP, neg_alu_b_W), 1 + (opcode + position) % 7);
+  if (position % 3 == 1) {
+    word |= shift_left;
+  } else if (position % 3 == 2) {
+    word |= shift_right | cin;
+  }
+  return word;
+}
+
+// Moves between registers, segments and mar
+static __uint64_t register_body(int opcode, int position) {
+  switch ((opcode + position) % 3) {
+    case 0: // Register to segment
+      return with_segment(assert_low(NOP, neg_reg_en | neg_seg_en) | seg_W, position & 3) |
+             (position & 4 ? reg_sel : 0);
+    case 1: // Segment to register
+      return with_segment(assert_low(NOP, neg_seg_en | neg_reg_en) | reg_W, position & 3) |
+             (position & 4 ? 0 : reg_sel);
+    default: // Register to mar
+      return assert_low(NOP, neg_reg_en | neg_mar_W) | reg_sel;
+  }
+}
+
+// Address, read and write memory
+static __uint64_t memory_body(int opcode, int position) {
+  switch ((opcode + position) % 4) {
+    case 0:
+      return assert_low(NOP, neg_reg_en | neg_mar_W) | reg_sel;
+    case 1:
+      return assert_low(NOP, neg_mem_R | neg_reg_en) | reg_W;
+    case 2:
+      return assert_low(NOP, neg_reg_en | neg_mem_W);
+    default:
+      return assert_low(NOP, neg_mem_R | neg_alu_b_W);
+  }
+}
+
+// Memory through each address mode, with a segment or SP write in between to move the window
+static __uint64_t segmented_body(int opcode, int position) {
+  switch ((opcode + position) % 4) {
+    case 0:
+      return with_segment(assert_low(NOP, neg_reg_en | neg_seg_en) | seg_W, position & 3);
+    case 1:
+      return with_address_mode(with_segment(assert_low(NOP, neg_mem_R | neg_reg_en) | reg_W, position & 3),
+                                ADDR_SEGMENT);
+    case 2:
+      return with_address_mode(assert_low(NOP, neg_alu_re | neg_mem_W), position & 4 ? ADDR_STACK : ADDR_CODE);
+    default:
+      return with_address_mode(assert_low(NOP, neg_mem_R | neg_alu_b_W), ADDR_STACK);
+  }
+}
+
+// ALU results into B that latch the flags, and now and then a micro-jump that tests them but never
+// skips, so the instruction length stays the same
+static __uint64_t flags_body(int opcode, int position) {
+  if (position % 5 == 4) {
+    return with_jump(NOP, JUMP_ALWAYS + JUMP_NEGATE);
+  }
+  return with_alu(assert_low(NOP, neg_alu_b_W | neg_flag_W), 1 + (opcode + position) % 7);
+}
+
+static __uint64_t nop_body(int opcode, int position) {
+  (void) opcode;
+  (void) position;
+  return NOP;
+}
+
+static const struct workload workloads[] = {
+    {"alu", alu_body},
+    {"register", register_body},
+    {"memory", memory_body},
+    {"segmented", segmented_body},
+    {"flags", flags_body},
+    {"nop", nop_body},
+};
+
+#define WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void build_workload(const struct workload *workload) {
+  for (int i = 0; i < EEPROM_SIZE; ++i) {
+    loaded_microcode.storage[i] = NOP;
+  }
+  for (int opcode = 0; opcode < OPCODES; ++opcode) {
+    __uint64_t *program = &loaded_microcode.storage[opcode << 7];
+    // uPC 0 only runs after reset, uPC_clear lands on 1
+    for (int position = 0; position < BODY_LENGTH; ++position) {
+      program[1 + position] = workload->body(opcode, position);
+    }
+    program[0] = program[1];
+    // IR = A = A + B, then decode it
+    program[BODY_LENGTH + 1] = with_alu(assert_low(NOP, neg_alu_a_W), 3) | ir_W;
+    program[BODY_LENGTH + 2] = assert_low(NOP, neg_decode_R | neg_uPC_clear);
+  }
+  loaded_microcode.words = loaded_microcode.storage;
+  decode_microcode(loaded_microcode.words, loaded_microcode.decoded, EEPROM_SIZE);
+  build_fused_blocks(&loaded_microcode);
+  build_instructions(&loaded_microcode);
+}
+
+static void reset_machine(void) {
+  memset(machine.registers, 0, sizeof(machine.registers));
+  memset(machine.segments, 0, sizeof(machine.segments));
+  refresh_segment_bases(&machine);
+  memset(machine.memory, 0, MEMORY_SIZE * sizeof(__uint16_t));
+  machine.alu_a = 0;
+  machine.alu_b = 0x0800; // Steps IR through the opcodes when nothing else changes B
+  machine.mar = 0;
+  write_flags(&machine, 0);
+  machine.instruction_register = 0;
+  machine.u_instruction_register = 0;
+  machine.u_program_counter = 0;
+  machine.tick_count = 0;
+  machine.running = true;
+}
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double) time.tv_sec + (double) time.tv_nsec / 1E9;
+}
+
+enum mode {
+  MODE_FUSED,
+  MODE_STEPPED,
+  MODE_FAST_FORWARD,
+  MODE_LOCKSTEP
+};
+
+static const char *mode_names[] = {"fused", "stepped", "ffwd", "lockstep"};
+
+// Splits the ticks between LOCKSTEP_LANES machines that only differ in AX
+static __uint64_t run_lockstep_once(__uint64_t ticks) {
+  struct lockstep group = {.microcode = &loaded_microcode, .lanes = LOCKSTEP_LANES};
+  for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+    reset_machine();
+    machine.registers[0] = (__uint16_t) lane;
+    lockstep_load(&group, lane, &machine);
+  }
+  run_lockstep(&group, ticks / LOCKSTEP_LANES);
+  __uint64_t total = 0;
+  for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+    total += group.tick_count[lane];
+  }
+  return total;
+}
+
+// Returns the achieved ticks per second, counting every lane's ticks in lockstep mode
+static double run_once(__uint64_t ticks, enum mode mode) {
+  reset_machine();
+  double start = now();
+  __uint64_t done;
+  if (mode == MODE_LOCKSTEP) {
+    ticks -= ticks % LOCKSTEP_LANES;
+    done = run_lockstep_once(ticks);
+  } else {
+    fast_forward = mode == MODE_FAST_FORWARD;
+    run_ticks(&machine, ticks, mode != MODE_STEPPED);
+    done = machine.tick_count;
+  }
+  double elapsed = now() - start;
+  if (done != ticks) {
+    fprintf(stderr, "Workload stopped after %llu of %llu ticks\n", (unsigned long long) done,
+            (unsigned long long) ticks);
+  }
+  return elapsed > 0 ? (double) done / elapsed : 0;
+}
+
+static void usage(void) {
+  printf("Usage: ./vm_bench [--ticks N] [--repeat N] [--workload name] [--csv]\n");
+  printf("Workloads:");
+  for (size_t i = 0; i < WORKLOADS; ++i) {
+    printf(" %s", workloads[i].name);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  static struct option long_options[] = {
+      {"ticks", required_argument, NULL, 'n'},
+      {"repeat", required_argument, NULL, 'r'},
+      {"workload", required_argument, NULL, 'w'},
+      {"csv", no_argument, NULL, 'c'},
+      {NULL, 0, NULL, 0}
+  };
+  __uint64_t ticks = DEFAULT_TICKS;
+  int repeat = DEFAULT_REPEAT;
+  const char *only = NULL;
+  bool csv = false;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'n':
+        ticks = strtoull(optarg, NULL, 0);
+        break;
+      case 'r':
+        repeat = atoi(optarg);
+        break;
+      case 'w':
+        only = optarg;
+        break;
+      case 'c':
+        csv = true;
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc || ticks == 0 || repeat < 1) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  machine.memory = calloc(MEMORY_SIZE, sizeof(__uint16_t));
+  if (machine.memory == NULL) {
+    printf("Could not allocate memory\n");
+    return EXIT_FAILURE;
+  }
+  if (csv) {
+    printf("workload,mode,ticks,repeat,ticks_per_s,stddev_ticks_per_s,ns_per_tick,instructions_per_s\n");
+  } else {
+    printf("%-10s %-8s %14s %10s %10s %14s\n", "workload", "mode", "ticks/s", "stddev", "ns/tick", "instr/s");
+  }
+
+  bool found = false;
+  for (size_t w = 0; w < WORKLOADS; ++w) {
+    if (only && strcmp(only, workloads[w].name) != 0) {
+      continue;
+    }
+    found = true;
+    build_workload(&workloads[w]);
+    for (enum mode mode = MODE_FUSED; mode <= MODE_LOCKSTEP; ++mode) {
+      // Warm the caches and branch predictors before timing
+      run_once(ticks / 10 + LOCKSTEP_LANES, mode);
+      double sum = 0;
+      double sum_squares = 0;
+      for (int r = 0; r < repeat; ++r) {
+        double rate = run_once(ticks, mode);
+        sum += rate;
+        sum_squares += rate * rate;
+      }
+      double mean = sum / repeat;
+      double variance = repeat > 1 ? (sum_squares - sum * mean) / (repeat - 1) : 0;
+      double stddev = variance > 0 ? sqrt(variance) : 0;
+      double ns_per_tick = mean > 0 ? 1E9 / mean : 0;
+      double instructions = mean / INSTRUCTION_LENGTH;
+      if (csv) {
+        printf("%s,%s,%llu,%d,%.0f,%.0f,%.3f,%.0f\n", workloads[w].name, mode_names[mode], (unsigned long long) ticks, repeat,
+               mean, stddev, ns_per_tick, instructions);
+      } else {
+        printf("%-10s %-8s %14.0f %9.1f%% %10.3f %14.0f\n", workloads[w].name, mode_names[mode], mean,
+               mean > 0 ? 100 * stddev / mean : 0, ns_per_tick, instructions);
+      }
+      fflush(stdout);
+    }
+  }
+  free(machine.memory);
+  if (!found) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
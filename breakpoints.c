@@ -0,0 +1,458 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "breakpoints.h"
+#include "main.h"
+#include "printing.h"
+
+// Breakpoints are only checked by run_ticks_checked(), which run_ticks() switches to while any are
+// set, so the normal loops never pay for them.
+
+struct breakpoint breakpoints[MAX_BREAKPOINTS];
+int breakpoint_count;
+int next_breakpoint_id = 1;
+// Set when a breakpoint stopped the last run, cleared when the next one starts
+bool breakpoint_hit;
+// Message for the last hit, kept for headless runs where info() is dropped
+char hit_message[160];
+// How the last checked run stopped. A breakpoint stops before its tick runs, so resuming from that
+// tick mustn't stop on it again. Watchpoints and "run until" stop after their tick ran, so resuming
+// from them checks everything.
+enum stop_kind {
+  STOP_NONE,
+  STOP_BEFORE_TICK,
+  STOP_AFTER_TICK
+};
+
+static enum stop_kind last_stop;
+// Tick at which the last stop happened
+__uint64_t stopped_at = UINT64_MAX;
+// CS:IP before the last tick of the current checked run, for edge triggered CS:IP breakpoints
+__uint32_t last_csip;
+// Stop condition of a "run until", checked after every tick like a watchpoint
+bool until_active;
+struct predicate until_condition;
+char until_text[96];
+
+#define CS 0
+#define IP 1
+#define csip(vm) ((__uint32_t) (vm)->segments[CS] << 16 | (vm)->segments[IP])
+
+static const char *register_operands[8] = {"ax", "bx", "cx", "dx", "sp", "bp", "si", "bi"};
+static const char *segment_operands[4] = {"cs", "ip", "ss", "ds"};
+static const char *comparison_names[] = {"==", "!=", "<", "<=", ">", ">="};
+
+static __uint16_t read_operand(const struct vm *vm, const struct operand *operand) {
+  switch (operand->kind) {
+    case OPERAND_REGISTER:
+      return vm->registers[operand->arg];
+    case OPERAND_SEGMENT:
+      return vm->segments[operand->arg];
+    case OPERAND_MAR:
+      return vm->mar;
+    case OPERAND_BUS:
+      return vm->bus;
+    case OPERAND_IR:
+      return vm->instruction_register;
+    case OPERAND_UIR:
+      return vm->u_instruction_register;
+    case OPERAND_UPC:
+      return vm->u_program_counter;
+    case OPERAND_ALU_A:
+      return vm->alu_a;
+    case OPERAND_ALU_B:
+      return vm->alu_b;
+    case OPERAND_MEMORY:
+      return vm->memory[operand->arg];
+    case OPERAND_FLAGS:
+      return peek_flags(vm);
+    default:
+      return 0;
+  }
+}
+
+bool condition_holds(const struct vm *vm, const struct predicate *predicate) {
+  for (int i = 0; i < predicate->count; ++i) {
+    const struct condition_term *term = &predicate->terms[i];
+    __uint16_t value = read_operand(vm, &term->operand);
+    bool result;
+    switch (term->comparison) {
+      case CMP_EQ: result = value == term->value; break;
+      case CMP_NE: result = value != term->value; break;
+      case CMP_LT: result = value < term->value; break;
+      case CMP_LE: result = value <= term->value; break;
+      case CMP_GT: result = value > term->value; break;
+      default: result = value >= term->value; break;
+    }
+    if (!result) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// -------------------
+// Parsing
+// ------------------
+
+static bool parse_number(const char *token, unsigned long max, __uint16_t *value) {
+  char *end;
+  unsigned long parsed = strtoul(token, &end, 0);
+  if (*token == '\0' || *end != '\0' || parsed > max) {
+    return false;
+  }
+  *value = (__uint16_t) parsed;
+  return true;
+}
+
+// Operands: ax..bi or r0..r7, cs/ip/ss/ds, mar, bus, ir, uir, upc, a, b, flags, mem:ADDR
+static bool parse_operand(const char *token, struct operand *operand) {
+  for (int i = 0; i < 8; ++i) {
+    char alias[3] = {'r', (char) ('0' + i), '\0'};
+    if (strcasecmp(token, register_operands[i]) == 0 || strcasecmp(token, alias) == 0) {
+      operand->kind = OPERAND_REGISTER;
+      operand->arg = (__uint16_t) i;
+      return true;
+    }
+  }
+  for (int i = 0; i < 4; ++i) {
+    if (strcasecmp(token, segment_operands[i]) == 0) {
+      operand->kind = OPERAND_SEGMENT;
+      operand->arg = (__uint16_t) i;
+      return true;
+    }
+  }
+  operand->arg = 0;
+  if (strcasecmp(token, "mar") == 0) { operand->kind = OPERAND_MAR; return true; }
+  if (strcasecmp(token, "bus") == 0) { operand->kind = OPERAND_BUS; return true; }
+  if (strcasecmp(token, "ir") == 0) { operand->kind = OPERAND_IR; return true; }
+  if (strcasecmp(token, "uir") == 0) { operand->kind = OPERAND_UIR; return true; }
+  if (strcasecmp(token, "upc") == 0) { operand->kind = OPERAND_UPC; return true; }
+  if (strcasecmp(token, "a") == 0) { operand->kind = OPERAND_ALU_A; return true; }
+  if (strcasecmp(token, "b") == 0) { operand->kind = OPERAND_ALU_B; return true; }
+  if (strcasecmp(token, "flags") == 0) { operand->kind = OPERAND_FLAGS; return true; }
+  if (strncasecmp(token, "mem:", 4) == 0) {
+    operand->kind = OPERAND_MEMORY;
+    return parse_number(token + 4, MEMORY_SIZE - 1, &operand->arg);
+  }
+  return false;
+}
+
+// Compiles "OPERAND CMP VALUE [&& OPERAND CMP VALUE]..." from the remaining tokens
+static bool parse_condition(char **tokens, int count, struct predicate *predicate) {
+  predicate->count = 0;
+  int i = 0;
+  while (i < count) {
+    if (predicate->count == MAX_CONDITION_TERMS || i + 3 > count) {
+      return false;
+    }
+    struct condition_term *term = &predicate->terms[predicate->count++];
+    if (!parse_operand(tokens[i], &term->operand) || !parse_number(tokens[i + 2], 0xFFFF, &term->value)) {
+      return false;
+    }
+    int comparison = -1;
+    for (int c = CMP_EQ; c <= CMP_GE; ++c) {
+      if (strcmp(tokens[i + 1], comparison_names[c]) == 0) {
+        comparison = c;
+      }
+    }
+    if (comparison < 0) {
+      return false;
+    }
+    term->comparison = (__uint8_t) comparison;
+    i += 3;
+    if (i < count && strcmp(tokens[i++], "&&") != 0) {
+      return false;
+    }
+    if (i == count && strcmp(tokens[i - 1], "&&") == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static const char *operand_names[] = {"", "", "mar", "bus", "ir", "uir", "upc", "a", "b", "", "flags"};
+
+static int format_operand(const struct operand *operand, char *buf, size_t size) {
+  switch (operand->kind) {
+    case OPERAND_REGISTER:
+      return snprintf(buf, size, "%s", register_operands[operand->arg]);
+    case OPERAND_SEGMENT:
+      return snprintf(buf, size, "%s", segment_operands[operand->arg]);
+    case OPERAND_MEMORY:
+      return snprintf(buf, size, "mem:%04x", operand->arg);
+    default:
+      return snprintf(buf, size, "%s", operand_names[operand->kind]);
+  }
+}
+
+static void describe(const struct breakpoint *breakpoint, char *buf, size_t size) {
+  int used;
+  switch (breakpoint->kind) {
+    case BREAK_MICROWORD:
+      used = snprintf(buf, size, "%d: break uop %02x:%u", breakpoint->id, breakpoint->index >> 7,
+                      breakpoint->index & 0x7F);
+      break;
+    case BREAK_CSIP:
+      used = snprintf(buf, size, "%d: break csip %04x:%04x", breakpoint->id, breakpoint->cs, breakpoint->ip);
+      break;
+    default:
+      used = snprintf(buf, size, "%d: watch ", breakpoint->id);
+      used += format_operand(&breakpoint->watched, buf + used, size - used);
+      break;
+  }
+  for (int i = 0; i < breakpoint->condition.count && (size_t) used < size; ++i) {
+    const struct condition_term *term = &breakpoint->condition.terms[i];
+    used += snprintf(buf + used, size - used, i == 0 ? " if " : " && ");
+    if ((size_t) used < size) {
+      used += format_operand(&term->operand, buf + used, size - used);
+    }
+    if ((size_t) used < size) {
+      used += snprintf(buf + used, size - used, " %s 0x%x", comparison_names[term->comparison], term->value);
+    }
+  }
+}
+
+static void add_breakpoint(struct breakpoint *breakpoint) {
+  char buf[128];
+  if (breakpoint_count == MAX_BREAKPOINTS) {
+    error("Too many breakpoints");
+    return;
+  }
+  breakpoint->id = next_breakpoint_id++;
+  breakpoints[breakpoint_count++] = *breakpoint;
+  describe(breakpoint, buf, sizeof(buf));
+  info(buf);
+}
+
+static void delete_breakpoint(const char *which) {
+  if (strcmp(which, "all") == 0) {
+    breakpoint_count = 0;
+    info("Deleted all breakpoints");
+    return;
+  }
+  int id = atoi(which);
+  for (int i = 0; i < breakpoint_count; ++i) {
+    if (breakpoints[i].id == id) {
+      memmove(&breakpoints[i], &breakpoints[i + 1], (breakpoint_count - i - 1) * sizeof(struct breakpoint));
+      --breakpoint_count;
+      info("Deleted breakpoint");
+      return;
+    }
+  }
+  error("No such breakpoint");
+}
+
+// Handles break/watch/delete/breakpoints commands:
+//   break uop UIR:UPC [if COND]     break uop INDEX [if COND]
+//   break csip CS:IP [if COND]      watch OPERAND [if COND]
+//   delete N|all                    breakpoints
+void debug_command(const char *line) {
+  char copy[256];
+  char *tokens[32];
+  int count = 0;
+  strncpy(copy, line, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = '\0';
+  for (char *token = strtok(copy, " "); token && count < 32; token = strtok(NULL, " ")) {
+    tokens[count++] = token;
+  }
+  if (count == 0) {
+    return;
+  }
+
+  if (strcmp(tokens[0], "breakpoints") == 0) {
+    char buf[128];
+    for (int i = 0; i < breakpoint_count; ++i) {
+      describe(&breakpoints[i], buf, sizeof(buf));
+      info(buf);
+    }
+    if (breakpoint_count == 0) {
+      info("No breakpoints");
+    }
+    return;
+  }
+  if (strcmp(tokens[0], "delete") == 0 && count == 2) {
+    delete_breakpoint(tokens[1]);
+    return;
+  }
+
+  struct breakpoint breakpoint = {0};
+  int condition_start;
+  if (strcmp(tokens[0], "watch") == 0 && count >= 2 && parse_operand(tokens[1], &breakpoint.watched)) {
+    breakpoint.kind = WATCH;
+    breakpoint.last_value = read_operand(&machine, &breakpoint.watched);
+    condition_start = 2;
+  } else if (strcmp(tokens[0], "break") == 0 && count >= 3) {
+    char *colon = strchr(tokens[2], ':');
+    __uint16_t high = 0, low;
+    if (colon) {
+      *colon = '\0';
+    }
+    bool parsed = colon ? parse_number(tokens[2], 0xFFFF, &high) && parse_number(colon + 1, 0xFFFF, &low)
+                        : parse_number(tokens[2], 0xFFFF, &low);
+    if (parsed && strcmp(tokens[1], "uop") == 0 && (colon ? high < 64 && low < 128 : low < 8192)) {
+      breakpoint.kind = BREAK_MICROWORD;
+      breakpoint.index = (__uint16_t) (colon ? high << 7 | low : low);
+    } else if (parsed && colon && strcmp(tokens[1], "csip") == 0) {
+      breakpoint.kind = BREAK_CSIP;
+      breakpoint.cs = high;
+      breakpoint.ip = low;
+    } else {
+      error("Usage: break uop UIR:UPC|INDEX [if COND] or break csip CS:IP [if COND]");
+      return;
+    }
+    condition_start = 3;
+  } else {
+    error("Usage: watch OPERAND [if COND], break ..., delete N|all, breakpoints");
+    return;
+  }
+
+  if (condition_start < count) {
+    if (strcmp(tokens[condition_start], "if") != 0 ||
+        !parse_condition(&tokens[condition_start + 1], count - condition_start - 1, &breakpoint.condition)) {
+      error("Bad condition, expected e.g. 'if ax == 0x10 && mem:0x100 != 0'");
+      return;
+    }
+  }
+  add_breakpoint(&breakpoint);
+}
+
+// Compiles a condition in the breakpoint syntax or the compact form, like "uir=0x1f" or
+// "ax>=3&&bx==0"
+bool compile_condition(const char *text, struct predicate *predicate) {
+  char spaced[256];
+  char *tokens[32];
+  int count = 0;
+  size_t used = 0;
+  bool in_operator = false;
+  for (const char *c = text; *c && used < sizeof(spaced) - 4; ++c) {
+    bool is_operator = strchr("=!<>&", *c) != NULL;
+    if (*c == ' ' || is_operator != in_operator) {
+      spaced[used++] = ' ';
+    }
+    if (*c != ' ') {
+      spaced[used++] = *c;
+    }
+    in_operator = is_operator;
+  }
+  spaced[used] = '\0';
+  for (char *token = strtok(spaced, " "); token && count < 32; token = strtok(NULL, " ")) {
+    // A single = compares too
+    tokens[count++] = strcmp(token, "=") == 0 ? "==" : token;
+  }
+  return count > 0 && parse_condition(tokens, count, predicate);
+}
+
+// Sets the condition a "run until" stops at
+bool set_until(const char *text) {
+  if (!compile_condition(text, &until_condition)) {
+    error("Bad condition, expected e.g. 'run until uir=0x1f' or 'run until ax == 3 && bx != 0'");
+    return false;
+  }
+  strncpy(until_text, text, sizeof(until_text) - 1);
+  until_text[sizeof(until_text) - 1] = '\0';
+  until_active = true;
+  return true;
+}
+
+void clear_until(void) {
+  until_active = false;
+}
+
+// -------------------
+// Checked execution
+// ------------------
+
+static void report_hit(const struct vm *vm, const struct breakpoint *breakpoint) {
+  char description[128];
+  describe(breakpoint, description, sizeof(description));
+  snprintf(hit_message, sizeof(hit_message), "Hit %s at tick %llu", description, (unsigned long long) vm->tick_count);
+  info(hit_message);
+  breakpoint_hit = true;
+  last_stop = breakpoint->kind == WATCH ? STOP_AFTER_TICK : STOP_BEFORE_TICK;
+  stopped_at = vm->tick_count;
+}
+
+const char *last_hit(void) {
+  return hit_message;
+}
+
+// Breakpoints that stop before the next microword runs
+static bool hit_before_tick(const struct vm *vm) {
+  unsigned index = eeprom_index(vm);
+  __uint32_t current_csip = csip(vm);
+  for (int i = 0; i < breakpoint_count; ++i) {
+    const struct breakpoint *breakpoint = &breakpoints[i];
+    bool matches = false;
+    if (breakpoint->kind == BREAK_MICROWORD) {
+      matches = breakpoint->index == index;
+    } else if (breakpoint->kind == BREAK_CSIP) {
+      matches = current_csip != last_csip && current_csip == ((__uint32_t) breakpoint->cs << 16 | breakpoint->ip);
+    }
+    if (matches && condition_holds(vm, &breakpoint->condition)) {
+      report_hit(vm, breakpoint);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Watchpoints and the "run until" condition, checked after each tick
+static bool hit_after_tick(const struct vm *vm) {
+  bool hit = false;
+  for (int i = 0; i < breakpoint_count; ++i) {
+    struct breakpoint *breakpoint = &breakpoints[i];
+    if (breakpoint->kind != WATCH) {
+      continue;
+    }
+    __uint16_t value = read_operand(vm, &breakpoint->watched);
+    if (value != breakpoint->last_value) {
+      breakpoint->last_value = value;
+      if (!hit && condition_holds(vm, &breakpoint->condition)) {
+        report_hit(vm, breakpoint);
+        hit = true;
+      }
+    }
+  }
+  if (!hit && until_active && condition_holds(vm, &until_condition)) {
+    snprintf(hit_message, sizeof(hit_message), "Reached %s at tick %llu", until_text,
+             (unsigned long long) vm->tick_count);
+    info(hit_message);
+    breakpoint_hit = true;
+    last_stop = STOP_AFTER_TICK;
+    stopped_at = vm->tick_count;
+    hit = true;
+  }
+  return hit;
+}
+
+// The debugging variant of run_ticks(): steps microword by microword and stops at the first
+// breakpoint or watchpoint that hits.
+void run_ticks_checked(struct vm *vm, __uint64_t ticks) {
+  __uint64_t end = vm->tick_count + ticks < vm->tick_count ? UINT64_MAX : vm->tick_count + ticks;
+  breakpoint_hit = false;
+  // Values may have changed outside of checked runs (single steps, loading a snapshot)
+  for (int i = 0; i < breakpoint_count; ++i) {
+    if (breakpoints[i].kind == WATCH) {
+      breakpoints[i].last_value = read_operand(vm, &breakpoints[i].watched);
+    }
+  }
+  // CS:IP may have moved outside of checked runs too, only a change from here on is an edge
+  last_csip = csip(vm);
+  // Only the tick a breakpoint stopped before is let through, and only once
+  bool resuming = last_stop == STOP_BEFORE_TICK && vm->tick_count == stopped_at;
+  last_stop = STOP_NONE;
+  while (vm->running && vm->tick_count < end) {
+    if (!resuming && hit_before_tick(vm)) {
+      return;
+    }
+    resuming = false;
+    last_csip = csip(vm);
+    step(vm);
+    if (hit_after_tick(vm)) {
+      return;
+    }
+  }
+}
@@ -0,0 +1,87 @@
+#include <stdbool.h>
+
+#ifndef VM_BREAKPOINTS_H
+#define VM_BREAKPOINTS_H
+
+#define MAX_BREAKPOINTS 32
+#define MAX_CONDITION_TERMS 4
+
+// Anything a condition or watchpoint can look at
+enum operand_kind {
+  OPERAND_REGISTER,
+  OPERAND_SEGMENT,
+  OPERAND_MAR,
+  OPERAND_BUS,
+  OPERAND_IR,
+  OPERAND_UIR,
+  OPERAND_UPC,
+  OPERAND_ALU_A,
+  OPERAND_ALU_B,
+  OPERAND_MEMORY,
+  OPERAND_FLAGS
+};
+
+struct operand {
+  __uint8_t kind;
+  __uint16_t arg; // Register/segment index or memory address
+};
+
+enum comparison {
+  CMP_EQ,
+  CMP_NE,
+  CMP_LT,
+  CMP_LE,
+  CMP_GT,
+  CMP_GE
+};
+
+// Conditions are compiled to a conjunction of "operand comparison constant" terms
+struct condition_term {
+  struct operand operand;
+  __uint8_t comparison;
+  __uint16_t value;
+};
+
+struct predicate {
+  int count;
+  struct condition_term terms[MAX_CONDITION_TERMS];
+};
+
+enum breakpoint_kind {
+  BREAK_MICROWORD, // Before the microword at an EEPROM index runs
+  BREAK_CSIP,      // When CS:IP becomes a guest address
+  WATCH            // After a tick that changed a value
+};
+
+struct breakpoint {
+  int id;
+  __uint8_t kind;
+  __uint16_t index;
+  __uint16_t cs;
+  __uint16_t ip;
+  struct operand watched;
+  __uint16_t last_value;
+  struct predicate condition;
+};
+
+extern int breakpoint_count;
+extern bool breakpoint_hit;
+extern bool until_active;
+
+void debug_command(const char *line);
+
+struct vm;
+
+bool compile_condition(const char *text, struct predicate *predicate);
+
+bool condition_holds(const struct vm *vm, const struct predicate *predicate);
+
+bool set_until(const char *text);
+
+void clear_until(void);
+
+const char *last_hit(void);
+
+void run_ticks_checked(struct vm *vm, __uint64_t ticks);
+
+#endif //VM_BREAKPOINTS_H
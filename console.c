@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "console.h"
+#include "printing.h"
+
+// Lines shown in the UI are cut to fit a message
+#define UI_LINE_LENGTH 120
+
+char console_buffer[CONSOLE_BUFFER_SIZE];
+size_t console_length;
+FILE *console_file;
+bool console_to_screen;
+
+static void console_write(struct vm *vm, __uint16_t offset, __uint16_t value) {
+  (void) vm;
+  if (offset == CONSOLE_DATA) {
+    console_put(value);
+  }
+}
+
+static __uint16_t console_read(struct vm *vm, __uint16_t offset) {
+  (void) vm;
+  return offset == CONSOLE_STATUS;
+}
+
+// Output goes to path, to stdout if path is NULL, or to the output window when there is a screen
+int console_attach(struct io_bus *bus, const char *path) {
+  struct io_device device = {"console", CONSOLE_BASE, CONSOLE_REGISTERS, console_read, console_write};
+  if (io_register(bus, &device) == EXIT_FAILURE) {
+    return EXIT_FAILURE;
+  }
+  if (path) {
+    console_file = fopen(path, "w");
+    if (console_file == NULL) {
+      printf("Could not open console file %s\n", path);
+      return EXIT_FAILURE;
+    }
+  }
+  console_to_screen = path == NULL;
+  bus->out = console_put;
+  return EXIT_SUCCESS;
+}
+
+void console_put(__uint16_t value) {
+  console_buffer[console_length++] = (char) value;
+  if (console_length == CONSOLE_BUFFER_SIZE) {
+    console_flush(true);
+  }
+}
+
+// Prints the buffered output through info(), one message per line
+static size_t flush_to_screen(bool partial_line) {
+  size_t done = 0;
+  char line[UI_LINE_LENGTH + 1];
+  while (done < console_length) {
+    char *newline = memchr(console_buffer + done, '\n', console_length - done);
+    if (newline == NULL && !partial_line) {
+      break;
+    }
+    size_t length = newline ? (size_t) (newline - (console_buffer + done)) : console_length - done;
+    size_t shown = length < UI_LINE_LENGTH ? length : UI_LINE_LENGTH;
+    memcpy(line, console_buffer + done, shown);
+    line[shown] = '\0';
+    info(line);
+    done += length + (newline ? 1 : 0);
+  }
+  return done;
+}
+
+// Writes out everything up to the last newline, or everything if partial_line is set. The UI
+// flushes once per batch of ticks, so output reaches the window at frame rate.
+void console_flush(bool partial_line) {
+  if (console_length == 0) {
+    return;
+  }
+  size_t done;
+  if (console_to_screen && screen_active) {
+    // A full buffer without a newline has to go out anyway
+    done = flush_to_screen(partial_line || console_length == CONSOLE_BUFFER_SIZE);
+  } else {
+    FILE *out = console_file ? console_file : stdout;
+    done = fwrite(console_buffer, 1, console_length, out);
+    fflush(out);
+  }
+  memmove(console_buffer, console_buffer + done, console_length - done);
+  console_length -= done;
+}
+
+void console_close(void) {
+  console_flush(true);
+  if (console_file) {
+    fclose(console_file);
+    console_file = NULL;
+  }
+}
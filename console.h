@@ -0,0 +1,26 @@
+#include <stdbool.h>
+#include "io.h"
+
+#ifndef VM_CONSOLE_H
+#define VM_CONSOLE_H
+
+// The console prints the low byte of everything written to it. It is the target of out W, and is
+// also mapped at CONSOLE_BASE: writing the data register prints, the status register reads 1 once
+// the console is ready.
+#define CONSOLE_BASE 0xFF00
+#define CONSOLE_DATA 0
+#define CONSOLE_STATUS 1
+#define CONSOLE_REGISTERS 2
+
+// Output is collected here and written in one go when it fills up or is flushed
+#define CONSOLE_BUFFER_SIZE (1 << 16)
+
+int console_attach(struct io_bus *bus, const char *path);
+
+void console_put(__uint16_t value);
+
+void console_flush(bool partial_line);
+
+void console_close(void);
+
+#endif //VM_CONSOLE_H
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "core.h"
+#include "main.h"
+#include "ring.h"
+#include "throttle.h"
+#include "snapshot.h"
+#include "printing.h"
+#include "trace.h"
+#include "breakpoints.h"
+#include "stats.h"
+#include "fastforward.h"
+#include "console.h"
+#include "history.h"
+
+// The core thread owns all machine state while it runs. The UI talks to it only through the
+// command queue and reads it only through the published triple buffer, so neither side ever
+// blocks the other.
+
+#define COMMAND_QUEUE_SIZE 64
+// How long the core sleeps between polls of the command queue while paused
+#define IDLE_POLL_NS 1000000L
+// Longest the core waits on the throttle before checking for commands again
+#define COMMAND_LATENCY 0.01
+// Records shown by a bare log command, and the most a single one will show
+#define DEFAULT_LOG_LENGTH 20
+#define MAX_LOG_LENGTH 512
+
+// Ticks between checks of the command queue in full speed runs
+#define FULL_SPEED_BATCH (1 << 20)
+
+struct core_command {
+  int code;
+  char arg[COMMAND_ARG_LENGTH];
+};
+
+// What the core is doing between commands
+struct core_state {
+  int mode;
+  struct throttle throttle;
+  __uint64_t ticks_left; // Left in a counted run, 0 when the run isn't counted
+  bool full_speed;       // Ignores the clock rate
+  bool exiting;
+};
+
+pthread_t core_thread;
+struct spsc_ring command_queue;
+bool core_fused;
+
+// Triple buffer: the core fills buffers[back] and swaps it into middle, the UI swaps middle into
+// front when it is fresh. Each side only ever touches the buffer it holds.
+#define BUFFER_INDEX 3
+#define BUFFER_FRESH 4
+struct published_state buffers[3];
+_Atomic int middle = 2;
+int back = 0;
+int front = 1;
+
+static void publish(int mode, const struct throttle *throttle) {
+  struct published_state *state = &buffers[back];
+  memcpy(state->registers, machine.registers, sizeof(state->registers));
+  memcpy(state->segments, machine.segments, sizeof(state->segments));
+  state->bus = machine.bus;
+  state->bus_floating = machine.bus_floating;
+  state->u_program_counter = machine.u_program_counter;
+  state->alu_a = machine.alu_a;
+  state->alu_b = machine.alu_b;
+  state->flags = read_flags(&machine);
+  state->control_bits = machine.microcode->words[eeprom_index(&machine)];
+  state->mar = machine.mar;
+  state->instruction_register = machine.instruction_register;
+  state->u_instruction_register = machine.u_instruction_register;
+  state->tick_count = machine.tick_count;
+  state->running = machine.running;
+  state->clock_rate = throttle->rate;
+  state->achieved_rate = mode == CONTINUOUS ? throttle->achieved_rate : 0;
+  back = atomic_exchange(&middle, back | BUFFER_FRESH) & BUFFER_INDEX;
+}
+
+// Returns false if nothing new was published since the last call
+bool core_latest_state(struct published_state *state) {
+  if ((atomic_load(&middle) & BUFFER_FRESH) == 0) {
+    return false;
+  }
+  front = atomic_exchange(&middle, front) & BUFFER_INDEX;
+  *state = buffers[front];
+  return true;
+}
+
+bool core_send(int code, const char *arg) {
+  struct core_command command;
+  command.code = code;
+  strncpy(command.arg, arg ? arg : "", COMMAND_ARG_LENGTH - 1);
+  command.arg[COMMAND_ARG_LENGTH - 1] = '\0';
+  return ring_push(&command_queue, &command);
+}
+
+// ff toggles, ff on/off sets. The log only records microcode-level ticks, so tracing stops while
+// fast-forward is on.
+static void set_fast_forward(const char *arg) {
+  bool on = strcmp(arg, "on") == 0 || (arg[0] == '\0' && !fast_forward);
+  if (on && trace_path) {
+    error("Fast-forward would leave holes in the trace file");
+    return;
+  }
+  fast_forward = on;
+  trace_enabled = !on;
+  info(on ? "Fast-forward on" : "Fast-forward off");
+}
+
+// Stops a run of any kind: plain, counted (step N) or conditional (run until)
+static void stop_running(struct core_state *core) {
+  core->mode = PAUSED;
+  core->ticks_left = 0;
+  core->full_speed = false;
+  clear_until();
+}
+
+// Counted and conditional runs go as fast as the host allows, checking for commands every
+// FULL_SPEED_BATCH ticks. Plain runs keep to the clock rate.
+static void start_running(struct core_state *core, __uint64_t ticks, bool full_speed) {
+  core->mode = CONTINUOUS;
+  core->ticks_left = ticks;
+  core->full_speed = full_speed;
+  throttle_start(&core->throttle, clock_rate);
+}
+
+// run, run until halt, run until COND
+static void run_command(struct core_state *core, const char *arg) {
+  clear_until();
+  if (arg[0] == '\0') {
+    start_running(core, 0, false);
+  } else if (strncmp(arg, "until ", 6) != 0) {
+    error("Usage: run [until halt|COND]");
+  } else if (strcmp(arg + 6, "halt") == 0 || set_until(arg + 6)) {
+    start_running(core, 0, true);
+  }
+}
+
+// step, step N. Single steps always go microword by microword.
+static void step_command(struct core_state *core, const char *arg) {
+  char *end;
+  __uint64_t count = arg[0] ? strtoull(arg, &end, 0) : 1;
+  if (arg[0] && (*end != '\0' || count == 0)) {
+    error("Usage: step [N]");
+    return;
+  }
+  stop_running(core);
+  if (count > 1) {
+    start_running(core, count, true);
+  } else if (machine.running) {
+    step(&machine);
+    log_trace(1);
+    console_flush(!machine.running);
+    if (!machine.running) {
+      flush_trace_once();
+    }
+  }
+}
+
+static void execute_command(struct core_state *core, const struct core_command *command) {
+  switch (command->code) {
+    case VM_EXIT:
+      core->exiting = true;
+      break;
+    case VM_RUN:
+      run_command(core, command->arg);
+      break;
+    case VM_PAUSE:
+      stop_running(core);
+      break;
+    case VM_STEP:
+      step_command(core, command->arg);
+      break;
+    case VM_SAVE:
+      if (save_snapshot(command->arg) == EXIT_SUCCESS) {
+        info("Snapshot saved");
+      }
+      break;
+    case VM_LOAD:
+      if (load_snapshot(command->arg) == EXIT_SUCCESS) {
+        history_reset(&machine);
+        info("Snapshot loaded");
+      }
+      break;
+    case VM_LOG: {
+      int count = command->arg[0] ? atoi(command->arg) : DEFAULT_LOG_LENGTH;
+      log_trace(count < 0 ? 0 : count > MAX_LOG_LENGTH ? MAX_LOG_LENGTH : count);
+      break;
+    }
+    case VM_STATS:
+      if (strcmp(command->arg, "reset") == 0) {
+        reset_stats();
+        info("Counters reset");
+      } else {
+        log_stats();
+      }
+      break;
+    case VM_DEBUG:
+      debug_command(command->arg);
+      break;
+    case VM_FAST_FORWARD:
+      set_fast_forward(command->arg);
+      break;
+    case VM_BACK:
+      stop_running(core);
+      history_command(&machine, command->arg);
+      break;
+    case VM_CLOCK:
+      clock_rate = strtod(command->arg, NULL);
+      if (clock_rate < 0) {
+        clock_rate = 0;
+      }
+      throttle_start(&core->throttle, clock_rate);
+      break;
+    default:
+      break;
+  }
+}
+
+// Runs one batch of a run in progress and stops it on halt, a breakpoint or the end of a count
+static void run_core_batch(struct core_state *core) {
+  __uint64_t before = machine.tick_count;
+  __uint64_t ticks = core->full_speed ? FULL_SPEED_BATCH : throttle_ticks_due(&core->throttle);
+  if (core->ticks_left != 0 && ticks > core->ticks_left) {
+    ticks = core->ticks_left;
+  }
+  run_ticks(&machine, ticks, core_fused);
+  __uint64_t done = machine.tick_count - before;
+  throttle_ticks_done(&core->throttle, done);
+  console_flush(!machine.running);
+  if (!machine.running) {
+    flush_trace_once();
+  }
+  bool counted_out = core->ticks_left != 0 && (core->ticks_left -= done) == 0;
+  if (breakpoint_hit || counted_out || !machine.running) {
+    breakpoint_hit = false;
+    stop_running(core);
+  }
+}
+
+static void *core_main(void *unused) {
+  (void) unused;
+  struct core_state core = {.mode = PAUSED};
+  throttle_start(&core.throttle, clock_rate);
+  history_reset(&machine);
+  publish(core.mode, &core.throttle);
+  while (!core.exiting) {
+    bool changed = false;
+    struct core_command command;
+    while (ring_pop(&command_queue, &command)) {
+      changed = true;
+      execute_command(&core, &command);
+    }
+
+    if (core.mode == CONTINUOUS && machine.running) {
+      bool full_speed = core.full_speed;
+      run_core_batch(&core);
+      publish(core.mode, &core.throttle);
+      if (!full_speed) {
+        throttle_wait(&core.throttle, COMMAND_LATENCY);
+      }
+    } else {
+      if (changed) {
+        publish(core.mode, &core.throttle);
+      }
+      struct timespec idle = {0, IDLE_POLL_NS};
+      nanosleep(&idle, NULL);
+    }
+  }
+  publish(core.mode, &core.throttle);
+  return NULL;
+}
+
+// Feeds the commands in path to the machine one line at a time on this thread, without curses.
+// Each command finishes before the next is read, so runs in scripts only end at halt, a
+// breakpoint, their count or condition, or max_ticks (0 = no limit). Blank lines and lines
+// starting with # are skipped.
+int run_script(const char *path, __uint64_t max_ticks, bool fused) {
+  FILE *script = fopen(path, "r");
+  if (script == NULL) {
+    printf("Could not open script %s\n", path);
+    return EXIT_FAILURE;
+  }
+  core_fused = fused;
+  struct core_state core = {.mode = PAUSED};
+  throttle_start(&core.throttle, clock_rate);
+  history_reset(&machine);
+  char line[COMMAND_ARG_LENGTH];
+  int line_number = 0;
+  while (!core.exiting && fgets(line, sizeof(line), script)) {
+    ++line_number;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    struct core_command command;
+    command.code = parse_command(line, command.arg);
+    if (command.code == 0) {
+      char message[COMMAND_ARG_LENGTH + 32];
+      snprintf(message, sizeof(message), "%s:%d: unknown command '%s'", path, line_number, line);
+      error(message);
+      continue;
+    }
+    execute_command(&core, &command);
+    while (core.mode == CONTINUOUS && machine.running) {
+      if (max_ticks != 0 && machine.tick_count >= max_ticks) {
+        info("Tick budget exhausted");
+        stop_running(&core);
+        break;
+      }
+      // Keep within max_ticks
+      if (max_ticks != 0 && (core.ticks_left == 0 || core.ticks_left > max_ticks - machine.tick_count)) {
+        core.ticks_left = max_ticks - machine.tick_count;
+      }
+      bool full_speed = core.full_speed;
+      run_core_batch(&core);
+      if (!full_speed) {
+        throttle_wait(&core.throttle, 1.0);
+      }
+    }
+    stop_running(&core);
+  }
+  fclose(script);
+  console_flush(true);
+  dump_machine(stdout, &machine);
+  printf("%s after %llu ticks\n", machine.running ? "Script ended" : "Halted",
+         (unsigned long long) machine.tick_count);
+  return errors_reported() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int start_core(bool fused) {
+  core_fused = fused;
+  if (ring_init(&command_queue, COMMAND_QUEUE_SIZE, sizeof(struct core_command)) == EXIT_FAILURE) {
+    return EXIT_FAILURE;
+  }
+  if (pthread_create(&core_thread, NULL, core_main, NULL) != 0) {
+    ring_destroy(&command_queue);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Asks the core to exit and waits for it. The machine state belongs to the caller again afterwards.
+void stop_core(void) {
+  while (!core_send(VM_EXIT, NULL)) {
+    struct timespec idle = {0, IDLE_POLL_NS};
+    nanosleep(&idle, NULL);
+  }
+  pthread_join(core_thread, NULL);
+  ring_destroy(&command_queue);
+}
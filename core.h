@@ -0,0 +1,38 @@
+#include <stdbool.h>
+
+#ifndef VM_CORE_H
+#define VM_CORE_H
+
+#define COMMAND_ARG_LENGTH 256
+
+// Everything the UI needs to draw a frame, published by the core thread after each batch
+struct published_state {
+  __uint16_t registers[8];
+  __uint16_t segments[4];
+  __uint16_t bus;
+  bool bus_floating;
+  __uint8_t u_program_counter;
+  __uint16_t alu_a;
+  __uint16_t alu_b;
+  __uint8_t flags;
+  __uint64_t control_bits;
+  __uint16_t mar;
+  __uint16_t instruction_register;
+  __uint8_t u_instruction_register;
+  __uint64_t tick_count;
+  bool running;
+  double clock_rate;
+  double achieved_rate;
+};
+
+int start_core(bool fused);
+
+void stop_core(void);
+
+bool core_send(int code, const char *arg);
+
+bool core_latest_state(struct published_state *state);
+
+int run_script(const char *path, __uint64_t max_ticks, bool fused);
+
+#endif //VM_CORE_H
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "eeprom.h"
+#include "microcode.h"
+
+const char EEPROM_HEADER[] = {0x37, 0x34, 0x6A, 0x75, 0x75, 0x78, 0x78, 0x78};
+const char EEPROM_FOOTER[] = {0x6C, 0x6D, 0x61, 0x6F, 0x66, 0x74, 0x65, 0x72};
+const char EEPROM_V2_MAGIC[] = {0x37, 0x34, 0x6A, 0x75, 0x75, 0x76, 0x32, 0x00};
+
+#define MICROWORD_BYTES (40 / 8)
+#define MICROWORD_MASK (((__uint64_t) 1 << 40) - 1)
+
+// Both image formats are little-endian and v2 images are used in place
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "EEPROM images require a little-endian host");
+_Static_assert(sizeof(struct eeprom_v2_header) == EEPROM_V2_HEADER_SIZE, "v2 header must keep words aligned");
+
+static __uint64_t load_le64(const unsigned char *p) {
+  __uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+int parseEEPROM(const unsigned char *eeprom_buffer, size_t buffer_size, __uint64_t eeprom[]) {
+  if (buffer_size < sizeof(EEPROM_HEADER) + sizeof(EEPROM_FOOTER) ||
+      memcmp(eeprom_buffer, EEPROM_HEADER, sizeof(EEPROM_HEADER)) != EXIT_SUCCESS) {
+    printf("Missing EEPROM header\n");
+    return EXIT_FAILURE;
+  }
+  size_t footer_start = buffer_size - 8;
+  if (memcmp(eeprom_buffer + footer_start, EEPROM_FOOTER, sizeof(EEPROM_FOOTER)) != EXIT_SUCCESS) {
+    printf("Missing EEPROM footer\n");
+    return EXIT_FAILURE;
+  }
+  size_t total_instructions = (buffer_size - 16) / MICROWORD_BYTES;
+  if (total_instructions != EEPROM_SIZE) {
+    printf("Wrong EEPROM size: %ld microwords\n", total_instructions);
+    return EXIT_FAILURE;
+  }
+  // Every 5 byte microword is followed by at least 3 more bytes (the footer at the end), so each one
+  // can be unpacked with a single unaligned 8 byte load and a mask.
+  const unsigned char *words = eeprom_buffer + sizeof(EEPROM_HEADER);
+  for (size_t i = 0; i < EEPROM_SIZE; ++i) {
+    eeprom[i] = load_le64(words + MICROWORD_BYTES * i) & MICROWORD_MASK;
+  }
+  return EXIT_SUCCESS;
+}
+
+__uint64_t eeprom_checksum(const __uint64_t words[], size_t count) {
+  // FNV-1a over the words
+  __uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < count; ++i) {
+    hash ^= words[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+static int check_v2(const unsigned char *buffer, size_t size) {
+  // Too short for the header means the fields below would be read past the mapping
+  if (size < EEPROM_V2_HEADER_SIZE) {
+    printf("Wrong v2 EEPROM size: %ld bytes\n", size);
+    return EXIT_FAILURE;
+  }
+  const struct eeprom_v2_header *header = (const struct eeprom_v2_header *) buffer;
+  if (header->version != EEPROM_V2_VERSION || header->word_count != EEPROM_SIZE) {
+    printf("Unsupported v2 EEPROM: version %u with %u microwords\n", header->version, header->word_count);
+    return EXIT_FAILURE;
+  }
+  if (size != EEPROM_V2_HEADER_SIZE + EEPROM_SIZE * sizeof(__uint64_t)) {
+    printf("Wrong v2 EEPROM size: %ld bytes\n", size);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int load_eeprom(const char *path, __uint64_t storage[], const __uint64_t **words) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Could not open EEPROM file %s\n", path);
+    return EXIT_FAILURE;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(EEPROM_V2_MAGIC)) {
+    printf("Could not read EEPROM file %s\n", path);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  size_t size = (size_t) st.st_size;
+  unsigned char *buffer = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buffer == MAP_FAILED) {
+    printf("Could not map EEPROM file %s\n", path);
+    return EXIT_FAILURE;
+  }
+
+  int result;
+  if (memcmp(buffer, EEPROM_V2_MAGIC, sizeof(EEPROM_V2_MAGIC)) == 0) {
+    result = check_v2(buffer, size);
+    const __uint64_t *mapped = (const __uint64_t *) (buffer + EEPROM_V2_HEADER_SIZE);
+    if (result == EXIT_SUCCESS &&
+        eeprom_checksum(mapped, EEPROM_SIZE) != ((const struct eeprom_v2_header *) buffer)->checksum) {
+      printf("EEPROM checksum mismatch\n");
+      result = EXIT_FAILURE;
+    }
+    if (result == EXIT_SUCCESS) {
+      // The mapping stays alive for the rest of the run and is used directly as the eeprom
+      *words = mapped;
+      return EXIT_SUCCESS;
+    }
+  } else {
+    result = parseEEPROM(buffer, size, storage);
+  }
+  munmap(buffer, size);
+  if (result == EXIT_SUCCESS) {
+    *words = storage;
+  }
+  return result;
+}
+
+int write_eeprom_v2(const char *path, const __uint64_t words[]) {
+  struct eeprom_v2_header header = {0};
+  memcpy(header.magic, EEPROM_V2_MAGIC, sizeof(EEPROM_V2_MAGIC));
+  header.version = EEPROM_V2_VERSION;
+  header.word_count = EEPROM_SIZE;
+  header.checksum = eeprom_checksum(words, EEPROM_SIZE);
+
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    printf("Could not open %s for writing\n", path);
+    return EXIT_FAILURE;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+            fwrite(words, sizeof(__uint64_t), EEPROM_SIZE, out) == EEPROM_SIZE;
+  if (fclose(out) != 0 || !ok) {
+    printf("Could not write %s\n", path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,27 @@
+#include <stdlib.h>
+
+#ifndef VM_EEPROM_H
+#define VM_EEPROM_H
+
+// v2 images store the microwords as aligned little-endian 64-bit words behind a fixed size header,
+// so they can be mapped and used as the eeprom without any parsing.
+#define EEPROM_V2_VERSION 2
+#define EEPROM_V2_HEADER_SIZE 64
+
+struct eeprom_v2_header {
+  char magic[8];
+  __uint32_t version;
+  __uint32_t word_count;
+  __uint64_t checksum;
+  __uint8_t reserved[EEPROM_V2_HEADER_SIZE - 24];
+};
+
+int parseEEPROM(const unsigned char *eeprom_buffer, size_t buffer_size, __uint64_t eeprom[]);
+
+int load_eeprom(const char *path, __uint64_t storage[], const __uint64_t **words);
+
+int write_eeprom_v2(const char *path, const __uint64_t words[]);
+
+__uint64_t eeprom_checksum(const __uint64_t words[], size_t count);
+
+#endif //VM_EEPROM_H
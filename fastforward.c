@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include "fastforward.h"
+#include "main.h"
+#include "stats.h"
+
+#define UPC_MASK 0x7F
+
+bool fast_forward;
+
+// State a block's steps can overwrite, as bits of a live set. Registers are picked through IR at
+// run time, so register writes are always kept.
+#define LIVE_ALU_A (1 << 0)
+#define LIVE_ALU_B (1 << 1)
+#define LIVE_MAR (1 << 2)
+#define LIVE_IR (1 << 3)
+#define LIVE_FLAGS (1 << 4)
+#define LIVE_SEGMENT(segment) (1 << (5 + (segment)))
+
+// Effects that latch the bus value
+#define LATCH_EFFECTS (EFFECT_MAR | EFFECT_SEGMENT | EFFECT_REG_SRC | EFFECT_REG_DST | EFFECT_ALU_A | EFFECT_ALU_B |\
+    EFFECT_IR)
+// Effects that read IR, as the uIR source or to pick a register
+#define IR_EFFECTS (EFFECT_DECODE | EFFECT_UIP | EFFECT_REG_SRC | EFFECT_REG_DST)
+
+static bool is_block_start(const struct fused_step fused[], unsigned index) {
+  return fused[index].length != 0 && ((index & UPC_MASK) == 0 || fused[index - 1].length <= 1);
+}
+
+// Memory can be a device's, and only fused blocks and step() know to stop for those
+static bool accesses_memory_anywhere(const struct fused_step *block, unsigned length) {
+  for (unsigned k = 0; k < length; ++k) {
+    if (accesses_memory(&block[k])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Drops the effect if what it writes is dead, and kills what it writes otherwise
+static void keep_if_live(struct fused_step *op, __uint16_t effect, unsigned state, unsigned *live) {
+  if ((op->effects & effect) == 0) {
+    return;
+  }
+  if (*live & state) {
+    *live &= ~state;
+  } else {
+    op->effects &= (__uint16_t) ~effect;
+  }
+}
+
+// Walks the block backwards from its last step, where everything is observable. Returns the
+// number of steps kept, which are written to out in execution order.
+static unsigned compile_block(const struct fused_step *block, unsigned length, struct fused_step *out) {
+  struct fused_step kept[UPC_MASK + 1];
+  unsigned count = 0;
+  unsigned live = ~0u;
+  for (unsigned k = length; k-- > 0;) {
+    struct fused_step op = block[k];
+    keep_if_live(&op, EFFECT_MAR, LIVE_MAR, &live);
+    keep_if_live(&op, EFFECT_SEGMENT, LIVE_SEGMENT(op.segment), &live);
+    keep_if_live(&op, EFFECT_ALU_A, LIVE_ALU_A, &live);
+    keep_if_live(&op, EFFECT_ALU_B, LIVE_ALU_B, &live);
+    keep_if_live(&op, EFFECT_IR, LIVE_IR, &live);
+    // Only the last flag W before anything reads the flags matters, and that is outside the block
+    keep_if_live(&op, EFFECT_FLAGS, LIVE_FLAGS, &live);
+    bool flags_from_bus = (op.effects & EFFECT_FLAGS) && (op.modifiers & MOD_FLAG_SEL_BUS);
+    if ((op.effects & EFFECT_FLAGS) && !flags_from_bus) {
+      live |= LIVE_ALU_A | LIVE_ALU_B;
+    }
+
+    // The last step's value stays on the bus, and an ALU with both shifts has to report its error
+    bool is_last = k == length - 1;
+    bool needs_value = (op.effects & LATCH_EFFECTS) || flags_from_bus || is_last ||
+                       (op.driver == DRIVE_ALU && (op.modifiers & (MOD_SHL | MOD_SHR)) == (MOD_SHL | MOD_SHR));
+    if (!needs_value) {
+      op.driver = DRIVE_NONE;
+    }
+    if (op.effects & IR_EFFECTS) {
+      live |= LIVE_IR;
+    }
+    switch (op.driver) {
+      case DRIVE_SEGMENT:
+        live |= LIVE_SEGMENT(op.segment);
+        break;
+      case DRIVE_REG_SRC:
+      case DRIVE_REG_DST:
+        live |= LIVE_IR;
+        break;
+      case DRIVE_ALU:
+        live |= LIVE_ALU_A | LIVE_ALU_B;
+        break;
+      default:
+        break;
+    }
+    if (op.driver != DRIVE_NONE || op.effects != 0 || is_last) {
+      op.length = 0;
+      kept[count++] = op;
+    }
+  }
+  for (unsigned i = 0; i < count; ++i) {
+    out[i] = kept[count - 1 - i];
+  }
+  return count;
+}
+
+// Block starts don't overlap the blocks before them, so all compiled steps fit in EEPROM_SIZE
+void build_instructions(struct microcode *microcode) {
+  unsigned used = 0;
+  for (unsigned index = 0; index < EEPROM_SIZE; ++index) {
+    struct ff_block *block = &microcode->blocks[index];
+    block->first = (__uint16_t) used;
+    block->count = 0;
+    if (is_block_start(microcode->fused, index) &&
+        !accesses_memory_anywhere(&microcode->fused[index], microcode->fused[index].length)) {
+      block->count = (__uint16_t) compile_block(&microcode->fused[index], microcode->fused[index].length,
+                                                &microcode->compiled[used]);
+      used += block->count;
+    }
+  }
+}
+
+// Runs compiled blocks until the instruction ends (uPC clear or halt), the next block doesn't fit
+// in budget ticks or the machine reaches a microword that has to be stepped. Returns false if it
+// didn't run anything.
+bool run_instruction(struct vm *vm, __uint64_t budget) {
+  const struct microcode *microcode = vm->microcode;
+  bool ran = false;
+  while (vm->running) {
+    unsigned index = eeprom_index(vm);
+    const struct ff_block *block = &microcode->blocks[index];
+    __uint16_t length = microcode->fused[index].length;
+    if (block->count == 0 || length > budget) {
+      break;
+    }
+    const struct fused_step *steps = &microcode->compiled[block->first];
+    replay_fused_steps(vm, steps, block->count);
+    if (stats_enabled) {
+      for (unsigned i = index; i < index + length; ++i) {
+        count_microword(i, microcode->fused[i].driver == DRIVE_NONE);
+      }
+    }
+    __uint16_t effects = steps[block->count - 1].effects;
+    if (effects & EFFECT_UPC_CLEAR) {
+      vm->u_program_counter = 1;
+    } else {
+      vm->u_program_counter = (__uint8_t) (vm->u_program_counter + length);
+    }
+    vm->tick_count += length;
+    budget -= length;
+    ran = true;
+    if (effects & (EFFECT_UPC_CLEAR | EFFECT_HALT)) {
+      break;
+    }
+  }
+  return ran;
+}
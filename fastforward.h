@@ -0,0 +1,30 @@
+#include <stdbool.h>
+#include "fused.h"
+
+#ifndef VM_FASTFORWARD_H
+#define VM_FASTFORWARD_H
+
+// Fast-forward runs the guest a macro-instruction at a time. Every fused block that can start an
+// instruction (uPC 0, or right after a block ends) is compiled once more at load time, keeping only
+// the steps whose results are still observable when the block ends: latches overwritten later in
+// the block and bus values nobody latches are dropped. The machine is exact at every block
+// boundary, so the microcode-level path can take over after any instruction.
+
+// Compiled steps of the block starting at an index. count is 0 if no block starts there.
+struct ff_block {
+  __uint16_t first;
+  __uint16_t count;
+};
+
+// Set by --fast-forward or the UI's ff command. run_ticks() only fast-forwards while nothing is
+// traced and no breakpoints are set.
+extern bool fast_forward;
+
+struct vm;
+struct microcode;
+
+void build_instructions(struct microcode *microcode);
+
+bool run_instruction(struct vm *vm, __uint64_t budget);
+
+#endif //VM_FASTFORWARD_H
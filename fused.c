@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include "fused.h"
+#include "main.h"
+#include "trace.h"
+#include "stats.h"
+#include "io.h"
+#include "interrupts.h"
+
+#define UPC_MASK 0x7F
+
+// Actions fused steps know how to replay. Anything else (flag R, jumps, interrupts, output) goes
+// through step(), and so do memory accesses that land on a device. flag W only records what the
+// ALU did, so it is as cheap as any other latch.
+#define FUSABLE_ACTIONS (action_bit(ACT_MEM_R) | action_bit(ACT_SEG_R) | action_bit(ACT_REG_R) |\
+    action_bit(ACT_ALU_RE) | action_bit(ACT_DECODE_R) | action_bit(ACT_UIP_W) | action_bit(ACT_MEM_W) |\
+    action_bit(ACT_MAR_W) | action_bit(ACT_SEG_W) | action_bit(ACT_FLAG_W) |\
+    action_bit(ACT_REG_W) | action_bit(ACT_ALU_A_W) | action_bit(ACT_ALU_B_W) | action_bit(ACT_UPC_CLEAR) |\
+    action_bit(ACT_IR_W) | action_bit(ACT_HALT))
+
+#define DRIVER_ACTIONS (action_bit(ACT_MEM_R) | action_bit(ACT_SEG_R) | action_bit(ACT_REG_R) | action_bit(ACT_ALU_RE))
+
+// Returns false if the microword has to be stepped, e.g. because it drives the bus twice.
+static bool fuse_microword(const struct u_op *op, struct fused_step *step) {
+  __uint32_t actions = op->actions;
+  if ((actions & ~FUSABLE_ACTIONS) != 0) {
+    return false;
+  }
+  __uint32_t drivers = actions & DRIVER_ACTIONS;
+  if ((drivers & (drivers - 1)) != 0) {
+    return false;
+  }
+  bool reg_src = (op->modifiers & MOD_REG_SRC) != 0;
+
+  step->driver = DRIVE_NONE;
+  if (actions & action_bit(ACT_MEM_R)) {
+    step->driver = DRIVE_MEMORY;
+  } else if (actions & action_bit(ACT_SEG_R)) {
+    step->driver = DRIVE_SEGMENT;
+  } else if (actions & action_bit(ACT_REG_R)) {
+    step->driver = reg_src ? DRIVE_REG_SRC : DRIVE_REG_DST;
+  } else if (actions & action_bit(ACT_ALU_RE)) {
+    step->driver = DRIVE_ALU;
+  }
+  step->segment = op->segment;
+  step->alu_operation = op->alu_operation;
+  step->modifiers = op->modifiers & (MOD_SHL | MOD_SHR | MOD_CIN | MOD_FLAG_SEL_BUS | MOD_ADDR_MODE);
+
+  __uint16_t effects = 0;
+  if (actions & action_bit(ACT_DECODE_R)) { effects |= EFFECT_DECODE; }
+  if (actions & action_bit(ACT_UIP_W)) { effects |= EFFECT_UIP; }
+  if (actions & action_bit(ACT_MEM_W)) { effects |= EFFECT_MEMORY; }
+  if (actions & action_bit(ACT_MAR_W)) { effects |= EFFECT_MAR; }
+  if (actions & action_bit(ACT_SEG_W)) { effects |= EFFECT_SEGMENT; }
+  if (actions & action_bit(ACT_REG_W)) { effects |= reg_src ? EFFECT_REG_SRC : EFFECT_REG_DST; }
+  if (actions & action_bit(ACT_FLAG_W)) { effects |= EFFECT_FLAGS; }
+  if (actions & action_bit(ACT_ALU_A_W)) { effects |= EFFECT_ALU_A; }
+  if (actions & action_bit(ACT_ALU_B_W)) { effects |= EFFECT_ALU_B; }
+  if (actions & action_bit(ACT_UPC_CLEAR)) { effects |= EFFECT_UPC_CLEAR; }
+  if (actions & action_bit(ACT_IR_W)) { effects |= EFFECT_IR; }
+  if (actions & action_bit(ACT_HALT)) { effects |= EFFECT_HALT; }
+  step->effects = effects;
+  return true;
+}
+
+void build_fused_blocks(struct microcode *microcode) {
+  const struct u_op *decoded = microcode->decoded;
+  struct fused_step *fused_steps = microcode->fused;
+  // Walk each opcode's sequence backwards so every step knows how far its block extends
+  for (int i = EEPROM_SIZE - 1; i >= 0; --i) {
+    struct fused_step *step = &fused_steps[i];
+    if (!fuse_microword(&decoded[i], step)) {
+      step->length = 0;
+      continue;
+    }
+    bool last_in_opcode = (i & UPC_MASK) == UPC_MASK;
+    if (last_in_opcode || (step->effects & EFFECT_BLOCK_END) || fused_steps[i + 1].length == 0) {
+      step->length = 1;
+    } else {
+      step->length = (__uint16_t) (fused_steps[i + 1].length + 1);
+    }
+  }
+}
+
+// address is where a memory step reads or writes, worked out before any of its effects
+static inline __uint16_t drive_value(struct vm *vm, const struct fused_step *step, __uint16_t address) {
+  switch (step->driver) {
+    case DRIVE_MEMORY:
+      return vm->memory[address];
+    case DRIVE_SEGMENT:
+      return vm->segments[step->segment];
+    case DRIVE_REG_SRC:
+      return vm->registers[ir_src_reg(vm)];
+    case DRIVE_REG_DST:
+      return vm->registers[ir_dst_reg(vm)];
+    case DRIVE_ALU:
+      return get_alu_result(vm, step->alu_operation, step->modifiers & MOD_SHL, step->modifiers & MOD_SHR,
+                            step->modifiers & MOD_CIN);
+    default:
+      return 0;
+  }
+}
+
+static inline void apply_effects(struct vm *vm, const struct fused_step *step, __uint16_t value,
+                                 __uint16_t address) {
+  __uint16_t effects = step->effects;
+  // Blocks stop at the next event and never acknowledge, so pending interrupts can't change in one
+  if (effects & EFFECT_DECODE) {
+    vm->u_instruction_register = vm->interrupts_pending ? INTERRUPT_UIR : (__uint8_t) (vm->instruction_register >> 11);
+  }
+  if (effects & EFFECT_UIP) { vm->u_instruction_register = (__uint8_t) (vm->instruction_register >> 10); }
+  if (effects & EFFECT_MEMORY) { vm->memory[address] = value; }
+  if (effects & EFFECT_MAR) { vm->mar = value; }
+  if (effects & EFFECT_SEGMENT) { write_segment(vm, step->segment, value); }
+  if (effects & EFFECT_REG_SRC) { vm->registers[ir_src_reg(vm)] = value; }
+  if (effects & EFFECT_REG_DST) { vm->registers[ir_dst_reg(vm)] = value; }
+  if (effects & EFFECT_FLAGS) {
+    if (step->modifiers & MOD_FLAG_SEL_BUS) {
+      write_flags(vm, value);
+    } else {
+      record_alu_flags(vm, step->alu_operation, step->modifiers);
+    }
+  }
+  if (effects & EFFECT_ALU_A) { vm->alu_a = value; }
+  if (effects & EFFECT_ALU_B) { vm->alu_b = value; }
+  if (effects & EFFECT_IR) { vm->instruction_register = value; }
+  if (effects & EFFECT_HALT) { vm->running = false; }
+}
+
+// Runs count steps back to back and leaves the last one's value on the bus. Nothing else is
+// updated, the caller accounts for uPC and ticks. Memory steps must not reach devices.
+void replay_fused_steps(struct vm *vm, const struct fused_step *steps, unsigned count) {
+  __uint16_t value = 0;
+  for (const struct fused_step *step = steps; step != steps + count; ++step) {
+    __uint16_t address = accesses_memory(step) ? memory_address(vm, step->modifiers, step->segment) : 0;
+    value = drive_value(vm, step, address);
+    if (step->effects != 0) {
+      apply_effects(vm, step, value, address);
+    }
+  }
+  vm->bus = value;
+  vm->bus_floating = steps[count - 1].driver == DRIVE_NONE;
+}
+
+// Runs the whole block starting at the current microword if it fits in budget ticks. Leaves the
+// machine exactly as the same number of step() calls would. Devices have to see the exact tick, so
+// the block stops short of a memory access that lands on one. Returns false if nothing ran.
+bool run_fused_block(struct vm *vm, __uint64_t budget) {
+  unsigned index = eeprom_index(vm);
+  const struct fused_step *first = &vm->microcode->fused[index];
+  const struct fused_step *step = first;
+  __uint16_t length = step->length;
+  if (length == 0 || length > budget) {
+    return false;
+  }
+  const struct fused_step *end = step + length;
+  const struct io_bus *io = vm->io;
+  bool tracing = trace_enabled;
+  bool counting = stats_enabled;
+  __uint64_t tick = vm->tick_count;
+  __uint16_t value = 0;
+  for (; step != end; ++step, ++index, ++tick) {
+    __uint16_t address = 0;
+    if (accesses_memory(step)) {
+      address = memory_address(vm, step->modifiers, step->segment);
+      if (io && io->pages[address >> IO_PAGE_SHIFT]) {
+        break;
+      }
+    }
+    if (tracing) {
+      trace_microword(tick, index, vm->microcode->decoded[index].actions, 0, true);
+    }
+    value = drive_value(vm, step, address);
+    if (tracing) {
+      trace_bus(value, step->driver == DRIVE_NONE);
+    }
+    if (counting) {
+      count_microword(index, step->driver == DRIVE_NONE);
+    }
+    if (step->effects != 0) {
+      apply_effects(vm, step, value, address);
+    }
+  }
+
+  __uint16_t done = (__uint16_t) (step - first);
+  if (done == 0) {
+    return false;
+  }
+  const struct fused_step *last = step - 1;
+  vm->bus = value;
+  vm->bus_floating = last->driver == DRIVE_NONE;
+  if (last->effects & EFFECT_UPC_CLEAR) {
+    vm->u_program_counter = 1;
+  } else {
+    vm->u_program_counter = (__uint8_t) (vm->u_program_counter + done);
+  }
+  vm->tick_count += done;
+  return true;
+}
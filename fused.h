@@ -0,0 +1,61 @@
+#include <stdbool.h>
+#include "microcode.h"
+
+#ifndef VM_FUSED_H
+#define VM_FUSED_H
+
+// A fused step is one microword with its bus transfer resolved at load time: at most one driver
+// and a set of effects that latch the driven value. Consecutive fusable microwords of the same
+// opcode form a block that runs as one macro-instruction, ending at the microword that clears uPC,
+// changes uIR or halts.
+enum fused_driver {
+  DRIVE_NONE,
+  DRIVE_SEGMENT,
+  DRIVE_REG_SRC,
+  DRIVE_REG_DST,
+  DRIVE_ALU,
+  DRIVE_MEMORY
+};
+
+// Effects, in the order tick() applies them
+#define EFFECT_DECODE (1 << 0)
+#define EFFECT_UIP (1 << 1)
+#define EFFECT_MEMORY (1 << 2)
+#define EFFECT_MAR (1 << 3)
+#define EFFECT_SEGMENT (1 << 4)
+#define EFFECT_REG_SRC (1 << 5)
+#define EFFECT_REG_DST (1 << 6)
+#define EFFECT_FLAGS (1 << 7)
+#define EFFECT_ALU_A (1 << 8)
+#define EFFECT_ALU_B (1 << 9)
+#define EFFECT_UPC_CLEAR (1 << 10)
+#define EFFECT_IR (1 << 11)
+#define EFFECT_HALT (1 << 12)
+
+// Effects that have to end a block
+#define EFFECT_BLOCK_END (EFFECT_DECODE | EFFECT_UIP | EFFECT_UPC_CLEAR | EFFECT_HALT)
+
+struct fused_step {
+  __uint8_t driver;
+  __uint8_t segment;
+  __uint8_t alu_operation;
+  // ALU, flag source and address mode bits of u_op.modifiers
+  __uint8_t modifiers;
+  __uint16_t effects;
+  // Microwords left in the block starting here, including this one. 0 if the microword can't be fused.
+  __uint16_t length;
+};
+
+// Steps that read or write memory, which have to be stepped when the address is a device's
+#define accesses_memory(step) ((step)->driver == DRIVE_MEMORY || ((step)->effects & EFFECT_MEMORY))
+
+struct vm;
+struct microcode;
+
+void build_fused_blocks(struct microcode *microcode);
+
+bool run_fused_block(struct vm *vm, __uint64_t budget);
+
+void replay_fused_steps(struct vm *vm, const struct fused_step *steps, unsigned count);
+
+#endif //VM_FUSED_H
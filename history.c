@@ -0,0 +1,369 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "history.h"
+#include "main.h"
+#include "printing.h"
+#include "breakpoints.h"
+
+// Time travel for the interactive machine. Every tick appends the architectural fields it changed
+// to a ring of deltas, and every interval ticks the whole state, memory included, is copied into a
+// checkpoint. Going back restores the newest checkpoint at or before the target and replays
+// deltas up to it, so nothing is executed again and devices see nothing. The ring and the
+// checkpoints are sized once from the window, older history is dropped as it fills.
+
+// Deltas allowed for per tick of the window. Most ticks change uPC, the bus and one or two more.
+#define DELTAS_PER_TICK 4
+// Every field a single tick can change, with memory, status and the end marker
+#define MAX_DELTAS_PER_TICK 16
+
+enum delta_field {
+  DELTA_REGISTER = 0,                       // + register index
+  DELTA_SEGMENT = DELTA_REGISTER + 8,       // + segment index
+  DELTA_ALU_A = DELTA_SEGMENT + 4,
+  DELTA_ALU_B,
+  DELTA_MAR,
+  DELTA_IR,
+  DELTA_UIR,
+  DELTA_BUS,    // address is bus_floating
+  DELTA_STATUS, // value is running | interrupts_pending << 8
+  DELTA_FLAGS,
+  DELTA_MEMORY, // address is the word written
+  DELTA_END     // Ends a tick, value is the new uPC
+};
+
+struct delta {
+  __uint8_t field;
+  __uint16_t address;
+  __uint16_t value;
+};
+
+// Everything a tick can change, except memory
+struct arch_state {
+  __uint16_t registers[8];
+  __uint16_t segments[4];
+  __uint16_t alu_a;
+  __uint16_t alu_b;
+  __uint16_t mar;
+  __uint16_t instruction_register;
+  __uint8_t u_instruction_register;
+  __uint8_t u_program_counter;
+  __uint16_t bus;
+  bool bus_floating;
+  bool running;
+  __uint8_t interrupts_pending;
+  // The lazy flags as they were, so recording can tell when flag W changed them
+  struct lazy_flags flags;
+  __uint64_t tick_count;
+};
+
+struct checkpoint {
+  struct arch_state state;
+  __uint16_t *memory;
+  // Position of the first delta recorded after it
+  __uint64_t first_delta;
+};
+
+bool history_enabled;
+__uint64_t checkpoint_interval;
+
+// Absolute positions, wrapped into the ring with delta_mask
+struct delta *deltas;
+__uint64_t delta_mask;
+__uint64_t next_delta;
+
+// A ring of checkpoints from oldest to newest
+struct checkpoint *checkpoints;
+int checkpoint_slots;
+int oldest_checkpoint;
+int checkpoint_count;
+
+// The state as of the last recorded tick, to find what the next one changed
+struct arch_state recorded;
+
+static struct checkpoint *checkpoint_at(int age) {
+  return &checkpoints[(oldest_checkpoint + age) % checkpoint_slots];
+}
+
+static void capture(const struct vm *vm, struct arch_state *state) {
+  memcpy(state->registers, vm->registers, sizeof(state->registers));
+  memcpy(state->segments, vm->segments, sizeof(state->segments));
+  state->alu_a = vm->alu_a;
+  state->alu_b = vm->alu_b;
+  state->mar = vm->mar;
+  state->instruction_register = vm->instruction_register;
+  state->u_instruction_register = vm->u_instruction_register;
+  state->u_program_counter = vm->u_program_counter;
+  state->bus = vm->bus;
+  state->bus_floating = vm->bus_floating;
+  state->running = vm->running;
+  state->interrupts_pending = vm->interrupts_pending;
+  state->flags = vm->flags;
+  state->tick_count = vm->tick_count;
+}
+
+static void restore(struct vm *vm, const struct checkpoint *checkpoint) {
+  const struct arch_state *state = &checkpoint->state;
+  memcpy(vm->registers, state->registers, sizeof(state->registers));
+  memcpy(vm->segments, state->segments, sizeof(state->segments));
+  refresh_segment_bases(vm);
+  vm->alu_a = state->alu_a;
+  vm->alu_b = state->alu_b;
+  vm->mar = state->mar;
+  vm->instruction_register = state->instruction_register;
+  vm->u_instruction_register = state->u_instruction_register;
+  vm->u_program_counter = state->u_program_counter;
+  vm->bus = state->bus;
+  vm->bus_floating = state->bus_floating;
+  vm->running = state->running;
+  vm->interrupts_pending = state->interrupts_pending;
+  vm->flags = state->flags;
+  vm->tick_count = state->tick_count;
+  memcpy(vm->memory, checkpoint->memory, MEMORY_SIZE * sizeof(__uint16_t));
+}
+
+static void drop_oldest_checkpoint(void) {
+  oldest_checkpoint = (oldest_checkpoint + 1) % checkpoint_slots;
+  --checkpoint_count;
+}
+
+static void take_checkpoint(const struct vm *vm) {
+  if (checkpoint_count == checkpoint_slots) {
+    drop_oldest_checkpoint();
+  }
+  struct checkpoint *checkpoint = checkpoint_at(checkpoint_count++);
+  capture(vm, &checkpoint->state);
+  memcpy(checkpoint->memory, vm->memory, MEMORY_SIZE * sizeof(__uint16_t));
+  checkpoint->first_delta = next_delta;
+}
+
+// The ring holds at least two intervals of deltas, so there is always a checkpoint left to drop
+static void push_delta(__uint8_t field, __uint16_t address, __uint16_t value) {
+  while (checkpoint_count > 1 && next_delta - checkpoint_at(0)->first_delta > delta_mask) {
+    drop_oldest_checkpoint();
+  }
+  struct delta *delta = &deltas[next_delta++ & delta_mask];
+  delta->field = field;
+  delta->address = address;
+  delta->value = value;
+}
+
+// Allocates room for window ticks of history. interval is clamped to the window.
+int history_start(__uint64_t window, __uint64_t interval) {
+  checkpoint_interval = interval < window ? interval : window;
+  checkpoint_slots = (int) (window / checkpoint_interval + 2);
+  __uint64_t wanted = window * DELTAS_PER_TICK;
+  if (wanted < 2 * checkpoint_interval * MAX_DELTAS_PER_TICK) {
+    wanted = 2 * checkpoint_interval * MAX_DELTAS_PER_TICK;
+  }
+  __uint64_t capacity = 1;
+  while (capacity < wanted) {
+    capacity <<= 1;
+  }
+  delta_mask = capacity - 1;
+  deltas = malloc(capacity * sizeof(struct delta));
+  checkpoints = calloc((size_t) checkpoint_slots, sizeof(struct checkpoint));
+  bool allocated = deltas != NULL && checkpoints != NULL;
+  for (int i = 0; allocated && i < checkpoint_slots; ++i) {
+    checkpoints[i].memory = malloc(MEMORY_SIZE * sizeof(__uint16_t));
+    allocated = checkpoints[i].memory != NULL;
+  }
+  if (!allocated) {
+    printf("Could not allocate %llu ticks of history\n", (unsigned long long) window);
+    return EXIT_FAILURE;
+  }
+  history_enabled = true;
+  return EXIT_SUCCESS;
+}
+
+// Forgets everything and starts over from the machine's current state, for when it was changed
+// outside of a tick
+void history_reset(const struct vm *vm) {
+  if (!history_enabled) {
+    return;
+  }
+  oldest_checkpoint = 0;
+  checkpoint_count = 0;
+  next_delta = 0;
+  take_checkpoint(vm);
+  capture(vm, &recorded);
+}
+
+void history_record_memory(__uint16_t address, __uint16_t value) {
+  push_delta(DELTA_MEMORY, address, value);
+}
+
+static inline void record_field(__uint8_t field, __uint16_t value, __uint16_t *last) {
+  if (value != *last) {
+    push_delta(field, 0, value);
+    *last = value;
+  }
+}
+
+// Called at the end of each step
+void history_record_tick(const struct vm *vm) {
+  for (int i = 0; i < 8; ++i) {
+    record_field((__uint8_t) (DELTA_REGISTER + i), vm->registers[i], &recorded.registers[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    record_field((__uint8_t) (DELTA_SEGMENT + i), vm->segments[i], &recorded.segments[i]);
+  }
+  record_field(DELTA_ALU_A, vm->alu_a, &recorded.alu_a);
+  record_field(DELTA_ALU_B, vm->alu_b, &recorded.alu_b);
+  record_field(DELTA_MAR, vm->mar, &recorded.mar);
+  record_field(DELTA_IR, vm->instruction_register, &recorded.instruction_register);
+  if (vm->u_instruction_register != recorded.u_instruction_register) {
+    push_delta(DELTA_UIR, 0, vm->u_instruction_register);
+    recorded.u_instruction_register = vm->u_instruction_register;
+  }
+  if (vm->bus != recorded.bus || vm->bus_floating != recorded.bus_floating) {
+    push_delta(DELTA_BUS, vm->bus_floating, vm->bus);
+    recorded.bus = vm->bus;
+    recorded.bus_floating = vm->bus_floating;
+  }
+  if (vm->running != recorded.running || vm->interrupts_pending != recorded.interrupts_pending) {
+    push_delta(DELTA_STATUS, 0, (__uint16_t) (vm->running | vm->interrupts_pending << 8));
+    recorded.running = vm->running;
+    recorded.interrupts_pending = vm->interrupts_pending;
+  }
+  // Deltas hold the flags worked out, which is only needed when a flag W changed what they record
+  if (memcmp(&vm->flags, &recorded.flags, sizeof(vm->flags)) != 0) {
+    __uint8_t value = peek_flags(vm);
+    if (value != (recorded.flags.pending ? alu_flags(&recorded.flags) : recorded.flags.value)) {
+      push_delta(DELTA_FLAGS, 0, value);
+    }
+    recorded.flags = vm->flags;
+  }
+  push_delta(DELTA_END, 0, vm->u_program_counter);
+  if (vm->tick_count - checkpoint_at(checkpoint_count - 1)->state.tick_count >= checkpoint_interval) {
+    take_checkpoint(vm);
+  }
+}
+
+static void apply_delta(struct vm *vm, const struct delta *delta) {
+  switch (delta->field) {
+    case DELTA_ALU_A:
+      vm->alu_a = delta->value;
+      break;
+    case DELTA_ALU_B:
+      vm->alu_b = delta->value;
+      break;
+    case DELTA_MAR:
+      vm->mar = delta->value;
+      break;
+    case DELTA_IR:
+      vm->instruction_register = delta->value;
+      break;
+    case DELTA_UIR:
+      vm->u_instruction_register = (__uint8_t) delta->value;
+      break;
+    case DELTA_BUS:
+      vm->bus = delta->value;
+      vm->bus_floating = delta->address;
+      break;
+    case DELTA_STATUS:
+      vm->running = delta->value & 1;
+      vm->interrupts_pending = (__uint8_t) (delta->value >> 8);
+      break;
+    case DELTA_FLAGS:
+      write_flags(vm, delta->value);
+      break;
+    case DELTA_MEMORY:
+      vm->memory[delta->address] = delta->value;
+      break;
+    case DELTA_END:
+      vm->u_program_counter = (__uint8_t) delta->value;
+      vm->tick_count++;
+      break;
+    default:
+      if (delta->field < DELTA_SEGMENT) {
+        vm->registers[delta->field - DELTA_REGISTER] = delta->value;
+      } else {
+        write_segment(vm, delta->field - DELTA_SEGMENT, delta->value);
+      }
+      break;
+  }
+}
+
+// Applies deltas from position on until the machine is at tick. Returns the position after them.
+static __uint64_t replay(struct vm *vm, __uint64_t position, __uint64_t tick) {
+  while (vm->tick_count < tick && position < next_delta) {
+    apply_delta(vm, &deltas[position++ & delta_mask]);
+  }
+  return position;
+}
+
+// Rebuilds the state at tick and forgets everything recorded after it
+static void travel_to(struct vm *vm, __uint64_t tick) {
+  int age = checkpoint_count - 1;
+  while (age > 0 && checkpoint_at(age)->state.tick_count > tick) {
+    --age;
+  }
+  const struct checkpoint *checkpoint = checkpoint_at(age);
+  restore(vm, checkpoint);
+  next_delta = replay(vm, checkpoint->first_delta, tick);
+  checkpoint_count = age + 1;
+  capture(vm, &recorded);
+}
+
+// Finds the last tick before now at which the condition held, newest interval first
+static void back_until(struct vm *vm, const char *text) {
+  struct predicate condition;
+  if (!compile_condition(text, &condition)) {
+    error("Bad condition, expected e.g. 'run back until uir=0x1f'");
+    return;
+  }
+  __uint64_t now = vm->tick_count;
+  __uint64_t found = UINT64_MAX;
+  for (int age = checkpoint_count - 1; age >= 0 && found == UINT64_MAX; --age) {
+    const struct checkpoint *checkpoint = checkpoint_at(age);
+    __uint64_t end = age + 1 < checkpoint_count ? checkpoint_at(age + 1)->state.tick_count : now;
+    __uint64_t position = checkpoint->first_delta;
+    restore(vm, checkpoint);
+    while (vm->tick_count < end && position < next_delta) {
+      if (condition_holds(vm, &condition)) {
+        found = vm->tick_count;
+      }
+      position = replay(vm, position, vm->tick_count + 1);
+    }
+  }
+  char message[160];
+  if (found == UINT64_MAX) {
+    travel_to(vm, now);
+    snprintf(message, sizeof(message), "%s never held since tick %llu", text,
+             (unsigned long long) checkpoint_at(0)->state.tick_count);
+    error(message);
+    return;
+  }
+  travel_to(vm, found);
+  snprintf(message, sizeof(message), "Back at tick %llu, where %s", (unsigned long long) found, text);
+  info(message);
+}
+
+// back [N], back until COND
+void history_command(struct vm *vm, const char *arg) {
+  if (!history_enabled) {
+    error("No history is recorded, start with --history TICKS");
+    return;
+  }
+  if (strncmp(arg, "until ", 6) == 0) {
+    back_until(vm, arg + 6);
+    return;
+  }
+  char *end;
+  __uint64_t count = arg[0] ? strtoull(arg, &end, 0) : 1;
+  if (arg[0] && *end != '\0') {
+    error("Usage: back [N] or run back until COND");
+    return;
+  }
+  char message[96];
+  __uint64_t first = checkpoint_at(0)->state.tick_count;
+  __uint64_t target = vm->tick_count - first < count ? first : vm->tick_count - count;
+  if (target == first && vm->tick_count - first < count) {
+    snprintf(message, sizeof(message), "History only reaches back to tick %llu", (unsigned long long) first);
+    info(message);
+  }
+  travel_to(vm, target);
+  snprintf(message, sizeof(message), "Back at tick %llu", (unsigned long long) target);
+  info(message);
+}
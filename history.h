@@ -0,0 +1,26 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifndef VM_HISTORY_H
+#define VM_HISTORY_H
+
+// Ticks between full checkpoints unless --checkpoint-interval says otherwise
+#define DEFAULT_CHECKPOINT_INTERVAL 65536
+
+// Set while the interactive machine's history is recorded. Like tracing it only applies to that
+// machine, and every tick has to be stepped for it.
+extern bool history_enabled;
+
+struct vm;
+
+int history_start(__uint64_t window, __uint64_t interval);
+
+void history_reset(const struct vm *vm);
+
+void history_record_memory(__uint16_t address, __uint16_t value);
+
+void history_record_tick(const struct vm *vm);
+
+void history_command(struct vm *vm, const char *arg);
+
+#endif //VM_HISTORY_H
@@ -0,0 +1,15 @@
+#include "interrupts.h"
+#include "main.h"
+
+void raise_interrupt(struct vm *vm, int line) {
+  vm->interrupts_pending |= (__uint8_t) (1 << line);
+}
+
+// The highest priority pending line, 0 if none is
+__uint16_t interrupt_vector(const struct vm *vm) {
+  return vm->interrupts_pending ? (__uint16_t) __builtin_ctz(vm->interrupts_pending) : 0;
+}
+
+void acknowledge_interrupt(struct vm *vm) {
+  vm->interrupts_pending &= (__uint8_t) (vm->interrupts_pending - 1);
+}
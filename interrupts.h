@@ -0,0 +1,21 @@
+#include <stdlib.h>
+
+#ifndef VM_INTERRUPTS_H
+#define VM_INTERRUPTS_H
+
+// Devices raise one of INTERRUPT_LINES lines, lower lines first. While any line is pending, decode R
+// loads INTERRUPT_UIR instead of the opcode. The microcode there reads the vector (the line number)
+// with int R, acknowledges it with inta and clears uPC, so the next decode continues the program.
+// decode R only reaches opcodes 0-31, so the entry sits just above them.
+#define INTERRUPT_LINES 8
+#define INTERRUPT_UIR 0x20
+
+struct vm;
+
+void raise_interrupt(struct vm *vm, int line);
+
+__uint16_t interrupt_vector(const struct vm *vm);
+
+void acknowledge_interrupt(struct vm *vm);
+
+#endif //VM_INTERRUPTS_H
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "io.h"
+
+struct io_bus io_bus;
+
+// Fails if the range wraps around the address space or overlaps another device
+int io_register(struct io_bus *bus, const struct io_device *device) {
+  unsigned end = (unsigned) device->base + device->size;
+  if (bus->device_count == MAX_IO_DEVICES || device->size == 0 || end > (1 << 16)) {
+    printf("Could not map device %s\n", device->name);
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < bus->device_count; ++i) {
+    const struct io_device *other = &bus->devices[i];
+    if (device->base < other->base + other->size && other->base < end) {
+      printf("Device %s overlaps %s\n", device->name, other->name);
+      return EXIT_FAILURE;
+    }
+  }
+  bus->devices[bus->device_count++] = *device;
+  for (unsigned page = device->base >> IO_PAGE_SHIFT; page <= (end - 1) >> IO_PAGE_SHIFT; ++page) {
+    bus->pages[page]++;
+  }
+  return EXIT_SUCCESS;
+}
+
+static const struct io_device *find_device(const struct io_bus *bus, __uint16_t address) {
+  for (int i = 0; i < bus->device_count; ++i) {
+    const struct io_device *device = &bus->devices[i];
+    if (address >= device->base && address - device->base < device->size) {
+      return device;
+    }
+  }
+  return NULL;
+}
+
+// Returns false if no device claims the address. Write-only devices read 0.
+bool io_read(const struct io_bus *bus, struct vm *vm, __uint16_t address, __uint16_t *value) {
+  const struct io_device *device = find_device(bus, address);
+  if (device == NULL) {
+    return false;
+  }
+  *value = device->read ? device->read(vm, (__uint16_t) (address - device->base)) : 0;
+  return true;
+}
+
+bool io_write(const struct io_bus *bus, struct vm *vm, __uint16_t address, __uint16_t value) {
+  const struct io_device *device = find_device(bus, address);
+  if (device == NULL) {
+    return false;
+  }
+  if (device->write) {
+    device->write(vm, (__uint16_t) (address - device->base), value);
+  }
+  return true;
+}
@@ -0,0 +1,42 @@
+#include <stdbool.h>
+
+#ifndef VM_IO_H
+#define VM_IO_H
+
+// Devices claim ranges of the memory address space. mem R and mem W go to the device that claims
+// MAR, everything else goes to memory. Pages tell the core which accesses can hit a device without
+// searching the device list.
+#define IO_PAGE_SHIFT 8
+#define IO_PAGES (1 << (16 - IO_PAGE_SHIFT))
+#define MAX_IO_DEVICES 8
+
+struct vm;
+
+struct io_device {
+  const char *name;
+  __uint16_t base;
+  __uint16_t size;
+  // Offsets are relative to base
+  __uint16_t (*read)(struct vm *vm, __uint16_t offset);
+  void (*write)(struct vm *vm, __uint16_t offset, __uint16_t value);
+};
+
+struct io_bus {
+  struct io_device devices[MAX_IO_DEVICES];
+  int device_count;
+  // Devices overlapping each page
+  __uint8_t pages[IO_PAGES];
+  // Where out W sends the bus, NULL to drop it
+  void (*out)(__uint16_t value);
+};
+
+// The interactive machine's devices
+extern struct io_bus io_bus;
+
+int io_register(struct io_bus *bus, const struct io_device *device);
+
+bool io_read(const struct io_bus *bus, struct vm *vm, __uint16_t address, __uint16_t *value);
+
+bool io_write(const struct io_bus *bus, struct vm *vm, __uint16_t address, __uint16_t value);
+
+#endif //VM_IO_H
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "lockstep.h"
+#include "fused.h"
+#include "memory_image.h"
+
+#define LANES LOCKSTEP_LANES
+#define blend(old, value, mask) (((old) & ~(mask)) | ((value) & (mask)))
+
+void lockstep_load(struct lockstep *lockstep, int lane, const struct vm *vm) {
+  for (int i = 0; i < 8; ++i) {
+    lockstep->registers[i][lane] = vm->registers[i];
+  }
+  for (int i = 0; i < 4; ++i) {
+    lockstep->segments[i][lane] = vm->segments[i];
+  }
+  lockstep->alu_a[lane] = vm->alu_a;
+  lockstep->alu_b[lane] = vm->alu_b;
+  lockstep->mar[lane] = vm->mar;
+  lockstep->instruction_register[lane] = vm->instruction_register;
+  lockstep->bus[lane] = vm->bus;
+  lockstep->bus_floating[lane] = vm->bus_floating ? 0xFFFF : 0;
+  lockstep->flags[lane] = vm->flags;
+  lockstep->u_instruction_register[lane] = vm->u_instruction_register;
+  lockstep->u_program_counter[lane] = vm->u_program_counter;
+  lockstep->tick_count[lane] = vm->tick_count;
+  lockstep->running[lane] = vm->running;
+  lockstep->errors[lane] = vm->errors;
+  lockstep->first_error[lane] = vm->first_error;
+  lockstep->memory[lane] = vm->memory;
+}
+
+// The lane as a quiet machine sharing the lockstep's microcode
+void lockstep_store(const struct lockstep *lockstep, int lane, struct vm *vm) {
+  for (int i = 0; i < 8; ++i) {
+    vm->registers[i] = lockstep->registers[i][lane];
+  }
+  for (int i = 0; i < 4; ++i) {
+    write_segment(vm, (unsigned) i, lockstep->segments[i][lane]);
+  }
+  vm->alu_a = lockstep->alu_a[lane];
+  vm->alu_b = lockstep->alu_b[lane];
+  vm->mar = lockstep->mar[lane];
+  vm->instruction_register = lockstep->instruction_register[lane];
+  vm->bus = lockstep->bus[lane];
+  vm->bus_floating = lockstep->bus_floating[lane] != 0;
+  vm->flags = lockstep->flags[lane];
+  vm->u_instruction_register = lockstep->u_instruction_register[lane];
+  vm->u_program_counter = lockstep->u_program_counter[lane];
+  vm->tick_count = lockstep->tick_count[lane];
+  vm->running = lockstep->running[lane];
+  vm->errors = lockstep->errors[lane];
+  vm->first_error = lockstep->first_error[lane];
+  vm->memory = lockstep->memory[lane];
+  vm->microcode = lockstep->microcode;
+  vm->io = NULL;
+  vm->scheduler = NULL;
+  vm->next_event = UINT64_MAX;
+  vm->interrupts_pending = 0;
+  vm->quiet = true;
+}
+
+// get_alu_result() for every lane at once. Vectors go by pointer, passing them by value depends on
+// which vector extensions the build enables.
+static void alu_lanes(const lane_word *alu_a, const lane_word *alu_b, __uint8_t operation, __uint8_t modifiers,
+                      lane_word *out) {
+  lane_word a = *alu_a;
+  lane_word b = *alu_b;
+  lane_word zero = {0};
+  lane_word result;
+  switch (operation) {
+    case 1:
+      result = a + ((lane_word) (b == zero) & 1);
+      break;
+    case 2:
+      result = ((lane_word) (a == zero) & 1) + b;
+      break;
+    case 3:
+      result = a + b;
+      break;
+    case 4:
+      result = a ^ b;
+      break;
+    case 5:
+      result = a | b;
+      break;
+    case 6:
+      result = a & b;
+      break;
+    case 7:
+      result = zero + 0xFFFF;
+      break;
+    default:
+      result = zero;
+      break;
+  }
+  if (modifiers & MOD_CIN) {
+    result += 1;
+  }
+  if (modifiers & MOD_SHL) {
+    result <<= 1;
+  }
+  if (modifiers & MOD_SHR) {
+    result >>= 1;
+  }
+  *out = result;
+}
+
+// Anything fused blocks can't replay goes through step() one lane at a time
+static void step_lane(struct lockstep *lockstep, int lane) {
+  struct vm vm;
+  lockstep_store(lockstep, lane, &vm);
+  step(&vm);
+  lockstep_load(lockstep, lane, &vm);
+}
+
+#define src_reg(lane) ((lockstep->instruction_register[lane] & 0x00E0) >> 5)
+#define dst_reg(lane) ((lockstep->instruction_register[lane] & 0x0700) >> 8)
+
+// Lanes replay fused steps with vector operations, except for ALU steps with both shifts set, which
+// step() has to report as errors
+#define needs_step(step) ((step)->length == 0 ||\
+    ((step)->driver == DRIVE_ALU && ((step)->modifiers & (MOD_SHL | MOD_SHR)) == (MOD_SHL | MOD_SHR)))
+
+// memory_address() for every lane. Lanes keep no segment bases, the shift is as cheap as a load.
+static void lane_addresses(const struct lockstep *lockstep, const struct fused_step *step, lane_word *out) {
+  switch ((step->modifiers & MOD_ADDR_MODE) >> MOD_ADDR_MODE_SHIFT) {
+    case ADDR_SEGMENT:
+      *out = (lockstep->segments[step->segment] << SEGMENT_SHIFT) + lockstep->mar;
+      break;
+    case ADDR_CODE:
+      *out = (lockstep->segments[SEGMENT_CS] << SEGMENT_SHIFT) + lockstep->segments[SEGMENT_IP];
+      break;
+    case ADDR_STACK:
+      *out = (lockstep->segments[SEGMENT_SS] << SEGMENT_SHIFT) + lockstep->registers[REGISTER_SP];
+      break;
+    default:
+      *out = lockstep->mar;
+      break;
+  }
+}
+
+// flag W for one lane, as apply_effects() does it
+static void record_lane_flags(struct lockstep *lockstep, const struct fused_step *step, int lane, __uint16_t value) {
+  struct lazy_flags *flags = &lockstep->flags[lane];
+  if (step->modifiers & MOD_FLAG_SEL_BUS) {
+    flags->value = (__uint8_t) (value & FLAGS_MASK);
+    flags->pending = false;
+  } else {
+    flags->alu_a = lockstep->alu_a[lane];
+    flags->alu_b = lockstep->alu_b[lane];
+    flags->operation = step->alu_operation;
+    flags->modifiers = step->modifiers & ALU_FLAG_MODIFIERS;
+    flags->pending = true;
+  }
+}
+
+// Runs one fused step on the lanes in mask, in the same order as run_fused_block(). uPC and the
+// tick count are left to the caller. Lanes have no devices, so memory is always plain memory.
+static void step_lanes(struct lockstep *lockstep, const struct fused_step *step, const lane_word *lanes_mask,
+                       const bool in_group[]) {
+  lane_word mask = *lanes_mask;
+  lane_word zero = {0};
+  lane_word value = zero;
+  lane_word address = zero;
+  if (accesses_memory(step)) {
+    lane_addresses(lockstep, step, &address);
+  }
+  switch (step->driver) {
+    case DRIVE_MEMORY:
+      for (int lane = 0; lane < lockstep->lanes; ++lane) {
+        if (in_group[lane]) {
+          value[lane] = lockstep->memory[lane][address[lane]];
+        }
+      }
+      break;
+    case DRIVE_SEGMENT:
+      value = lockstep->segments[step->segment];
+      break;
+    case DRIVE_REG_SRC:
+    case DRIVE_REG_DST:
+      // Each lane picks its register from its own IR
+      for (int lane = 0; lane < lockstep->lanes; ++lane) {
+        if (in_group[lane]) {
+          value[lane] = lockstep->registers[step->driver == DRIVE_REG_SRC ? src_reg(lane) : dst_reg(lane)][lane];
+        }
+      }
+      break;
+    case DRIVE_ALU:
+      alu_lanes(&lockstep->alu_a, &lockstep->alu_b, step->alu_operation, step->modifiers, &value);
+      break;
+    default:
+      break;
+  }
+  lockstep->bus = blend(lockstep->bus, value, mask);
+  lockstep->bus_floating = blend(lockstep->bus_floating, step->driver == DRIVE_NONE ? zero + 0xFFFF : zero, mask);
+
+  __uint16_t effects = step->effects;
+  if (effects &
+      (EFFECT_DECODE | EFFECT_UIP | EFFECT_MEMORY | EFFECT_REG_SRC | EFFECT_REG_DST | EFFECT_FLAGS | EFFECT_HALT)) {
+    for (int lane = 0; lane < lockstep->lanes; ++lane) {
+      if (!in_group[lane]) {
+        continue;
+      }
+      __uint16_t ir = lockstep->instruction_register[lane];
+      if (effects & EFFECT_DECODE) { lockstep->u_instruction_register[lane] = (__uint8_t) (ir >> 11); }
+      if (effects & EFFECT_UIP) { lockstep->u_instruction_register[lane] = (__uint8_t) (ir >> 10); }
+      if (effects & EFFECT_MEMORY) { lockstep->memory[lane][address[lane]] = value[lane]; }
+      if (effects & EFFECT_REG_SRC) { lockstep->registers[src_reg(lane)][lane] = value[lane]; }
+      if (effects & EFFECT_REG_DST) { lockstep->registers[dst_reg(lane)][lane] = value[lane]; }
+      if (effects & EFFECT_FLAGS) { record_lane_flags(lockstep, step, lane, value[lane]); }
+      if (effects & EFFECT_HALT) { lockstep->running[lane] = false; }
+    }
+  }
+  if (effects & EFFECT_MAR) { lockstep->mar = blend(lockstep->mar, value, mask); }
+  if (effects & EFFECT_SEGMENT) {
+    lockstep->segments[step->segment] = blend(lockstep->segments[step->segment], value, mask);
+  }
+  if (effects & EFFECT_ALU_A) { lockstep->alu_a = blend(lockstep->alu_a, value, mask); }
+  if (effects & EFFECT_ALU_B) { lockstep->alu_b = blend(lockstep->alu_b, value, mask); }
+  if (effects & EFFECT_IR) { lockstep->instruction_register = blend(lockstep->instruction_register, value, mask); }
+}
+
+// Runs every lane for up to ticks more clock ticks, stopping lanes early on halt. Each round runs
+// the fused block of the lane furthest behind, together with every other lane at the same microword.
+void run_lockstep(struct lockstep *lockstep, __uint64_t ticks) {
+  __uint64_t end[LANES];
+  for (int lane = 0; lane < lockstep->lanes; ++lane) {
+    __uint64_t tick = lockstep->tick_count[lane];
+    end[lane] = tick + ticks < tick ? UINT64_MAX : tick + ticks;
+  }
+  while (true) {
+    int leader = -1;
+    for (int lane = 0; lane < lockstep->lanes; ++lane) {
+      if (lockstep->running[lane] && lockstep->tick_count[lane] < end[lane] &&
+          (leader < 0 || lockstep->tick_count[lane] < lockstep->tick_count[leader])) {
+        leader = lane;
+      }
+    }
+    if (leader < 0) {
+      return;
+    }
+    unsigned index = lockstep->u_instruction_register[leader] << 7 | lockstep->u_program_counter[leader];
+    bool in_group[LANES] = {false};
+    lane_word mask = {0};
+    __uint64_t budget = UINT64_MAX;
+    for (int lane = 0; lane < lockstep->lanes; ++lane) {
+      in_group[lane] = lockstep->running[lane] && lockstep->tick_count[lane] < end[lane] &&
+                       (unsigned) (lockstep->u_instruction_register[lane] << 7 | lockstep->u_program_counter[lane]) ==
+                       index;
+      mask[lane] = in_group[lane] ? 0xFFFF : 0;
+      if (in_group[lane] && end[lane] - lockstep->tick_count[lane] < budget) {
+        budget = end[lane] - lockstep->tick_count[lane];
+      }
+    }
+
+    // As much of the block as every lane in the group has budget for
+    const struct fused_step *block = &lockstep->microcode->fused[index];
+    __uint64_t count = 0;
+    while (count < block->length && count < budget && !needs_step(&block[count])) {
+      ++count;
+    }
+    if (count == 0) {
+      for (int lane = 0; lane < lockstep->lanes; ++lane) {
+        if (in_group[lane]) {
+          step_lane(lockstep, lane);
+        }
+      }
+      continue;
+    }
+    for (__uint64_t i = 0; i < count; ++i) {
+      step_lanes(lockstep, &block[i], &mask, in_group);
+    }
+    bool cleared = (block[count - 1].effects & EFFECT_UPC_CLEAR) != 0;
+    for (int lane = 0; lane < lockstep->lanes; ++lane) {
+      if (in_group[lane]) {
+        lockstep->u_program_counter[lane] = cleared ? 1 : (__uint8_t) (lockstep->u_program_counter[lane] + count);
+        lockstep->tick_count[lane] += count;
+      }
+    }
+  }
+}
+
+// -------------------
+// Sweeps
+// ------------------
+
+static __uint64_t splitmix(__uint64_t *state) {
+  __uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Same fields randomize_registers() sets, reproducible from the seed and instance number
+static void randomize_instance(struct vm *vm, __uint64_t seed, unsigned instance) {
+  __uint64_t state = seed ^ ((__uint64_t) instance << 32);
+  for (int i = 0; i < 8; i++) {
+    vm->registers[i] = (__uint16_t) splitmix(&state);
+  }
+  for (int i = 0; i < 4; i++) {
+    vm->segments[i] = (__uint16_t) splitmix(&state);
+  }
+  vm->alu_a = (__uint16_t) splitmix(&state);
+  vm->alu_b = (__uint16_t) splitmix(&state);
+  vm->mar = (__uint16_t) splitmix(&state);
+  refresh_segment_bases(vm);
+}
+
+static void report_instance(unsigned instance, const struct vm *vm) {
+  printf("%u %s %llu", instance, vm->errors ? "error" : vm->running ? "budget" : "halted",
+         (unsigned long long) vm->tick_count);
+  for (int i = 0; i < 8; ++i) {
+    printf(" %04x", vm->registers[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    printf(" %04x", vm->segments[i]);
+  }
+  printf(" %04x %04x %04x %04x\n", vm->alu_a, vm->alu_b, vm->mar, vm->instruction_register);
+}
+
+// Runs count copies of the loaded microcode from randomized registers, LOCKSTEP_LANES at a time, or
+// one by one on the scalar core when lockstep is false. Prints one line per instance: number,
+// status, ticks, then the final registers, segments, A, B, MAR and IR.
+int run_sweep(unsigned count, __uint64_t seed, __uint64_t max_ticks, const char *memory_path, bool lockstep) {
+  struct timespec start, end;
+  struct vm instances[LANES];
+  unsigned halted = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned first = 0; first < count; first += LANES) {
+    int lanes = count - first < LANES ? (int) (count - first) : LANES;
+    for (int lane = 0; lane < lanes; ++lane) {
+      struct vm *vm = &instances[lane];
+      memset(vm, 0, sizeof(*vm));
+      vm->running = true;
+      vm->quiet = true;
+      vm->microcode = &loaded_microcode;
+      randomize_instance(vm, seed, first + lane);
+      // Every instance gets its own copy-on-write view of the image
+      if (load_memory_image(memory_path, &vm->memory) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+      }
+    }
+    __uint64_t budget = max_ticks == 0 ? UINT64_MAX : max_ticks;
+    if (lockstep) {
+      struct lockstep group = {.microcode = &loaded_microcode, .lanes = lanes};
+      for (int lane = 0; lane < lanes; ++lane) {
+        lockstep_load(&group, lane, &instances[lane]);
+      }
+      run_lockstep(&group, budget);
+      for (int lane = 0; lane < lanes; ++lane) {
+        lockstep_store(&group, lane, &instances[lane]);
+      }
+    } else {
+      for (int lane = 0; lane < lanes; ++lane) {
+        run_ticks(&instances[lane], budget, true);
+      }
+    }
+    for (int lane = 0; lane < lanes; ++lane) {
+      report_instance(first + lane, &instances[lane]);
+      halted += !instances[lane].running && instances[lane].errors == 0;
+      free_memory_image(instances[lane].memory);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1E9;
+  printf("%u of %u instances halted cleanly in %.6f s (%.0f instances/s, %s)\n", halted, count, elapsed,
+         elapsed > 0 ? count / elapsed : 0.0, lockstep ? "lockstep" : "scalar");
+  return halted == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,48 @@
+#include <stdbool.h>
+#include "main.h"
+
+#ifndef VM_LOCKSTEP_H
+#define VM_LOCKSTEP_H
+
+// Machines run side by side, one per vector lane. 8, 16 or 32.
+#ifndef LOCKSTEP_LANES
+#define LOCKSTEP_LANES 16
+#endif
+
+typedef __uint16_t lane_word __attribute__((vector_size(LOCKSTEP_LANES * sizeof(__uint16_t))));
+
+// Structure of arrays form of LOCKSTEP_LANES machines running the same microcode. Lanes at the same
+// microword execute it together with vector operations. Lanes whose path diverged wait until the
+// group they are in gets its turn.
+struct lockstep {
+  lane_word registers[8];
+  lane_word segments[4];
+  lane_word alu_a;
+  lane_word alu_b;
+  lane_word mar;
+  lane_word instruction_register;
+  lane_word bus;
+  lane_word bus_floating; // 0xFFFF in floating lanes
+  // Only microwords that go through step() touch the flags
+  struct lazy_flags flags[LOCKSTEP_LANES];
+  __uint8_t u_instruction_register[LOCKSTEP_LANES];
+  __uint8_t u_program_counter[LOCKSTEP_LANES];
+  __uint64_t tick_count[LOCKSTEP_LANES];
+  bool running[LOCKSTEP_LANES];
+  int errors[LOCKSTEP_LANES];
+  const char *first_error[LOCKSTEP_LANES];
+  __uint16_t *memory[LOCKSTEP_LANES];
+  const struct microcode *microcode;
+  // Lanes in use, the rest are left alone
+  int lanes;
+};
+
+void lockstep_load(struct lockstep *lockstep, int lane, const struct vm *vm);
+
+void lockstep_store(const struct lockstep *lockstep, int lane, struct vm *vm);
+
+void run_lockstep(struct lockstep *lockstep, __uint64_t ticks);
+
+int run_sweep(unsigned count, __uint64_t seed, __uint64_t max_ticks, const char *memory_path, bool lockstep);
+
+#endif //VM_LOCKSTEP_H
@@ -1,53 +1,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include "printing.h"
 #include <unistd.h>
 #include <math.h>
 #include <curses.h>
 #include <string.h>
+#include <getopt.h>
 #include "main.h"
+#include "microcode.h"
+#include "fused.h"
+#include "eeprom.h"
+#include "memory_image.h"
+#include "snapshot.h"
+#include "throttle.h"
+#include "core.h"
+#include "trace.h"
+#include "vcd.h"
+#include "breakpoints.h"
+#include "stats.h"
+#include "runner.h"
+#include "lockstep.h"
+#include "verify.h"
+#include "io.h"
+#include "console.h"
+#include "scheduler.h"
+#include "interrupts.h"
+#include "timer.h"
+#include "history.h"
+#include "aot.h"
 
-#define MEMORY_SIZE 1 << 16
-#define EEPROM_SIZE 1 << 13
 
 typedef uint8_t u_char;
 
-_Bool running = true;
+struct vm machine = {.running = true, .microcode = &loaded_microcode, .next_event = UINT64_MAX};
+struct microcode loaded_microcode;
 
-double clock_rate = 1;
-#define clock_period 1/clock_rate * 1E6
-#define print_state() print_registers(registers, segments, bus, bus_floating, u_program_counter, alu_a, alu_b,\
-current_uInstruction, mar, instruction_register, u_instruction_register)
+// Target clock rate in Hz, 0 runs unthrottled
+double clock_rate = 0;
+// The curses UI is redrawn at this rate
+#define FRAME_RATE 30
+#define FRAME_PERIOD (1.0 / FRAME_RATE)
+#define print_state() print_registers(machine.registers, machine.segments, machine.bus, machine.bus_floating,\
+machine.u_program_counter, machine.alu_a, machine.alu_b, peek_flags(&machine), current_uInstruction, machine.mar,\
+machine.instruction_register, machine.u_instruction_register)
 
-const char EEPROM_HEADER[] = {0x37, 0x34, 0x6A, 0x75, 0x75, 0x78, 0x78, 0x78};
-const char EEPROM_FOOTER[] = {0x6C, 0x6D, 0x61, 0x6F, 0x66, 0x74, 0x65, 0x72};
-
-// -------------------
-// Official Registers:
-// ------------------
-
-// AX, BX, CX, DX, SP, BP, SI, BI
-__uint16_t registers[8];
-
-// CS, IP, SS, DS
-__uint16_t segments[4];
-
-// -------------------
-// Hidden Registers:
-// ------------------
-
-// ALU registers
-__uint16_t alu_a;
-__uint16_t alu_b;
-
-__uint16_t mar;
-
-// Instruction Registers
-__uint16_t instruction_register;
-__uint8_t u_instruction_register;
-__uint8_t u_program_counter;
 //
 //// -------------------
 //// ALU Control Bits:
@@ -69,113 +68,98 @@ __uint8_t u_program_counter;
 //_Bool segment_enable;
 //_Bool segment_write;
 
-__uint16_t memory[MEMORY_SIZE];
-#define eeprom_index u_instruction_register << 7 | u_program_counter
-__uint64_t eeprom[EEPROM_SIZE];
-
 // -------------------
-// Bus
+// Instruction Fields
 // ------------------
-_Bool bus_floating;
-__uint16_t bus;
+#define current_uInstruction machine.microcode->words[eeprom_index(&machine)]
 
+// Errors of quiet machines are only counted, with the first one kept for reporting
+void vm_error(struct vm *vm, char *msg) {
+  if (vm->errors++ == 0) {
+    vm->first_error = msg;
+  }
+  if (!vm->quiet) {
+    error(msg);
+  }
+}
 
-// -------------------
-// Control Signal Masks
-// ------------------
-#define current_uInstruction eeprom[eeprom_index]
-#define ir_src_reg ((instruction_register & 0x00E0) >> 5)
-#define ir_dst_reg ((instruction_register & 0x0700) >> 8)
-
-#define neg_uIP_W ((__uint64_t) 1 << 0)
-#define neg_out_W ((__uint64_t) 1 << 1)
-#define neg_mem_R ((__uint64_t) 1 << 2)
-#define neg_mem_W ((__uint64_t) 1 << 3)
-#define neg_mar_W ((__uint64_t) 1 << 4)
-// 5: Empty
-#define neg_seg_en ((__uint64_t) 1 << 6)
-#define seg_W ((__uint64_t) 1 << 7)
-#define neg_reg_en ((__uint64_t) 1 << 8)
-#define reg_W ((__uint64_t) 1 << 9)
-#define neg_flag_W ((__uint64_t) 1 << 10)
-#define flag_sel_bus ((__uint64_t) 1 << 11)
-#define neg_flag_R ((__uint64_t) 1 << 12)
-
-#define neg_alu_b_W ((__uint64_t) 1 << 13)
-#define neg_alu_a_W ((__uint64_t) 1 << 14)
-#define shift_right ((__uint64_t) 1 << 15)
-#define shift_left ((__uint64_t) 1 << 16)
-#define alu_s ((__uint64_t) (1 << 17 | 1 << 18 | 1 << 19))
-#define neg_alu_re ((__uint64_t) 1 << 20)
-#define cin ((__uint64_t) 1 << 21)
-#define addr_mode ((__uint64_t) (1 << 22 | 1 << 23))
-#define reg_sel ((__uint64_t) 1 << 24)
-#define neg_jmp_re ((__uint64_t) 1 << 25)
-#define inta ((__uint64_t) 1 << 26)
-#define neg_int_re ((__uint64_t) 1 << 27)
-#define halt ((__uint64_t) 1 << 28)
-#define neg_decode_R (1 << 29)
-// 30: Empty
-#define neg_uPC_clear ((__uint64_t) 1 << 31)
-#define jsel ((__uint64_t) 1 << 32 | (__uint64_t) 1 << 33 | (__uint64_t) 1 << 34 | (__uint64_t) 1 << 35)
-#define seg_sel ((__uint64_t) 1 << 36 | (__uint64_t) 1 << 37)
-#define ir_W ((__uint64_t) 1 << 38)
-
-const __uint64_t do_nothing_bits =
-    neg_uIP_W + neg_out_W + neg_mem_R + neg_mem_W + neg_mar_W + neg_seg_en + neg_reg_en + neg_flag_W + neg_alu_b_W +
-    neg_alu_a_W + neg_alu_re + neg_jmp_re + neg_int_re + neg_decode_R + neg_uPC_clear;
-
-void empty_bus() {
-  bus_floating = true;
-  bus = 0;
+void empty_bus(struct vm *vm) {
+  vm->bus_floating = true;
+  vm->bus = 0;
 }
 
-void write_bus(__uint16_t val) {
-  if (bus_floating) {
-    bus = val;
-    bus_floating = false;
+void write_bus(struct vm *vm, __uint16_t val) {
+  if (vm->bus_floating) {
+    vm->bus = val;
+    vm->bus_floating = false;
   } else {
-    error("Bus written twice in same tick!");
+    vm_error(vm, "Bus written twice in same tick!");
   }
 }
 
-__uint16_t read_bus() {
-  if (bus_floating) {
+__uint16_t read_bus(struct vm *vm) {
+  if (vm->bus_floating) {
     return 0;
   } else {
-    return bus;
+    return vm->bus;
+  }
+}
+
+// Devices are only consulted for pages they overlap
+__uint16_t read_memory(struct vm *vm, __uint16_t address) {
+  __uint16_t value;
+  if (vm->io && vm->io->pages[address >> IO_PAGE_SHIFT] && io_read(vm->io, vm, address, &value)) {
+    return value;
+  }
+  return vm->memory[address];
+}
+
+void write_memory(struct vm *vm, __uint16_t address, __uint16_t value) {
+  if (vm->io && vm->io->pages[address >> IO_PAGE_SHIFT] && io_write(vm->io, vm, address, value)) {
+    return;
+  }
+  vm->memory[address] = value;
+  if (history_enabled) {
+    history_record_memory(address, value);
+  }
+}
+
+// For when segments were changed wholesale, like restoring a snapshot
+void refresh_segment_bases(struct vm *vm) {
+  for (unsigned i = 0; i < 4; ++i) {
+    write_segment(vm, i, vm->segments[i]);
   }
 }
 
-__uint16_t get_alu_result(u_char operation, bool shl, bool shr, bool carry) {
+__uint16_t get_alu_result(struct vm *vm, u_char operation, bool shl, bool shr, bool carry) {
   __uint16_t result = 0;
   switch (operation) {
     case 0:
       result = 0;
       break;
     case 1:
-      result = alu_a + !alu_b;
+      result = vm->alu_a + !vm->alu_b;
       break;
     case 2:
-      result = !alu_a + alu_b;
+      result = !vm->alu_a + vm->alu_b;
       break;
     case 3:
-      result = alu_a + alu_b;
+      result = vm->alu_a + vm->alu_b;
       break;
     case 4:
-      result = alu_a ^ alu_b;
+      result = vm->alu_a ^ vm->alu_b;
       break;
     case 5:
-      result = alu_a | alu_b;
+      result = vm->alu_a | vm->alu_b;
       break;
     case 6:
-      result = alu_a & alu_b;
+      result = vm->alu_a & vm->alu_b;
       break;
     case 7:
       result = 0xFFFF;
       break;
     default:
-      error("Expected operation to be between 0 and 7");
+      vm_error(vm, "Expected operation to be between 0 and 7");
       break;
   }
   if (carry) {
@@ -188,249 +172,699 @@ __uint16_t get_alu_result(u_char operation, bool shl, bool shr, bool carry) {
     result = result >> 1;
   }
   if (shl && shr) {
-    error("Both shift_left and shift_right set");
+    vm_error(vm, "Both shift_left and shift_right set");
   }
   return result;
 }
 
-void tick() {
-  char buf[256] = "Tick: ";
-  if ((neg_uIP_W & current_uInstruction) == 0) {
-    strcat(buf, "[write uIP]");
-    u_instruction_register = (__uint8_t) (instruction_register >> 10);
-  }
-  if ((neg_out_W & current_uInstruction) == 0) {
-  }
-  if ((neg_mem_W & current_uInstruction) == 0) {
-    // Something
-  }
-  if ((neg_mar_W & current_uInstruction) == 0) {
-    strcat(buf, "[mar W]");
-    mar = read_bus();
-  }
-  if ((neg_seg_en & current_uInstruction) == 0) {
-    int segment_index = (int) ((seg_sel & current_uInstruction) >> 36);
-    if (seg_W & current_uInstruction) {
-      segments[segment_index] = read_bus();
-    } else {
-      write_bus(segments[segment_index]);
-    }
-  }
-  // TODO: Check order of reg_sel
-  if ((neg_reg_en & current_uInstruction) == 0) {
-    if (reg_W & current_uInstruction) {
-      if ((reg_sel & current_uInstruction) != 0) {
-        registers[ir_src_reg] = read_bus();
-      } else {
-        registers[ir_dst_reg] = read_bus();
-      }
-    }
-  }
-  if ((neg_flag_W & current_uInstruction) == 0) {
-    // TODO: implement
-  }
-  if ((neg_alu_a_W & current_uInstruction) == 0) {
-    strcat(buf, "[ALU A W]");
-    alu_a = read_bus();
-  }
-  if ((neg_alu_b_W & current_uInstruction) == 0) {
-    strcat(buf, "[ALU B W]");
-    alu_b = read_bus();
-  }
-  if ((neg_uPC_clear & current_uInstruction) == 0) {
-    strcat(buf, "[PC CLR]");
-    u_program_counter = 0;
+// The flags for what get_alu_result() computes. Every operation is taken as x + y + carry in, with y
+// 0 for the ones that aren't additions, and carry and overflow come from that addition. A shift
+// then moves the bit it shifts out into carry.
+__uint8_t alu_flags(const struct lazy_flags *flags) {
+  __uint16_t a = flags->alu_a;
+  __uint16_t b = flags->alu_b;
+  __uint16_t x;
+  __uint16_t y = 0;
+  switch (flags->operation) {
+    case 0:
+      x = 0;
+      break;
+    case 1:
+      x = a;
+      y = !b;
+      break;
+    case 2:
+      x = !a;
+      y = b;
+      break;
+    case 3:
+      x = a;
+      y = b;
+      break;
+    case 4:
+      x = a ^ b;
+      break;
+    case 5:
+      x = a | b;
+      break;
+    case 6:
+      x = a & b;
+      break;
+    default:
+      x = 0xFFFF;
+      break;
   }
-  if (ir_W & current_uInstruction) {
-    strcat(buf, "[IR W]");
-    instruction_register = read_bus();
+  __uint32_t sum = (__uint32_t) x + y + ((flags->modifiers & MOD_CIN) != 0);
+  __uint16_t result = (__uint16_t) sum;
+  bool carry = (sum >> 16) != 0;
+  bool overflow = ((x ^ result) & (y ^ result) & 0x8000) != 0;
+  if (flags->modifiers & MOD_SHL) {
+    carry = (result >> 15) != 0;
+    result = (__uint16_t) (result << 1);
   }
-  if (halt & current_uInstruction) {
-    strcat(buf, "[Halt]");
-    running = false;
+  if (flags->modifiers & MOD_SHR) {
+    carry = (result & 1) != 0;
+    result = result >> 1;
   }
-  info(buf);
+  return (__uint8_t) ((carry ? FLAG_CARRY : 0) | (result == 0 ? FLAG_ZERO : 0) | (result & 0x8000 ? FLAG_SIGN : 0) |
+                      (overflow ? FLAG_OVERFLOW : 0));
 }
 
-void non_tick() {
-  char buf[256] = "Non Clocked: ";
-  if ((neg_mem_R & current_uInstruction) == 0) {
-    // TODO: fill in
+bool jump_taken(__uint8_t flags, __uint8_t condition) {
+  bool carry = flags & FLAG_CARRY;
+  bool zero = flags & FLAG_ZERO;
+  bool less = ((flags & FLAG_SIGN) != 0) != ((flags & FLAG_OVERFLOW) != 0);
+  bool holds;
+  switch (condition & (JUMP_NEGATE - 1)) {
+    case JUMP_CARRY:
+      holds = carry;
+      break;
+    case JUMP_ZERO:
+      holds = zero;
+      break;
+    case JUMP_SIGN:
+      holds = flags & FLAG_SIGN;
+      break;
+    case JUMP_OVERFLOW:
+      holds = flags & FLAG_OVERFLOW;
+      break;
+    case JUMP_BELOW_OR_EQUAL:
+      holds = carry || zero;
+      break;
+    case JUMP_LESS:
+      holds = less;
+      break;
+    case JUMP_LESS_OR_EQUAL:
+      holds = less || zero;
+      break;
+    default:
+      holds = true;
+      break;
   }
-  if ((neg_seg_en & current_uInstruction) == 0) {
-    int segment_index = (int) ((seg_sel & current_uInstruction) >> 36);
-    if (!(seg_W & current_uInstruction)) {
-      write_bus(segments[segment_index]);
+  return condition & JUMP_NEGATE ? !holds : holds;
+}
+
+void tick(struct vm *vm, const struct u_op *op) {
+  __uint32_t pending = op->actions & CLOCKED_ACTIONS;
+  while (pending) {
+    enum u_action action = (enum u_action) __builtin_ctz(pending);
+    pending &= pending - 1;
+    switch (action) {
+      case ACT_UIP_W:
+        vm->u_instruction_register = (__uint8_t) (vm->instruction_register >> 10);
+        break;
+      case ACT_OUT_W:
+        if (vm->io && vm->io->out) {
+          vm->io->out(read_bus(vm));
+        }
+        break;
+      case ACT_MEM_W:
+        write_memory(vm, memory_address(vm, op->modifiers, op->segment), read_bus(vm));
+        break;
+      case ACT_MAR_W:
+        vm->mar = read_bus(vm);
+        break;
+      case ACT_SEG_W:
+        write_segment(vm, op->segment, read_bus(vm));
+        break;
+      case ACT_REG_W:
+        if (op->modifiers & MOD_REG_SRC) {
+          vm->registers[ir_src_reg(vm)] = read_bus(vm);
+        } else {
+          vm->registers[ir_dst_reg(vm)] = read_bus(vm);
+        }
+        break;
+      case ACT_FLAG_W:
+        if (op->modifiers & MOD_FLAG_SEL_BUS) {
+          write_flags(vm, read_bus(vm));
+        } else {
+          record_alu_flags(vm, op->alu_operation, op->modifiers);
+        }
+        break;
+      case ACT_ALU_A_W:
+        vm->alu_a = read_bus(vm);
+        break;
+      case ACT_ALU_B_W:
+        vm->alu_b = read_bus(vm);
+        break;
+      case ACT_UPC_CLEAR:
+        vm->u_program_counter = 0;
+        break;
+      case ACT_IR_W:
+        vm->instruction_register = read_bus(vm);
+        break;
+      case ACT_HALT:
+        vm->running = false;
+        break;
+      default:
+        break;
     }
   }
-  // TODO: Check order of reg_sel
-  if ((neg_reg_en & current_uInstruction) == 0) {
-    if (!(reg_W & current_uInstruction)) {
-      if ((reg_sel & current_uInstruction) != 0) {
-        write_bus(registers[ir_src_reg]);
-      } else {
-        write_bus(registers[ir_dst_reg]);
-      }
+}
+
+void non_tick(struct vm *vm, const struct u_op *op) {
+  __uint32_t pending = op->actions & UNCLOCKED_ACTIONS;
+  while (pending) {
+    enum u_action action = (enum u_action) __builtin_ctz(pending);
+    pending &= pending - 1;
+    switch (action) {
+      case ACT_MEM_R:
+        write_bus(vm, read_memory(vm, memory_address(vm, op->modifiers, op->segment)));
+        break;
+      case ACT_SEG_R:
+        write_bus(vm, vm->segments[op->segment]);
+        break;
+      case ACT_REG_R:
+        if (op->modifiers & MOD_REG_SRC) {
+          write_bus(vm, vm->registers[ir_src_reg(vm)]);
+        } else {
+          write_bus(vm, vm->registers[ir_dst_reg(vm)]);
+        }
+        break;
+      case ACT_FLAG_R:
+        write_bus(vm, read_flags(vm));
+        break;
+      case ACT_ALU_RE:
+        write_bus(vm, get_alu_result(vm, op->alu_operation, op->modifiers & MOD_SHL, op->modifiers & MOD_SHR,
+                                 op->modifiers & MOD_CIN));
+        break;
+      case ACT_JMP_RE:
+        // Skips the next microword, inverted_tick() still adds its one
+        if (jump_taken(read_flags(vm), op->jump_select)) {
+          vm->u_program_counter++;
+        }
+        break;
+      case ACT_INT_RE:
+        write_bus(vm, interrupt_vector(vm));
+        break;
+      case ACT_DECODE_R:
+        if (vm->interrupts_pending) {
+          vm->u_instruction_register = INTERRUPT_UIR;
+        } else {
+          vm->u_instruction_register = (__uint8_t) (vm->instruction_register >> 11);
+        }
+        break;
+      case ACT_INTA:
+        acknowledge_interrupt(vm);
+        break;
+      default:
+        break;
     }
   }
-  if ((neg_flag_R & current_uInstruction) == 0) {
-    // TODO: Check order of flags
-  }
-  if ((neg_alu_re & current_uInstruction) == 0) {
-    u_char alu_operation = (u_char) ((alu_s & current_uInstruction) >> 17);
-    bool shr = (bool) ((shift_left & current_uInstruction) >> 15);
-    bool shl = (bool) ((shift_left & current_uInstruction) >> 16);
-    bool carry_in = (bool) ((cin & current_uInstruction) >> 21);
-    write_bus(get_alu_result(alu_operation, shl, shr, carry_in));
+}
+
+void inverted_tick(struct vm *vm) {
+  vm->u_program_counter++;
+}
+
+void step(struct vm *vm) {
+  if (vm->tick_count >= vm->next_event) {
+    run_due_events(vm);
   }
-  if ((neg_jmp_re & current_uInstruction) == 0) {
-    // TODO: implement
+  // The microword is latched for the whole tick, even if decode_R changes uIR half way through
+  unsigned index = eeprom_index(vm);
+  const struct u_op *op = &vm->microcode->decoded[index];
+  empty_bus(vm);
+
+  if (trace_enabled) {
+    trace_microword(vm->tick_count, index, op->actions, 0, true);
+    non_tick(vm, op);
+    trace_bus(vm->bus, vm->bus_floating);
+  } else {
+    non_tick(vm, op);
   }
-  if ((neg_int_re & current_uInstruction) == 0) {
-    // TODO: implement
+  if (stats_enabled) {
+    count_microword(index, vm->bus_floating);
   }
-  if ((neg_decode_R & current_uInstruction) == 0) {
-    // TODO: add in interrupts
-    u_instruction_register = (__uint8_t) (instruction_register >> 11);
+  tick(vm, op);
+  inverted_tick(vm);
+  if (vcd_enabled) {
+    vcd_sample(vm, vm->microcode->words[index]);
   }
-  if (inta & current_uInstruction) {
-    // TODO: implement
+  vm->tick_count++;
+  if (history_enabled) {
+    history_record_tick(vm);
   }
-  info(buf);
-}
-
-void inverted_tick() {
-  u_program_counter++;
 }
 
 void randomize_registers() {
   char buf[50];
   srandom((unsigned int) time(NULL));
   for (int i = 0; i < 8; i++) {
-    registers[i] = (__uint16_t) random();
-    sprintf(buf, "reg %d: %x", i, registers[i]);
+    machine.registers[i] = (__uint16_t) random();
+    sprintf(buf, "reg %d: %x", i, machine.registers[i]);
     info(buf);
   }
   for (int i = 0; i < 4; i++) {
-    segments[i] = (__uint16_t) random();
-    sprintf(buf, "seg %d: %x", i, segments[i]);
+    machine.segments[i] = (__uint16_t) random();
+    sprintf(buf, "seg %d: %x", i, machine.segments[i]);
     info(buf);
   }
-  alu_a = (__uint16_t) random();
-  sprintf(buf, "a: %x", alu_a);
+  machine.alu_a = (__uint16_t) random();
+  sprintf(buf, "a: %x", machine.alu_a);
   info(buf);
-  alu_b = (__uint16_t) random();
-  sprintf(buf, "b: %x", alu_b);
+  machine.alu_b = (__uint16_t) random();
+  sprintf(buf, "b: %x", machine.alu_b);
   info(buf);
-  mar = (__uint16_t) random();
+  machine.mar = (__uint16_t) random();
+  refresh_segment_bases(&machine);
 
 //  instruction_register = (__uint16_t) random();
 //  u_instruction_register = (__uint8_t) random();
 }
 
 
-int parseEEPROM(unsigned char *eeprom_buffer, size_t buffer_size, __uint64_t eeprom[]) {
-  printf("%c %c %c %c %c %c %c %c %c %c\n", eeprom_buffer[0], eeprom_buffer[1], eeprom_buffer[2], eeprom_buffer[3],
-         eeprom_buffer[4], eeprom_buffer[5], eeprom_buffer[6], eeprom_buffer[7], eeprom_buffer[8], eeprom_buffer[9]);
-  if (memcmp(eeprom_buffer, EEPROM_HEADER, sizeof(EEPROM_HEADER)) != EXIT_SUCCESS) {
-    printf("Failed 1");
-    return EXIT_FAILURE;
+double elapsed_seconds(struct timespec *start, struct timespec *end) {
+  return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) / 1E9;
+}
+
+// Runs up to ticks clock ticks, stopping early on halt. Whole macro-instructions are executed as
+// fused blocks unless fused is false, or fast-forwarded if that is on and nothing is traced. While
+// breakpoints or a "run until" condition are set the checked loop runs instead. Recording history
+// takes every tick. vm_aot runs its compiled microcode instead of fused blocks when nothing is
+// instrumented.
+void run_ticks(struct vm *vm, __uint64_t ticks, bool fused) {
+  struct timespec start, end_time;
+  __uint64_t before = vm->tick_count;
+  fused = fused && !history_enabled;
+  if (stats_enabled) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+  }
+  if (breakpoint_count > 0 || until_active) {
+    run_ticks_checked(vm, ticks);
+#ifdef VM_AOT
+  } else if (fused && vm->microcode->aot && !trace_enabled && !stats_enabled) {
+    run_aot(vm, vm->tick_count + ticks < vm->tick_count ? UINT64_MAX : vm->tick_count + ticks);
+#endif
+  } else {
+    __uint64_t end = vm->tick_count + ticks < vm->tick_count ? UINT64_MAX : vm->tick_count + ticks;
+    bool skipping = fused && fast_forward && !trace_enabled;
+    while (vm->running && vm->tick_count < end) {
+      // Blocks stop short of the next event, which step() runs
+      __uint64_t limit = end < vm->next_event ? end : vm->next_event;
+      if (limit <= vm->tick_count) {
+        step(vm);
+        continue;
+      }
+      __uint64_t budget = limit - vm->tick_count;
+      if (skipping && run_instruction(vm, budget)) {
+        continue;
+      }
+      if (!fused || !run_fused_block(vm, budget)) {
+        step(vm);
+      }
+    }
   }
-  size_t footer_start = buffer_size - 8;
-  if (memcmp(eeprom_buffer + footer_start, EEPROM_FOOTER, sizeof(EEPROM_FOOTER)) != EXIT_SUCCESS) {
-    printf("Failed 2");
-    return EXIT_FAILURE;
+  if (stats_enabled) {
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    stats_host_time(vm->tick_count - before, elapsed_seconds(&start, &end_time));
   }
-  size_t total_instructions = (buffer_size - 16) / (40 / 8);
-  printf("eeprom size: %ld\n", total_instructions);
-  if (total_instructions != EEPROM_SIZE) {
-    printf("wrong size");
+}
+
+// Reads an EEPROM image and builds everything the core derives from it
+int load_microcode(const char *path, struct microcode *microcode) {
+  if (load_eeprom(path, microcode->storage, &microcode->words) == EXIT_FAILURE) {
     return EXIT_FAILURE;
   }
-//  for (int i = 0; i < EEPROM_SIZE; ++i) {
-  for (int i = 0; i < 5; ++i) {
-    __uint64_t acc = 0;
-    for (int j = 0; j < 5; ++j) {
-      acc += ((__uint64_t) eeprom_buffer[sizeof(EEPROM_HEADER) + 5 * i + j]) << (j * 8);
-//      printf("%lx\n", ((__uint64_t)eeprom_buffer[sizeof(EEPROM_HEADER) + 5*i + j]) << (j*8));
-//      printf("%x\n", eeprom_buffer[sizeof(EEPROM_HEADER) + 5 * i + j]);
+  decode_microcode(microcode->words, microcode->decoded, EEPROM_SIZE);
+  build_fused_blocks(microcode);
+  build_instructions(microcode);
+#ifdef VM_AOT
+  microcode->aot = eeprom_checksum(microcode->words, EEPROM_SIZE) == aot_checksum;
+#endif
+  return EXIT_SUCCESS;
+}
+
+void dump_machine(FILE *out, const struct vm *vm) {
+  dump_registers(out, vm->registers, vm->segments, vm->bus, vm->bus_floating, vm->u_program_counter, vm->alu_a,
+                 vm->alu_b, peek_flags(vm), vm->microcode->words[eeprom_index(vm)], vm->mar, vm->instruction_register,
+                 vm->u_instruction_register);
+}
+
+// Runs without curses until halt or until max_ticks have executed (0 = no limit), paced to
+// clock_rate if one is set.
+int run_headless(__uint64_t max_ticks, bool fused) {
+  struct timespec start, end;
+  struct throttle throttle;
+  throttle_start(&throttle, clock_rate);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (machine.running && (max_ticks == 0 || machine.tick_count < max_ticks)) {
+    __uint64_t budget = max_ticks == 0 ? UINT64_MAX : max_ticks - machine.tick_count;
+    if (throttle.rate > 0) {
+      __uint64_t due = throttle_ticks_due(&throttle);
+      if (due == 0) {
+        throttle_wait(&throttle, 1.0);
+        continue;
+      }
+      budget = due < budget ? due : budget;
     }
-//    printf("%lu\n", acc);
-//    printf("%lx\n", acc);
-    eeprom[i] = acc;
-//    printf("%04x: %lx\n", i, acc);
+    __uint64_t before = machine.tick_count;
+    run_ticks(&machine, budget, fused);
+    throttle_ticks_done(&throttle, machine.tick_count - before);
+    if (breakpoint_hit) {
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  // Guest output comes before the report
+  console_flush(true);
+
+  double elapsed = elapsed_seconds(&start, &end);
+  dump_machine(stdout, &machine);
+  if (breakpoint_hit) {
+    printf("%s\n", last_hit());
+  }
+  printf("%s after %llu ticks in %.6f s (%.0f ticks/s)\n",
+         breakpoint_hit ? "Stopped at breakpoint" : machine.running ? "Tick budget exhausted" : "Halted",
+         (unsigned long long) machine.tick_count, elapsed, elapsed > 0 ? (double) machine.tick_count / elapsed : 0.0);
+  if (stats_enabled) {
+    dump_stats(stdout);
+  }
+  if ((machine.running && !breakpoint_hit) || errors_reported() != 0) {
+    return EXIT_FAILURE;
   }
-  printf("Succeeded!\n");
   return EXIT_SUCCESS;
 }
 
+void usage(void) {
+  printf("Usage: ./vm [--headless] [--max-ticks N] [--no-fuse] [--fast-forward] [--clock-hz HZ] [--trace-file file]\n"
+         "          [--vcd file] [--break spec]... [--watch spec]... [--stats] [--console-file file]\n"
+         "          [--restore snapshot] [--save snapshot] [--script file] [--history TICKS]\n"
+         "          [--checkpoint-interval TICKS] EEPROM_file Memory_file\n");
+  printf("       ./vm --sweep N [--seed N] [--no-lockstep] [--max-ticks N] EEPROM_file Memory_file\n");
+  printf("       ./vm --batch jobs_file [--threads N] [--max-ticks N] [--no-fuse] [--fast-forward]\n");
+  printf("       ./vm --verify EEPROM_file [Memory_file]\n");
+  printf("       ./vm --convert-eeprom v2_file EEPROM_file\n");
+  printf("       ./vm --pack-memory sectioned_file Memory_file\n");
+}
+
+// vm_bench links this file for the core and brings its own main
+#ifndef VM_NO_MAIN
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    printf("Usage: ./vm EEPROM_file Memory_file\n");
+  static struct option long_options[] = {
+      {"headless", no_argument, NULL, 'H'},
+      {"max-ticks", required_argument, NULL, 'n'},
+      {"no-fuse", no_argument, NULL, 'F'},
+      {"fast-forward", no_argument, NULL, 'f'},
+      {"convert-eeprom", required_argument, NULL, 'C'},
+      {"pack-memory", required_argument, NULL, 'P'},
+      {"restore", required_argument, NULL, 'R'},
+      {"save", required_argument, NULL, 'S'},
+      {"clock-hz", required_argument, NULL, 'c'},
+      {"trace-file", required_argument, NULL, 't'},
+      {"vcd", required_argument, NULL, 'v'},
+      {"break", required_argument, NULL, 'b'},
+      {"watch", required_argument, NULL, 'w'},
+      {"stats", no_argument, NULL, 's'},
+      {"batch", required_argument, NULL, 'B'},
+      {"threads", required_argument, NULL, 'T'},
+      {"sweep", required_argument, NULL, 'W'},
+      {"seed", required_argument, NULL, 'x'},
+      {"no-lockstep", no_argument, NULL, 'L'},
+      {"verify", no_argument, NULL, 'V'},
+      {"console-file", required_argument, NULL, 'o'},
+      {"script", required_argument, NULL, 'X'},
+      {"history", required_argument, NULL, 'h'},
+      {"checkpoint-interval", required_argument, NULL, 'k'},
+      {NULL, 0, NULL, 0}
+  };
+  bool headless = false;
+  bool fused = true;
+  char *convert_path = NULL;
+  char *pack_path = NULL;
+  char *restore_path = NULL;
+  char *save_path = NULL;
+  char *trace_path = NULL;
+  char *vcd_path = NULL;
+  char *console_path = NULL;
+  char *script_path = NULL;
+  __uint64_t history_window = 0;
+  __uint64_t checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+  char *batch_path = NULL;
+  int threads = 0;
+  unsigned sweep_count = 0;
+  __uint64_t seed = 1;
+  bool lockstep = true;
+  bool verify = false;
+  char break_specs[MAX_BREAKPOINTS][256];
+  int break_spec_count = 0;
+  __uint64_t max_ticks = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'H':
+        headless = true;
+        break;
+      case 'n':
+        max_ticks = strtoull(optarg, NULL, 0);
+        break;
+      case 'F':
+        fused = false;
+        break;
+      case 'f':
+        fast_forward = true;
+        break;
+      case 'C':
+        convert_path = optarg;
+        break;
+      case 'P':
+        pack_path = optarg;
+        break;
+      case 'R':
+        restore_path = optarg;
+        break;
+      case 'S':
+        save_path = optarg;
+        break;
+      case 'c':
+        clock_rate = strtod(optarg, NULL);
+        break;
+      case 't':
+        trace_path = optarg;
+        break;
+      case 'v':
+        vcd_path = optarg;
+        break;
+      case 's':
+        stats_enabled = true;
+        break;
+      case 'B':
+        batch_path = optarg;
+        break;
+      case 'T':
+        threads = atoi(optarg);
+        break;
+      case 'W':
+        sweep_count = (unsigned) strtoul(optarg, NULL, 0);
+        break;
+      case 'x':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'L':
+        lockstep = false;
+        break;
+      case 'V':
+        verify = true;
+        break;
+      case 'o':
+        console_path = optarg;
+        break;
+      case 'X':
+        script_path = optarg;
+        break;
+      case 'h':
+        history_window = strtoull(optarg, NULL, 0);
+        break;
+      case 'k':
+        checkpoint_interval = strtoull(optarg, NULL, 0);
+        break;
+      case 'b':
+      case 'w':
+        if (break_spec_count < MAX_BREAKPOINTS) {
+          snprintf(break_specs[break_spec_count++], sizeof(break_specs[0]), "%s %s",
+                   opt == 'b' ? "break" : "watch", optarg);
+        }
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (batch_path) {
+    // Batch machines are quiet and uninstrumented, and each brings its own EEPROM and memory
+    if (argc != optind || trace_path || vcd_path || break_spec_count || stats_enabled || restore_path || save_path ||
+        history_window) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    return run_batch(batch_path, threads, max_ticks, fused);
+  }
+  bool verify_only = verify && argc - optind == 1;
+  if (argc - optind != (convert_path || pack_path || verify_only ? 1 : 2)) {
+    usage();
     return EXIT_FAILURE;
   }
-  FILE *eeprom_file;
-  unsigned char *eeprom_buffer;
-  eeprom_file = fopen(argv[1], "rb");
-  fseek(eeprom_file, 0, SEEK_END);
-  size_t eeprom_len = (size_t) ftell(eeprom_file);
-  rewind(eeprom_file);
-
-  eeprom_buffer = (unsigned char *) malloc((eeprom_len + 1) * sizeof(char));
-  fread(eeprom_buffer, eeprom_len, 1, eeprom_file);
-  fclose(eeprom_file);
-
-  if (parseEEPROM(eeprom_buffer, eeprom_len, eeprom) == EXIT_FAILURE) {
-    printf("EEPROM file provided was invalid.");
+  // Option combinations are checked before anything is loaded, so they fail with the usage alone.
+  // Sweep instances are quiet and uninstrumented like batch jobs.
+  if (sweep_count > 0 &&
+      (trace_path || vcd_path || break_spec_count || stats_enabled || restore_path || save_path || history_window)) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  // Fast-forwarded instructions aren't traced, a saved trace would have holes
+  if (fast_forward && trace_path) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  // Scripts run the UI's commands without the UI. History is only of use to their back command.
+  if ((script_path || history_window) && headless) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (history_window && checkpoint_interval == 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (pack_path) {
+    if (load_memory_image(argv[optind], &machine.memory) == EXIT_FAILURE) {
+      return EXIT_FAILURE;
+    }
+    return write_memory_image(pack_path, machine.memory);
+  }
+  if (load_microcode(argv[optind], &loaded_microcode) == EXIT_FAILURE) {
+    printf("EEPROM file provided was invalid.\n");
+    return EXIT_FAILURE;
+  }
+#ifdef VM_AOT
+  if (!loaded_microcode.aot) {
+    fprintf(stderr, "This vm_aot was built for a different EEPROM, interpreting it instead\n");
+  }
+#endif
+  // With a memory image the machine only starts if the microcode verifies
+  if (verify) {
+    int verified = verify_microcode(&loaded_microcode);
+    if (verify_only || verified == EXIT_FAILURE) {
+      return verified;
+    }
+  }
+  if (convert_path) {
+    return write_eeprom_v2(convert_path, loaded_microcode.words);
+  }
+  if (load_memory_image(argv[optind + 1], &machine.memory) == EXIT_FAILURE) {
+    printf("Memory file provided was invalid.\n");
+    return EXIT_FAILURE;
+  }
+  if (restore_path && load_snapshot(restore_path) == EXIT_FAILURE) {
+    return EXIT_FAILURE;
+  }
+  if (sweep_count > 0) {
+    return run_sweep(sweep_count, seed, max_ticks, argv[optind + 1], lockstep);
+  }
+  if (history_window && history_start(history_window, checkpoint_interval) == EXIT_FAILURE) {
+    return EXIT_FAILURE;
+  }
+  // The trace is always kept for the UI's log command, but only costs time headless if it is saved
+  trace_enabled = (!headless && !fast_forward) || trace_path;
+  stats_enabled = stats_enabled || !headless;
+  if (trace_path) {
+    set_trace_file(trace_path);
+    set_error_hook(flush_trace_once);
+  }
+  if (vcd_path) {
+    if (vcd_open(vcd_path) == EXIT_FAILURE) {
+      return EXIT_FAILURE;
+    }
+    // Waveforms need every tick sampled
+    fused = false;
+  }
+  // Without a file the console prints to stdout headless and to the output window otherwise
+  if (console_attach(&io_bus, console_path) == EXIT_FAILURE || timer_attach(&io_bus) == EXIT_FAILURE) {
+    return EXIT_FAILURE;
+  }
+  machine.io = &io_bus;
+  machine.scheduler = &scheduler;
+  for (int i = 0; i < break_spec_count; ++i) {
+    debug_command(break_specs[i]);
+  }
+  if (errors_reported() != 0) {
     return EXIT_FAILURE;
   }
 //  return EXIT_SUCCESS;
 
+  if (script_path) {
+    messages_to_stdout = true;
+    int result = run_script(script_path, max_ticks, fused);
+    flush_trace_once();
+    vcd_close();
+    console_close();
+    if (save_path && save_snapshot(save_path) == EXIT_FAILURE) {
+      return EXIT_FAILURE;
+    }
+    return result;
+  }
+
+  if (headless) {
+    // Registers start zeroed so that regression runs are reproducible
+    int result = run_headless(max_ticks, fused);
+    // Running out of ticks is a failure too, so keep the trace either way
+    flush_trace_once();
+    vcd_close();
+    console_close();
+    if (save_path && save_snapshot(save_path) == EXIT_FAILURE) {
+      return EXIT_FAILURE;
+    }
+    return result;
+  }
+
   init_screen();
 
 //  error(eeprom_filename);
-  randomize_registers();
+  if (!restore_path) {
+    randomize_registers();
+  }
 //  for (int i = 0; i < EEPROM_SIZE; ++i) {
 ////    sprintf(eeprom_filename, "At: %d", i);
 ////    error(eeprom_filename);
 //    eeprom[i] = do_nothing_bits;
 //  }
-  double last_time;
-  int mode = PAUSED;
-  while (running) {
-    last_time = (double) clock() / CLOCKS_PER_SEC;
-
+  if (start_core(fused) == EXIT_FAILURE) {
+    destroy_screen();
+    printf("Could not start the simulation thread\n");
+    return EXIT_FAILURE;
+  }
+  // The simulation runs on the core thread, this one only handles input and draws frames
+  struct published_state state;
+  bool halted = false;
+  while (!halted) {
     // Input
     int code = handle_keyboard();
     if (code == VM_EXIT) {
       break;
     }
-    if (code == VM_RUN) {
-      mode = CONTINUOUS;
-    }
-    if (code == VM_PAUSE) {
-      mode = PAUSED;
+    if (code != 0 && !core_send(code, command_argument())) {
+      error("Command queue full");
     }
 
-    if (code == VM_STEP || mode == CONTINUOUS) {
-      print_state();
-      // Debug
-
-      //
-      empty_bus();
-
-      non_tick();
-      tick();
-      inverted_tick();
-      double current_time = (double) clock() / CLOCKS_PER_SEC;
-      double elapsed_time = current_time - last_time;
-//      __useconds_t sleep_time = (__useconds_t)(clock_period - elapsed_time);
-//      sprintf(buf, "%f, %f, %f", current_time, elapsed_time, last_time);
-//      usleep(sleep_time);
+    flush_messages();
+    if (core_latest_state(&state)) {
+      print_registers(state.registers, state.segments, state.bus, state.bus_floating, state.u_program_counter,
+                      state.alu_a, state.alu_b, state.flags, state.control_bits, state.mar, state.instruction_register,
+                      state.u_instruction_register);
+      print_clock_rate(state.clock_rate, state.achieved_rate);
+      halted = !state.running;
     }
+    update_screen();
+    // A key press wakes the loop at once, otherwise frames come at FRAME_RATE
+    wait_for_input(FRAME_PERIOD);
   }
+  stop_core();
+  vcd_close();
+  console_close();
+  flush_messages();
+
   print_state();
-  if (!running) { // If halted, and not exit
+  update_screen();
+  if (!machine.running) { // If halted, and not exit
     info("HALTED MUDAFUCKA (press any key to exit)");
     while (1) {
       int key = getch();
@@ -439,7 +873,7 @@ int main(int argc, char *argv[]) {
       }
     }
   }
-  free(eeprom_buffer);
   destroy_screen();
   return 0;
 }
+#endif
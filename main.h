@@ -1,3 +1,9 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "microcode.h"
+#include "fused.h"
+#include "fastforward.h"
+
 #ifndef VM_MAIN_H
 #define VM_MAIN_H
 
@@ -5,8 +11,204 @@
 #define VM_STEP 2
 #define VM_RUN 3
 #define VM_PAUSE 4
+#define VM_SAVE 5
+#define VM_LOAD 6
+#define VM_CLOCK 7
+#define VM_LOG 8
+#define VM_DEBUG 9
+#define VM_STATS 10
+#define VM_FAST_FORWARD 11
+#define VM_BACK 12
 
 
 #define PAUSED 0
 #define CONTINUOUS 1
+
+#define MEMORY_SIZE (1 << 16)
+#define MEMORY_MASK (MEMORY_SIZE - 1)
+#define SEGMENT_SHIFT 4
+
+// Segments and registers that address modes use implicitly
+#define SEGMENT_CS 0
+#define SEGMENT_IP 1
+#define SEGMENT_SS 2
+#define REGISTER_SP 4
+
+// Flags register bits, in the order flag R puts them on the bus
+#define FLAG_CARRY (1 << 0)
+#define FLAG_ZERO (1 << 1)
+#define FLAG_SIGN (1 << 2)
+#define FLAG_OVERFLOW (1 << 3)
+#define FLAGS_MASK 0x000F
+// The ALU modifiers that change its flags
+#define ALU_FLAG_MODIFIERS (MOD_SHL | MOD_SHR | MOD_CIN)
+
+// What jsel tests when jmp_re is asserted. If it holds the next microword is skipped. Adding
+// JUMP_NEGATE tests the opposite, so JUMP_ALWAYS + JUMP_NEGATE never skips.
+enum jump_condition {
+  JUMP_ALWAYS,
+  JUMP_CARRY,
+  JUMP_ZERO,
+  JUMP_SIGN,
+  JUMP_OVERFLOW,
+  JUMP_BELOW_OR_EQUAL, // Carry or zero
+  JUMP_LESS,           // Sign differs from overflow
+  JUMP_LESS_OR_EQUAL,  // Less or zero
+  JUMP_NEGATE
+};
+
+#define eeprom_index(vm) ((vm)->u_instruction_register << 7 | (vm)->u_program_counter)
+#define ir_src_reg(vm) (((vm)->instruction_register & 0x00E0) >> 5)
+#define ir_dst_reg(vm) (((vm)->instruction_register & 0x0700) >> 8)
+
+// Everything derived from an EEPROM image. Read-only once loaded, so any number of machines can
+// share one.
+struct microcode {
+  // Points either at storage or straight into a mapped v2 image
+  const __uint64_t *words;
+  __uint64_t storage[EEPROM_SIZE];
+  struct u_op decoded[EEPROM_SIZE];
+  struct fused_step fused[EEPROM_SIZE];
+  // Fast-forward blocks by start index, and the compiled steps they point into
+  struct ff_block blocks[EEPROM_SIZE];
+  struct fused_step compiled[EEPROM_SIZE];
+  // Set in vm_aot when this is the image it was built for
+  bool aot;
+};
+
+struct io_bus;
+struct scheduler;
+
+// The flags register. Latching it from the ALU only records the operation and operands, the
+// flags are worked out from them when flag R or jmp_re first reads them. Most flag W microwords
+// are overwritten by the next one before anything looks.
+struct lazy_flags {
+  __uint16_t alu_a;
+  __uint16_t alu_b;
+  __uint8_t operation;
+  // ALU_FLAG_MODIFIERS of the microword
+  __uint8_t modifiers;
+  // Only valid when not pending
+  __uint8_t value;
+  _Bool pending;
+};
+
+// The state of one machine
+struct vm {
+  // AX, BX, CX, DX, SP, BP, SI, BI
+  __uint16_t registers[8];
+  // CS, IP, SS, DS
+  __uint16_t segments[4];
+  // segments << SEGMENT_SHIFT, kept up to date by write_segment() and refresh_segment_bases()
+  __uint16_t segment_bases[4];
+
+  // Hidden registers
+  __uint16_t alu_a;
+  __uint16_t alu_b;
+  __uint16_t mar;
+  __uint16_t instruction_register;
+  __uint8_t u_instruction_register;
+  __uint8_t u_program_counter;
+
+  _Bool bus_floating;
+  __uint16_t bus;
+  struct lazy_flags flags;
+
+  _Bool running;
+  // Clock ticks executed since reset
+  __uint64_t tick_count;
+
+  // MEMORY_SIZE words, mapped by load_memory_image()
+  __uint16_t *memory;
+  const struct microcode *microcode;
+  // Devices mapped into memory and the target of out W, NULL for none
+  const struct io_bus *io;
+  // Device events, NULL for none. next_event is the earliest one's tick, UINT64_MAX if there is
+  // none; 0 also works; the next step settles it.
+  struct scheduler *scheduler;
+  __uint64_t next_event;
+  // One bit per interrupt line
+  __uint8_t interrupts_pending;
+
+  // Quiet machines don't report errors through error(), they only count them and keep the first
+  _Bool quiet;
+  int errors;
+  const char *first_error;
+};
+
+// Segments are only written through here so their cached bases stay right
+static inline void write_segment(struct vm *vm, unsigned segment, __uint16_t value) {
+  vm->segments[segment] = value;
+  vm->segment_bases[segment] = (__uint16_t) (value << SEGMENT_SHIFT);
+}
+
+// Physical address of a mem R or mem W: a cached base plus an offset, wrapped to the memory size
+static inline __uint16_t memory_address(const struct vm *vm, __uint8_t modifiers, __uint8_t segment) {
+  switch ((modifiers & MOD_ADDR_MODE) >> MOD_ADDR_MODE_SHIFT) {
+    case ADDR_SEGMENT:
+      return (__uint16_t) ((vm->segment_bases[segment] + vm->mar) & MEMORY_MASK);
+    case ADDR_CODE:
+      return (__uint16_t) ((vm->segment_bases[SEGMENT_CS] + vm->segments[SEGMENT_IP]) & MEMORY_MASK);
+    case ADDR_STACK:
+      return (__uint16_t) ((vm->segment_bases[SEGMENT_SS] + vm->registers[REGISTER_SP]) & MEMORY_MASK);
+    default:
+      return vm->mar;
+  }
+}
+
+__uint8_t alu_flags(const struct lazy_flags *flags);
+
+// flag W from the ALU
+static inline void record_alu_flags(struct vm *vm, __uint8_t operation, __uint8_t modifiers) {
+  vm->flags.alu_a = vm->alu_a;
+  vm->flags.alu_b = vm->alu_b;
+  vm->flags.operation = operation;
+  vm->flags.modifiers = modifiers & ALU_FLAG_MODIFIERS;
+  vm->flags.pending = true;
+}
+
+// flag W from the bus
+static inline void write_flags(struct vm *vm, __uint16_t value) {
+  vm->flags.value = (__uint8_t) (value & FLAGS_MASK);
+  vm->flags.pending = false;
+}
+
+// The flags, worked out once and kept until the next flag W
+static inline __uint8_t read_flags(struct vm *vm) {
+  if (vm->flags.pending) {
+    vm->flags.value = alu_flags(&vm->flags);
+    vm->flags.pending = false;
+  }
+  return vm->flags.value;
+}
+
+// The flags without keeping them, for whoever only looks at a machine
+static inline __uint8_t peek_flags(const struct vm *vm) {
+  return vm->flags.pending ? alu_flags(&vm->flags) : vm->flags.value;
+}
+
+// The machine shown by the UI, defined in main.c
+extern struct vm machine;
+extern struct microcode loaded_microcode;
+extern double clock_rate;
+
+void vm_error(struct vm *vm, char *msg);
+
+__uint16_t get_alu_result(struct vm *vm, unsigned char operation, bool shl, bool shr, bool carry);
+
+bool jump_taken(__uint8_t flags, __uint8_t condition);
+
+__uint16_t read_memory(struct vm *vm, __uint16_t address);
+
+void write_memory(struct vm *vm, __uint16_t address, __uint16_t value);
+
+void refresh_segment_bases(struct vm *vm);
+
+void step(struct vm *vm);
+
+void run_ticks(struct vm *vm, __uint64_t ticks, bool fused);
+
+int load_microcode(const char *path, struct microcode *microcode);
+
+void dump_machine(FILE *out, const struct vm *vm);
 #endif //VM_MAIN_H
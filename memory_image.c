@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "memory_image.h"
+#include "main.h"
+
+const char MEMORY_IMAGE_MAGIC[] = {0x37, 0x34, 0x6A, 0x75, 0x75, 0x6D, 0x65, 0x6D};
+
+#define MEMORY_BYTES (MEMORY_SIZE * sizeof(__uint16_t))
+
+// Shortest run of zeros worth ending a data section for, and of a repeated value worth a fill section
+#define MIN_ZERO_GAP 8
+#define MIN_FILL_RUN 16
+
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Memory images require a little-endian host");
+
+static int load_sections(const unsigned char *image, size_t size, __uint16_t memory[]) {
+  struct memory_image_header header;
+  if (size < sizeof(header)) {
+    printf("Truncated memory image header\n");
+    return EXIT_FAILURE;
+  }
+  memcpy(&header, image, sizeof(header));
+  if (header.version != MEMORY_IMAGE_VERSION) {
+    printf("Unsupported memory image version %u\n", header.version);
+    return EXIT_FAILURE;
+  }
+  size_t offset = sizeof(header);
+  for (__uint32_t i = 0; i < header.section_count; ++i) {
+    struct memory_section section;
+    if (size - offset < sizeof(section)) {
+      printf("Truncated memory section %u\n", i);
+      return EXIT_FAILURE;
+    }
+    memcpy(&section, image + offset, sizeof(section));
+    offset += sizeof(section);
+    if (section.start > MEMORY_SIZE || section.length > MEMORY_SIZE - section.start) {
+      printf("Memory section %u (%x+%x) is out of range\n", i, section.start, section.length);
+      return EXIT_FAILURE;
+    }
+    if (section.flags & SECTION_FILL) {
+      if (section.fill == 0) {
+        continue; // Fresh memory is already zeroed
+      }
+      for (__uint32_t j = 0; j < section.length; ++j) {
+        memory[section.start + j] = section.fill;
+      }
+    } else {
+      size_t bytes = section.length * sizeof(__uint16_t);
+      if (size - offset < bytes) {
+        printf("Truncated memory section %u\n", i);
+        return EXIT_FAILURE;
+      }
+      memcpy(&memory[section.start], image + offset, bytes);
+      offset += bytes;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+int load_memory_image(const char *path, __uint16_t **memory) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Could not open memory file %s\n", path);
+    return EXIT_FAILURE;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    printf("Could not read memory file %s\n", path);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  size_t size = (size_t) st.st_size;
+
+  // Zeroed copy-on-write backing for the whole address space
+  __uint16_t *region = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    printf("Could not allocate memory\n");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  int result = EXIT_SUCCESS;
+  unsigned char magic[sizeof(MEMORY_IMAGE_MAGIC)];
+  if (size >= sizeof(magic) && pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      memcmp(magic, MEMORY_IMAGE_MAGIC, sizeof(magic)) == 0) {
+    unsigned char *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+      printf("Could not map memory file %s\n", path);
+      result = EXIT_FAILURE;
+    } else {
+      result = load_sections(image, size, region);
+      munmap(image, size);
+    }
+  } else if (size > MEMORY_BYTES || size % sizeof(__uint16_t) != 0) {
+    printf("Raw memory image must be a whole number of words, at most %lu bytes\n", MEMORY_BYTES);
+    result = EXIT_FAILURE;
+  } else if (size > 0) {
+    // Map the raw image privately over the start of the region, so pages are only read in (and copied)
+    // when the guest touches them. The rest of the last page past the end of the file reads as 0.
+    if (mmap(region, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      printf("Could not map memory file %s\n", path);
+      result = EXIT_FAILURE;
+    }
+  }
+  close(fd);
+  if (result == EXIT_FAILURE) {
+    munmap(region, MEMORY_BYTES);
+    return EXIT_FAILURE;
+  }
+  *memory = region;
+  return EXIT_SUCCESS;
+}
+
+void free_memory_image(__uint16_t *memory) {
+  munmap(memory, MEMORY_BYTES);
+}
+
+static bool write_section(FILE *out, __uint32_t start, __uint32_t length, __uint16_t fill, __uint16_t flags,
+                          const __uint16_t *data) {
+  struct memory_section section = {start, length, fill, flags};
+  if (fwrite(&section, sizeof(section), 1, out) != 1) {
+    return false;
+  }
+  return data == NULL || fwrite(data, sizeof(__uint16_t), length, out) == length;
+}
+
+// Writes a sectioned image: long runs of zeros are left out, long runs of one value become fill
+// sections and everything else is stored as data.
+int write_memory_image(const char *path, const __uint16_t memory[]) {
+  // run[i]: how many words starting at i hold the same value as memory[i]
+  static __uint32_t run[MEMORY_SIZE];
+  run[MEMORY_SIZE - 1] = 1;
+  for (int i = MEMORY_SIZE - 2; i >= 0; --i) {
+    run[i] = memory[i] == memory[i + 1] ? run[i + 1] + 1 : 1;
+  }
+
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    printf("Could not open %s for writing\n", path);
+    return EXIT_FAILURE;
+  }
+  struct memory_image_header header = {0};
+  memcpy(header.magic, MEMORY_IMAGE_MAGIC, sizeof(MEMORY_IMAGE_MAGIC));
+  header.version = MEMORY_IMAGE_VERSION;
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+#define is_gap(i) (memory[i] == 0 && run[i] >= MIN_ZERO_GAP)
+#define is_fill(i) (run[i] >= MIN_FILL_RUN)
+  __uint32_t i = 0;
+  while (ok && i < MEMORY_SIZE) {
+    if (is_gap(i)) {
+      i += run[i];
+    } else if (is_fill(i)) {
+      ok = write_section(out, i, run[i], memory[i], SECTION_FILL, NULL);
+      header.section_count++;
+      i += run[i];
+    } else {
+      __uint32_t end = i + 1;
+      while (end < MEMORY_SIZE && !is_gap(end) && !is_fill(end)) {
+        ++end;
+      }
+      ok = write_section(out, i, end - i, 0, 0, &memory[i]);
+      header.section_count++;
+      i = end;
+    }
+  }
+#undef is_gap
+#undef is_fill
+
+  // Patch in the final section count
+  ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+  if (fclose(out) != 0 || !ok) {
+    printf("Could not write %s\n", path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
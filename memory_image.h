@@ -0,0 +1,32 @@
+#include <stdlib.h>
+
+#ifndef VM_MEMORY_IMAGE_H
+#define VM_MEMORY_IMAGE_H
+
+// A memory image is either a raw dump of little-endian words starting at address 0, or a sectioned
+// image listing only the populated address ranges. Everything not covered by the image reads 0.
+#define MEMORY_IMAGE_VERSION 1
+
+// Section flags
+#define SECTION_FILL 1 // No data follows, every word in the section is set to fill
+
+struct memory_image_header {
+  char magic[8];
+  __uint32_t version;
+  __uint32_t section_count;
+};
+
+struct memory_section {
+  __uint32_t start;
+  __uint32_t length;
+  __uint16_t fill;
+  __uint16_t flags;
+};
+
+int load_memory_image(const char *path, __uint16_t **memory);
+
+void free_memory_image(__uint16_t *memory);
+
+int write_memory_image(const char *path, const __uint16_t memory[]);
+
+#endif //VM_MEMORY_IMAGE_H
@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include "microcode.h"
+
+const __uint64_t do_nothing_bits =
+    neg_uIP_W + neg_out_W + neg_mem_R + neg_mem_W + neg_mar_W + neg_seg_en + neg_reg_en + neg_flag_W + neg_flag_R +
+    neg_alu_b_W + neg_alu_a_W + neg_alu_re + neg_jmp_re + neg_int_re + neg_decode_R + neg_uPC_clear;
+
+#define asserted_low(word, mask) (((word) & (mask)) == 0)
+#define asserted_high(word, mask) (((word) & (mask)) != 0)
+
+struct u_op decode_microword(__uint64_t word) {
+  struct u_op op = {0};
+  __uint32_t actions = 0;
+
+  if (asserted_low(word, neg_mem_R)) { actions |= action_bit(ACT_MEM_R); }
+  if (asserted_low(word, neg_seg_en)) {
+    actions |= asserted_high(word, seg_W) ? action_bit(ACT_SEG_W) : action_bit(ACT_SEG_R);
+  }
+  // TODO: Check order of reg_sel
+  if (asserted_low(word, neg_reg_en)) {
+    actions |= asserted_high(word, reg_W) ? action_bit(ACT_REG_W) : action_bit(ACT_REG_R);
+  }
+  if (asserted_low(word, neg_flag_R)) { actions |= action_bit(ACT_FLAG_R); }
+  if (asserted_low(word, neg_alu_re)) { actions |= action_bit(ACT_ALU_RE); }
+  if (asserted_low(word, neg_jmp_re)) { actions |= action_bit(ACT_JMP_RE); }
+  if (asserted_low(word, neg_int_re)) { actions |= action_bit(ACT_INT_RE); }
+  if (asserted_low(word, neg_decode_R)) { actions |= action_bit(ACT_DECODE_R); }
+  if (asserted_high(word, inta)) { actions |= action_bit(ACT_INTA); }
+
+  if (asserted_low(word, neg_uIP_W)) { actions |= action_bit(ACT_UIP_W); }
+  if (asserted_low(word, neg_out_W)) { actions |= action_bit(ACT_OUT_W); }
+  if (asserted_low(word, neg_mem_W)) { actions |= action_bit(ACT_MEM_W); }
+  if (asserted_low(word, neg_mar_W)) { actions |= action_bit(ACT_MAR_W); }
+  if (asserted_low(word, neg_flag_W)) { actions |= action_bit(ACT_FLAG_W); }
+  if (asserted_low(word, neg_alu_a_W)) { actions |= action_bit(ACT_ALU_A_W); }
+  if (asserted_low(word, neg_alu_b_W)) { actions |= action_bit(ACT_ALU_B_W); }
+  if (asserted_low(word, neg_uPC_clear)) { actions |= action_bit(ACT_UPC_CLEAR); }
+  if (asserted_high(word, ir_W)) { actions |= action_bit(ACT_IR_W); }
+  if (asserted_high(word, halt)) { actions |= action_bit(ACT_HALT); }
+
+  op.actions = actions;
+  op.segment = (__uint8_t) ((word & seg_sel) >> 36);
+  op.alu_operation = (__uint8_t) ((word & alu_s) >> 17);
+  op.jump_select = (__uint8_t) ((word & jsel) >> 32);
+  op.modifiers = (__uint8_t) (((word & addr_mode) >> 22) << MOD_ADDR_MODE_SHIFT);
+  if (asserted_high(word, shift_left)) { op.modifiers |= MOD_SHL; }
+  if (asserted_high(word, shift_right)) { op.modifiers |= MOD_SHR; }
+  if (asserted_high(word, cin)) { op.modifiers |= MOD_CIN; }
+  if (asserted_high(word, reg_sel)) { op.modifiers |= MOD_REG_SRC; }
+  if (asserted_high(word, flag_sel_bus)) { op.modifiers |= MOD_FLAG_SEL_BUS; }
+  return op;
+}
+
+void decode_microcode(const __uint64_t eeprom[], struct u_op decoded[], size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    decoded[i] = decode_microword(eeprom[i]);
+  }
+}
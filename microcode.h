@@ -0,0 +1,115 @@
+#include <stdbool.h>
+
+#ifndef VM_MICROCODE_H
+#define VM_MICROCODE_H
+
+#define EEPROM_SIZE (1 << 13)
+
+// -------------------
+// Control Signal Masks
+// ------------------
+#define neg_uIP_W ((__uint64_t) 1 << 0)
+#define neg_out_W ((__uint64_t) 1 << 1)
+#define neg_mem_R ((__uint64_t) 1 << 2)
+#define neg_mem_W ((__uint64_t) 1 << 3)
+#define neg_mar_W ((__uint64_t) 1 << 4)
+// 5: Empty
+#define neg_seg_en ((__uint64_t) 1 << 6)
+#define seg_W ((__uint64_t) 1 << 7)
+#define neg_reg_en ((__uint64_t) 1 << 8)
+#define reg_W ((__uint64_t) 1 << 9)
+#define neg_flag_W ((__uint64_t) 1 << 10)
+#define flag_sel_bus ((__uint64_t) 1 << 11)
+#define neg_flag_R ((__uint64_t) 1 << 12)
+
+#define neg_alu_b_W ((__uint64_t) 1 << 13)
+#define neg_alu_a_W ((__uint64_t) 1 << 14)
+#define shift_right ((__uint64_t) 1 << 15)
+#define shift_left ((__uint64_t) 1 << 16)
+#define alu_s ((__uint64_t) (1 << 17 | 1 << 18 | 1 << 19))
+#define neg_alu_re ((__uint64_t) 1 << 20)
+#define cin ((__uint64_t) 1 << 21)
+#define addr_mode ((__uint64_t) (1 << 22 | 1 << 23))
+#define reg_sel ((__uint64_t) 1 << 24)
+#define neg_jmp_re ((__uint64_t) 1 << 25)
+#define inta ((__uint64_t) 1 << 26)
+#define neg_int_re ((__uint64_t) 1 << 27)
+#define halt ((__uint64_t) 1 << 28)
+#define neg_decode_R ((__uint64_t) 1 << 29)
+// 30: Empty
+#define neg_uPC_clear ((__uint64_t) 1 << 31)
+#define jsel ((__uint64_t) 1 << 32 | (__uint64_t) 1 << 33 | (__uint64_t) 1 << 34 | (__uint64_t) 1 << 35)
+#define seg_sel ((__uint64_t) 1 << 36 | (__uint64_t) 1 << 37)
+#define ir_W ((__uint64_t) 1 << 38)
+
+extern const __uint64_t do_nothing_bits;
+
+// -------------------
+// Predecoded Microcode
+// ------------------
+
+// Actions a microword asserts, as bit positions in u_op.actions. Everything is active high, so a
+// microword equal to do_nothing_bits decodes to no actions at all. Within each phase the actions
+// are listed in the order they have to be applied.
+enum u_action {
+  // Unclocked: drive the bus / combinational logic
+  ACT_MEM_R,
+  ACT_SEG_R,
+  ACT_REG_R,
+  ACT_FLAG_R,
+  ACT_ALU_RE,
+  ACT_JMP_RE,
+  ACT_INT_RE,
+  ACT_DECODE_R,
+  ACT_INTA,
+
+  // Clocked: latch from the bus on the rising edge
+  ACT_UIP_W = 16,
+  ACT_OUT_W,
+  ACT_MEM_W,
+  ACT_MAR_W,
+  ACT_SEG_W,
+  ACT_REG_W,
+  ACT_FLAG_W,
+  ACT_ALU_A_W,
+  ACT_ALU_B_W,
+  ACT_UPC_CLEAR,
+  ACT_IR_W,
+  ACT_HALT
+};
+
+#define action_bit(action) ((__uint32_t) 1 << (action))
+#define UNCLOCKED_ACTIONS ((__uint32_t) 0x0000FFFF)
+#define CLOCKED_ACTIONS ((__uint32_t) 0xFFFF0000)
+
+// Modifier bits in u_op.modifiers
+#define MOD_SHL (1 << 0)
+#define MOD_SHR (1 << 1)
+#define MOD_CIN (1 << 2)
+#define MOD_REG_SRC (1 << 3)
+#define MOD_FLAG_SEL_BUS (1 << 4)
+#define MOD_ADDR_MODE_SHIFT 5
+#define MOD_ADDR_MODE (3 << MOD_ADDR_MODE_SHIFT)
+
+// How mem R and mem W address memory, from addr_mode. Segments are in paragraphs (16 words), like
+// on the 8086, and addresses wrap around the end of memory.
+enum address_mode {
+  ADDR_FLAT,    // MAR
+  ADDR_SEGMENT, // The segment picked by seg_sel, with MAR as the offset
+  ADDR_CODE,    // CS:IP
+  ADDR_STACK    // SS:SP
+};
+
+struct u_op {
+  __uint32_t actions;
+  __uint8_t segment;
+  __uint8_t alu_operation;
+  __uint8_t jump_select;
+  __uint8_t modifiers;
+};
+
+struct u_op decode_microword(__uint64_t word);
+
+void decode_microcode(const __uint64_t eeprom[], struct u_op decoded[], size_t size);
+
+#endif //VM_MICROCODE_H
@@ -4,19 +4,41 @@
 #include <curses.h>
 #include <ctype.h>
 #include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
 #include "main.h"
+#include "ring.h"
 
 #define registers_height 20
 #define input_height 10
 
 #define ERROR_PAIR 1
 
+#define MESSAGE_QUEUE_SIZE 1024
+#define MESSAGE_LENGTH 128
+
 #define ctrl(x) ((x) & 0x1f)
 
 const char register_names[8][4] = {"EAX", "EBX", "ECX", "EDX", "ESI", "EDI", "EBP", "ESP"};
 const char segment_names[4][4] = {"IP", "DS", "SS", "CS"};
 
 int cur_line = 0;
+bool screen_active = false;
+bool messages_to_stdout = false;
+_Atomic int error_count = 0;
+void (*error_hook)(void);
+
+// Curses is only touched by the thread that called init_screen(). Messages from any other thread are
+// queued and printed by flush_messages().
+pthread_t ui_thread;
+struct spsc_ring message_queue;
+_Atomic int dropped_messages;
+
+struct queued_message {
+  bool is_error;
+  char text[MESSAGE_LENGTH];
+};
 WINDOW *register_window;
 WINDOW *output_window;
 WINDOW *input_window;
@@ -24,6 +46,7 @@ WINDOW *input_window;
 int maxlines, maxcols;
 struct input_line lnbuffer;
 int last_command = 0;
+char command_arg[1024];
 
 struct input_line {
   char *ln;
@@ -67,7 +90,7 @@ void render_line(struct input_line *buf) {
     waddch(input_window, ' ');
   }
   buf->last_rendered = rendered;
-  wrefresh(input_window);
+  wnoutrefresh(input_window);
 }
 
 int retrieve_content(struct input_line *buf, char *target, int max_len) {
@@ -99,26 +122,103 @@ void add_char(struct input_line *buf, char ch) {
 }
 
 
-void error(char *msg) {
-  wattron(output_window, A_BOLD | COLOR_PAIR(ERROR_PAIR));
+static bool queue_message(bool is_error, char *msg) {
+  if (pthread_equal(pthread_self(), ui_thread)) {
+    return false;
+  }
+  struct queued_message message;
+  message.is_error = is_error;
+  strncpy(message.text, msg, MESSAGE_LENGTH - 1);
+  message.text[MESSAGE_LENGTH - 1] = '\0';
+  if (!ring_push(&message_queue, &message)) {
+    atomic_fetch_add(&dropped_messages, 1);
+  }
+  return true;
+}
+
+// Adds a line to the output window without refreshing it
+static void output_line(char *msg, attr_t attrs) {
+  wattron(output_window, attrs);
   wmove(output_window, cur_line, 0);
   wprintw(output_window, "%s \n", msg);
   ++cur_line;
-  wattroff(output_window, A_BOLD | COLOR_PAIR(ERROR_PAIR));
+  wattroff(output_window, attrs);
   mvwhline(output_window, LINES - registers_height - input_height-1, 0, ACS_HLINE, COLS);
+}
+
+// hook is called on the thread that reports each error, before the message is printed
+void set_error_hook(void (*hook)(void)) {
+  error_hook = hook;
+}
+
+void error(char *msg) {
+  ++error_count;
+  if (error_hook) {
+    error_hook();
+  }
+  if (!screen_active) {
+    fprintf(stderr, "Error: %s\n", msg);
+    return;
+  }
+  if (queue_message(true, msg)) {
+    return;
+  }
+  output_line(msg, A_BOLD | COLOR_PAIR(ERROR_PAIR));
   wrefresh(output_window);
 }
 
+// Without a screen (headless mode) tracing is dropped so it doesn't slow down the simulation,
+// unless a script asked to see it
 void info(char *msg) {
-  wmove(output_window, cur_line, 0);
-  wprintw(output_window, "%s \n", msg);
-  ++cur_line;
-  mvwhline(output_window, LINES - registers_height - input_height-1, 0, ACS_HLINE, COLS);
+  if (!screen_active) {
+    if (messages_to_stdout) {
+      printf("%s\n", msg);
+    }
+    return;
+  }
+  if (queue_message(false, msg)) {
+    return;
+  }
+  output_line(msg, A_NORMAL);
   wrefresh(output_window);
 }
 
+int errors_reported(void) {
+  return error_count;
+}
+
+// Prints the messages queued by other threads with a single refresh. Only called from the UI thread.
+void flush_messages(void) {
+  struct queued_message message;
+  bool printed = false;
+  while (ring_pop(&message_queue, &message)) {
+    output_line(message.text, message.is_error ? A_BOLD | COLOR_PAIR(ERROR_PAIR) : A_NORMAL);
+    printed = true;
+  }
+  int dropped = atomic_exchange(&dropped_messages, 0);
+  if (dropped > 0) {
+    char buf[64];
+    sprintf(buf, "(%d messages dropped)", dropped);
+    output_line(buf, A_NORMAL);
+    printed = true;
+  }
+  if (printed) {
+    wnoutrefresh(output_window);
+  }
+}
+
+// Sends everything drawn since the last frame to the terminal at once. The input window goes last
+// so the cursor stays in it.
+void update_screen(void) {
+  wnoutrefresh(input_window);
+  doupdate();
+}
+
 void init_screen(void) {
   initscr();
+  screen_active = true;
+  ui_thread = pthread_self();
+  ring_init(&message_queue, MESSAGE_QUEUE_SIZE, sizeof(struct queued_message));
 
   cbreak();             // Immediate key input
   nonl();               // Get return key
@@ -169,6 +269,69 @@ void destroy_screen(void) {
   delwin(stdscr);
   endwin();
   refresh();
+  screen_active = false;
+  ring_destroy(&message_queue);
+}
+
+// Turns a command line into a VM_ command code, copying its argument (if it takes one) into arg,
+// which must hold as much as line. Returns 0 for anything else.
+int parse_command(const char *ln, char *arg) {
+  arg[0] = '\0';
+  if (strcmp(ln, "exit") == 0 || strcmp(ln, "quit") == 0) {
+    return VM_EXIT;
+  }
+  // back, back N, run back until COND
+  if (strcmp(ln, "back") == 0 || strncmp(ln, "back ", 5) == 0) {
+    strcpy(arg, ln[4] ? ln + 5 : "");
+    return VM_BACK;
+  }
+  if (strncmp(ln, "run back ", 9) == 0) {
+    strcpy(arg, ln + 9);
+    return VM_BACK;
+  }
+  // run, run until halt, run until COND
+  if (strcmp(ln, "r") == 0 || strcmp(ln, "run") == 0 || strncmp(ln, "run ", 4) == 0) {
+    strcpy(arg, ln[1] && ln[3] ? ln + 4 : "");
+    return VM_RUN;
+  }
+  if (strcmp(ln, "p") == 0 || strcmp(ln, "pause") == 0) {
+    return VM_PAUSE;
+  }
+  // step, step N
+  if (strcmp(ln, "s") == 0 || strcmp(ln, "step") == 0 || strncmp(ln, "step ", 5) == 0) {
+    strcpy(arg, ln[1] && ln[4] ? ln + 5 : "");
+    return VM_STEP;
+  }
+  if (strncmp(ln, "save ", 5) == 0) {
+    strcpy(arg, ln + 5);
+    return VM_SAVE;
+  }
+  if (strncmp(ln, "load ", 5) == 0) {
+    strcpy(arg, ln + 5);
+    return VM_LOAD;
+  }
+  if (strncmp(ln, "clock ", 6) == 0) {
+    strcpy(arg, ln + 6);
+    return VM_CLOCK;
+  }
+  if (strcmp(ln, "log") == 0 || strncmp(ln, "log ", 4) == 0) {
+    strcpy(arg, ln[3] ? ln + 4 : "");
+    return VM_LOG;
+  }
+  if (strncmp(ln, "break ", 6) == 0 || strncmp(ln, "watch ", 6) == 0 || strncmp(ln, "delete ", 7) == 0 ||
+      strcmp(ln, "breakpoints") == 0) {
+    strcpy(arg, ln);
+    return VM_DEBUG;
+  }
+  if (strcmp(ln, "stats") == 0 || strncmp(ln, "stats ", 6) == 0) {
+    strcpy(arg, ln[5] ? ln + 6 : "");
+    return VM_STATS;
+  }
+  if (strcmp(ln, "ff") == 0 || strncmp(ln, "ff ", 3) == 0) {
+    strcpy(arg, ln[2] ? ln + 3 : "");
+    return VM_FAST_FORWARD;
+  }
+  return 0;
 }
 
 int handle_keyboard(void) {
@@ -176,20 +339,10 @@ int handle_keyboard(void) {
   int code = 0;
   int len = get_key(&lnbuffer, ln, sizeof(ln));
   if (len != 0) { // If gotten a complete string
-    if (strcmp(ln, "exit") == 0 || strcmp(ln, "quit") == 0) {
-      code = VM_EXIT;
-    }
-    if (strcmp(ln, "r") == 0 || strcmp(ln, "run") == 0) {
-      code = VM_RUN;
-    }
-    if (strcmp(ln, "p") == 0 || strcmp(ln, "pause") == 0) {
-      code = VM_PAUSE;
-    }
-    if (strcmp(ln, "s") == 0 || strcmp(ln, "step") == 0) {
-      code = VM_STEP;
-    }
     if (len == 1) { // Zero length string
       code = last_command;
+    } else {
+      code = parse_command(ln, command_arg);
     }
     wmove(input_window, lines_read, 0);
     wclrtoeol(input_window);
@@ -198,7 +351,7 @@ int handle_keyboard(void) {
     if (len == -1 || strcmp(ln, "clear") == 0 || strcmp(ln, "clr") == 0) {
       lines_read = 0;
       wclear(input_window);
-      wrefresh(input_window);
+      wnoutrefresh(input_window);
       destroy_buffer(&lnbuffer);
     }
     last_command = code;
@@ -208,6 +361,18 @@ int handle_keyboard(void) {
   return code;
 }
 
+// Sleeps until a key arrives or timeout seconds have passed, so the UI wakes up at once for input
+// without polling curses in between frames
+void wait_for_input(double timeout) {
+  struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+  poll(&input, 1, (int) (timeout * 1000));
+}
+
+// Argument of the last command that takes one, e.g. the file name of save/load
+const char *command_argument(void) {
+  return command_arg;
+}
+
 int get_key(struct input_line *buf, char *target, int max_len) {
   while (1) {
     int key = getch();
@@ -261,51 +426,176 @@ int handle_input(struct input_line *buf, char *target, int max_len, int key) {
   return 0;
 }
 
+// Fills buf with the 41 bits of a microword, most significant first
 void control_bits_to_binary(__uint64_t control_bits, char *buf) {
-  printf("Starting: ");
   for (int i = 40; i >= 0; i--) {
-    char buf2[8];
-    sprintf(buf2, "%c", '0' + (int)((control_bits >> i) & 1));
-//    printf("(%2d) %lx - %s\n", i, control_bits, buf2);
-    strcat(buf, buf2);
+    *buf++ = (char) ('0' + (int) ((control_bits >> i) & 1));
+  }
+  *buf = '\0';
+}
+
+// Fills buf with CZSV, a dash for each flag that is clear
+static void flags_to_letters(__uint8_t flags, char *buf) {
+  const char letters[] = "CZSV";
+  for (int i = 0; i < 4; i++) {
+    buf[i] = flags & (1 << i) ? letters[i] : '-';
   }
-//  printf("%s", buf);
-//  printf("Done \n");
+  buf[4] = '\0';
 }
 
+// Fields of the register window, as bits of a mask
+#define FIELD_REGISTER(i) (1u << (i))
+#define FIELD_SEGMENT(i) (1u << (8 + (i)))
+#define FIELD_BUS (1u << 12)
+#define FIELD_ALU_A (1u << 13)
+#define FIELD_ALU_B (1u << 14)
+#define FIELD_UIR (1u << 15)
+#define FIELD_UPC (1u << 16)
+#define FIELD_IR (1u << 17)
+#define FIELD_CONTROL (1u << 18)
+#define FIELD_FLAGS (1u << 19)
+#define ALL_FIELDS ((1u << 20) - 1)
+
+#define CHANGED_ATTRS A_BOLD
+
+// What the register window currently shows. Frames only redraw the fields that differ, drawing them
+// highlighted, and redraw last frame's highlighted fields plain once they stop changing.
+struct register_view {
+  __uint16_t registers[8];
+  __uint16_t segments[4];
+  __uint16_t bus;
+  bool bus_floating;
+  __uint16_t alu_a;
+  __uint16_t alu_b;
+  __uint8_t flags;
+  __uint8_t u_instruction_register;
+  __uint8_t u_program_counter;
+  __uint16_t instruction_register;
+  __uint64_t control_bits;
+  bool drawn;
+  unsigned highlighted;
+};
+
+struct register_view view;
+
+static unsigned changed_fields(const struct register_view *next) {
+  if (!view.drawn) {
+    return ALL_FIELDS;
+  }
+  unsigned changed = 0;
+  for (int i = 0; i < 8; i++) {
+    if (next->registers[i] != view.registers[i]) { changed |= FIELD_REGISTER(i); }
+  }
+  for (int i = 0; i < 4; i++) {
+    if (next->segments[i] != view.segments[i]) { changed |= FIELD_SEGMENT(i); }
+  }
+  if (next->bus != view.bus || next->bus_floating != view.bus_floating) { changed |= FIELD_BUS; }
+  if (next->alu_a != view.alu_a) { changed |= FIELD_ALU_A; }
+  if (next->alu_b != view.alu_b) { changed |= FIELD_ALU_B; }
+  if (next->u_instruction_register != view.u_instruction_register) { changed |= FIELD_UIR; }
+  if (next->u_program_counter != view.u_program_counter) { changed |= FIELD_UPC; }
+  if (next->instruction_register != view.instruction_register) { changed |= FIELD_IR; }
+  if (next->control_bits != view.control_bits) { changed |= FIELD_CONTROL; }
+  if (next->flags != view.flags) { changed |= FIELD_FLAGS; }
+  return changed;
+}
+
+// Every field is drawn at a fixed width, so a redraw covers whatever was there before
+static void draw_field(unsigned field, const struct register_view *next) {
+  int bit = __builtin_ctz(field);
+  if (bit < 8) {
+    mvwprintw(register_window, bit, 0, "%s: %-4x", register_names[bit], next->registers[bit]);
+  } else if (bit < 12) {
+    mvwprintw(register_window, bit - 8, 12, "%s: %-4x", segment_names[bit - 8], next->segments[bit - 8]);
+  } else if (field == FIELD_BUS) {
+    mvwprintw(register_window, 9, 0, "Bus: %-4x %-10s", next->bus, next->bus_floating ? "(Floating)" : "");
+  } else if (field == FIELD_ALU_A) {
+    mvwprintw(register_window, 11, 0, "A: %-4x", next->alu_a);
+  } else if (field == FIELD_ALU_B) {
+    mvwprintw(register_window, 11, 10, "B: %-4x", next->alu_b);
+  } else if (field == FIELD_UIR) {
+    mvwprintw(register_window, 13, 0, "uIR: %-2x", next->u_instruction_register);
+  } else if (field == FIELD_UPC) {
+    mvwprintw(register_window, 13, 11, "uPC: %-3d", next->u_program_counter);
+  } else if (field == FIELD_IR) {
+    __uint16_t ir = next->instruction_register;
+    mvwprintw(register_window, 14, 0, "IR: %-4x    dst: %x    src: %x    off: %-2x   8: %-2x    11: %-3x", ir,
+              (ir & 0x0700) >> 8, (ir & 0x00E0) >> 5, ir & 0x001F, ir & 0x00FF, ir & 0x03FF);
+  } else if (field == FIELD_CONTROL) {
+    char binary[48];
+    control_bits_to_binary(next->control_bits, binary);
+    mvwprintw(register_window, 16, 0, "Current uInstruction: %010lx", next->control_bits);
+    mvwprintw(register_window, 17, 0, "%s", binary);
+  } else if (field == FIELD_FLAGS) {
+    char letters[5];
+    flags_to_letters(next->flags, letters);
+    mvwprintw(register_window, 11, 20, "Flags: %s", letters);
+  }
+}
+
+// Only queues the changes, update_screen() sends them
 void print_registers(__uint16_t registers[], __uint16_t segments[], __uint16_t bus, bool bus_floating,
                      __uint8_t u_program_counter, __uint16_t alu_a,
-                     __uint16_t alu_b, __uint64_t control_bits, __uint16_t mar, __uint16_t instruction_register,
-                     __uint8_t u_instruction_register) {
-  werase(register_window);
+                     __uint16_t alu_b, __uint8_t flags, __uint64_t control_bits, __uint16_t mar,
+                     __uint16_t instruction_register, __uint8_t u_instruction_register) {
+  (void) mar;
+  struct register_view next;
+  memcpy(next.registers, registers, sizeof(next.registers));
+  memcpy(next.segments, segments, sizeof(next.segments));
+  next.bus = bus;
+  next.bus_floating = bus_floating;
+  next.alu_a = alu_a;
+  next.alu_b = alu_b;
+  next.flags = flags;
+  next.u_instruction_register = u_instruction_register;
+  next.u_program_counter = u_program_counter;
+  next.instruction_register = instruction_register;
+  next.control_bits = control_bits;
+
+  unsigned changed = changed_fields(&next);
+  // Nothing is highlighted on the first frame
+  unsigned highlight = view.drawn ? changed : 0;
+  unsigned pending = changed | view.highlighted;
+  while (pending) {
+    unsigned field = pending & -pending;
+    pending &= pending - 1;
+    if (highlight & field) {
+      wattron(register_window, CHANGED_ATTRS);
+    }
+    draw_field(field, &next);
+    wattroff(register_window, CHANGED_ATTRS);
+  }
+  next.drawn = true;
+  next.highlighted = highlight;
+  view = next;
+  wnoutrefresh(register_window);
+}
+
+void print_clock_rate(double target, double achieved) {
+  wmove(register_window, 18, 0);
+  wclrtoeol(register_window);
+  if (target > 0) {
+    mvwprintw(register_window, 18, 0, "Clock: %.0f Hz    Achieved: %.1f Hz", target, achieved);
+  } else {
+    mvwprintw(register_window, 18, 0, "Clock: unthrottled    Achieved: %.0f Hz", achieved);
+  }
+  wnoutrefresh(register_window);
+}
+
+void dump_registers(FILE *out, const __uint16_t registers[], const __uint16_t segments[], __uint16_t bus,
+                    bool bus_floating, __uint8_t u_program_counter, __uint16_t alu_a,
+                    __uint16_t alu_b, __uint8_t flags, __uint64_t control_bits, __uint16_t mar,
+                    __uint16_t instruction_register, __uint8_t u_instruction_register) {
+  char letters[5];
+  flags_to_letters(flags, letters);
   for (int i = 0; i < 8; i++) {
-    mvwprintw(register_window, i, 0, "%s: %x", register_names[i], registers[i]);
+    fprintf(out, "%s: %04x%s", register_names[i], registers[i], i == 7 ? "\n" : "  ");
   }
   for (int i = 0; i < 4; i++) {
-    mvwprintw(register_window, i, 12, "%s: %x", segment_names[i], segments[i]);
-  }
-  // Bus
-  char *bus_text = bus_floating ? "Bus: %x (Floating)" : "Bus: %x";
-  mvwprintw(register_window, 9, 0, bus_text, bus);
-
-  // ALU
-  mvwprintw(register_window, 11, 0, "A: %x    B: %x", alu_a, alu_b);
-
-  // Control Logic
-  int src_reg = ((instruction_register & 0x00E0) >> 5);
-  int dst_reg = ((instruction_register & 0x0700) >> 8);
-  int offset = instruction_register & 0x001F;
-  int val8 = instruction_register & 0x00FF;
-  int val11 = instruction_register & 0x03FF;
-  mvwprintw(register_window, 13, 0, "uIR: %x    uPC: %d", u_instruction_register, u_program_counter);
-  mvwprintw(register_window, 14, 0, "IR: %x    dst: %x    src: %x    off: %x   8: %x    11: %x",
-      instruction_register, dst_reg, src_reg, offset, val8, val11);
-  mvwprintw(register_window, 16, 0, "Current uInstruction: %lx", control_bits);
-
-  char buf[64] = "";
-  control_bits_to_binary(control_bits, buf);
-  mvwprintw(register_window, 17, 0, buf);
-
-  mvwhline(register_window, registers_height-1, 0, ACS_HLINE, COLS);
-  wrefresh(register_window);
+    fprintf(out, "%s: %04x%s", segment_names[i], segments[i], i == 3 ? "\n" : "  ");
+  }
+  fprintf(out, "Bus: %04x%s  A: %04x  B: %04x  MAR: %04x  Flags: %s\n", bus, bus_floating ? " (Floating)" : "",
+          alu_a, alu_b, mar, letters);
+  fprintf(out, "IR: %04x  uIR: %x  uPC: %d  uInstruction: %010lx\n", instruction_register, u_instruction_register,
+          u_program_counter, control_bits);
 }
@@ -1,28 +1,55 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 
 #ifndef VM_PRINTING_H
 #define VM_PRINTING_H
 
+// Set while curses owns the terminal
+extern bool screen_active;
+// Prints info() messages to stdout while there is no screen
+extern bool messages_to_stdout;
+
 void init_screen(void);
 
 void destroy_screen(void);
 
 struct input_line;
 
+void set_error_hook(void (*hook)(void));
+
 void error(char *msg);
 
 void info(char *msg);
 
+int errors_reported(void);
+
+void flush_messages(void);
+
+void update_screen(void);
+
 void print_registers(__uint16_t registers[], __uint16_t segments[], __uint16_t bus, bool bus_floating,
                      __uint8_t u_program_counter, __uint16_t alu_a,
-                     __uint16_t alu_b, __uint64_t control_bits, __uint16_t mar, __uint16_t instruction_register,
+                     __uint16_t alu_b, __uint8_t flags, __uint64_t control_bits, __uint16_t mar, __uint16_t instruction_register,
                      __uint8_t u_instruction_register);
 
+void print_clock_rate(double target, double achieved);
+
+void dump_registers(FILE *out, const __uint16_t registers[], const __uint16_t segments[], __uint16_t bus,
+                    bool bus_floating, __uint8_t u_program_counter, __uint16_t alu_a,
+                    __uint16_t alu_b, __uint8_t flags, __uint64_t control_bits, __uint16_t mar, __uint16_t instruction_register,
+                    __uint8_t u_instruction_register);
+
 int get_key(struct input_line *buf, char *target, int max_len);
 
+int parse_command(const char *ln, char *arg);
+
 int handle_keyboard(void);
 
+void wait_for_input(double timeout);
+
+const char *command_argument(void);
+
 int handle_input(struct input_line *buf, char *target, int max_len, int key);
 
 #endif //VM_PRINTING_H
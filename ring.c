@@ -0,0 +1,46 @@
+#include <string.h>
+#include "ring.h"
+
+int ring_init(struct spsc_ring *ring, size_t capacity, size_t item_size) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    return EXIT_FAILURE;
+  }
+  ring->slots = malloc(capacity * item_size);
+  if (ring->slots == NULL) {
+    return EXIT_FAILURE;
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->capacity = capacity;
+  ring->item_size = item_size;
+  return EXIT_SUCCESS;
+}
+
+void ring_destroy(struct spsc_ring *ring) {
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+// Returns false if the ring is full
+bool ring_push(struct spsc_ring *ring, const void *item) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail == ring->capacity) {
+    return false;
+  }
+  memcpy(ring->slots + (head & (ring->capacity - 1)) * ring->item_size, item, ring->item_size);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+// Returns false if the ring is empty
+bool ring_pop(struct spsc_ring *ring, void *item) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (head == tail) {
+    return false;
+  }
+  memcpy(item, ring->slots + (tail & (ring->capacity - 1)) * ring->item_size, ring->item_size);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
@@ -0,0 +1,26 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifndef VM_RING_H
+#define VM_RING_H
+
+// Lock-free single producer / single consumer queue of fixed size items. capacity must be a power
+// of two. head and tail live on separate cache lines so the two threads don't share one.
+struct spsc_ring {
+  _Alignas(64) _Atomic size_t head; // Next slot the producer writes
+  _Alignas(64) _Atomic size_t tail; // Next slot the consumer reads
+  _Alignas(64) size_t capacity;
+  size_t item_size;
+  unsigned char *slots;
+};
+
+int ring_init(struct spsc_ring *ring, size_t capacity, size_t item_size);
+
+void ring_destroy(struct spsc_ring *ring);
+
+bool ring_push(struct spsc_ring *ring, const void *item);
+
+bool ring_pop(struct spsc_ring *ring, void *item);
+
+#endif //VM_RING_H
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include "runner.h"
+#include "main.h"
+#include "memory_image.h"
+
+// Runs many short programs in one process, each on its own quiet machine. Jobs are dealt out to one
+// deque per worker up front, workers take from the bottom of their own and steal from the top of
+// the others' when they run dry, so a few long jobs don't hold up the rest.
+
+enum job_status {
+  JOB_PENDING,
+  JOB_HALTED,
+  JOB_BUDGET,
+  JOB_ERROR,
+  JOB_LOAD_FAILED
+};
+
+static const char *status_names[] = {"pending", "halted", "budget exhausted", "error", "load failed"};
+
+struct job {
+  char *eeprom_path;
+  char *memory_path;
+  __uint64_t max_ticks;
+  const struct microcode *microcode;
+  // The EEPROM was tried and is invalid, later jobs with the same path don't try it again
+  bool load_failed;
+  enum job_status status;
+  // Final state. memory is unmapped once the job is done.
+  struct vm vm;
+};
+
+// Chase-Lev deque without growth: all jobs are pushed before the workers start
+struct deque {
+  _Alignas(64) _Atomic long top;
+  _Alignas(64) _Atomic long bottom;
+  _Alignas(64) int *jobs;
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+};
+
+struct job *jobs;
+int job_count;
+struct deque *deques;
+int worker_count;
+bool batch_fused;
+
+// Owner only. The last job can race with a thief, the CAS on top decides who gets it.
+static bool take(struct deque *deque, int *job) {
+  long bottom = atomic_load(&deque->bottom) - 1;
+  atomic_store(&deque->bottom, bottom);
+  long top = atomic_load(&deque->top);
+  if (top > bottom) {
+    atomic_store(&deque->bottom, bottom + 1);
+    return false;
+  }
+  *job = deque->jobs[bottom];
+  if (top == bottom) {
+    bool won = atomic_compare_exchange_strong(&deque->top, &top, top + 1);
+    atomic_store(&deque->bottom, bottom + 1);
+    return won;
+  }
+  return true;
+}
+
+// Returns false if the deque looked empty or another thread got there first
+static bool steal(struct deque *deque, int *job, bool *empty) {
+  long top = atomic_load(&deque->top);
+  long bottom = atomic_load(&deque->bottom);
+  if (top >= bottom) {
+    return false;
+  }
+  *empty = false;
+  *job = deque->jobs[top];
+  return atomic_compare_exchange_strong(&deque->top, &top, top + 1);
+}
+
+static void run_job(struct job *job) {
+  struct vm *vm = &job->vm;
+  memset(vm, 0, sizeof(*vm));
+  vm->running = true;
+  vm->quiet = true;
+  vm->microcode = job->microcode;
+  if (job->load_failed || load_memory_image(job->memory_path, &vm->memory) == EXIT_FAILURE) {
+    job->status = JOB_LOAD_FAILED;
+    return;
+  }
+  run_ticks(vm, job->max_ticks == 0 ? UINT64_MAX : job->max_ticks, batch_fused);
+  free_memory_image(vm->memory);
+  vm->memory = NULL;
+  job->status = vm->errors != 0 ? JOB_ERROR : vm->running ? JOB_BUDGET : JOB_HALTED;
+}
+
+static void *worker_main(void *arg) {
+  struct worker *worker = arg;
+  int job;
+  while (true) {
+    while (take(&deques[worker->id], &job)) {
+      run_job(&jobs[job]);
+    }
+    // Out of work, look for some elsewhere until every deque is seen empty
+    bool empty = true;
+    bool stolen = false;
+    for (int i = 1; i < worker_count && !stolen; ++i) {
+      stolen = steal(&deques[(worker->id + i) % worker_count], &job, &empty);
+    }
+    if (stolen) {
+      run_job(&jobs[job]);
+    } else if (empty) {
+      return NULL;
+    }
+  }
+}
+
+static int read_jobs(const char *path, __uint64_t max_ticks) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    printf("Could not open batch file %s\n", path);
+    return EXIT_FAILURE;
+  }
+  char line[MAX_JOB_LINE];
+  int capacity = 0;
+  int line_number = 0;
+  while (fgets(line, sizeof(line), file)) {
+    ++line_number;
+    char eeprom_path[MAX_JOB_LINE], memory_path[MAX_JOB_LINE];
+    unsigned long long ticks = max_ticks;
+    char *start = line + strspn(line, " \t");
+    if (*start == '#' || *start == '\n' || *start == '\0') {
+      continue;
+    }
+    if (sscanf(start, "%s %s %llu", eeprom_path, memory_path, &ticks) < 2) {
+      printf("Bad job on line %d of %s\n", line_number, path);
+      fclose(file);
+      return EXIT_FAILURE;
+    }
+    if (job_count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      struct job *grown = realloc(jobs, capacity * sizeof(struct job));
+      if (grown == NULL) {
+        printf("Could not allocate %d jobs\n", capacity);
+        fclose(file);
+        return EXIT_FAILURE;
+      }
+      jobs = grown;
+    }
+    struct job *job = &jobs[job_count++];
+    memset(job, 0, sizeof(*job));
+    job->eeprom_path = strdup(eeprom_path);
+    job->memory_path = strdup(memory_path);
+    job->max_ticks = ticks;
+  }
+  fclose(file);
+  return EXIT_SUCCESS;
+}
+
+// Every distinct EEPROM is loaded once and shared by all the jobs that use it. An invalid one is
+// reported once, and every job that uses it fails to load.
+static int load_microcodes(void) {
+  for (int i = 0; i < job_count; ++i) {
+    bool seen = false;
+    for (int j = 0; j < i && !seen; ++j) {
+      if (strcmp(jobs[j].eeprom_path, jobs[i].eeprom_path) == 0) {
+        jobs[i].microcode = jobs[j].microcode;
+        jobs[i].load_failed = jobs[j].load_failed;
+        seen = true;
+      }
+    }
+    if (seen) {
+      continue;
+    }
+    struct microcode *microcode = malloc(sizeof(struct microcode));
+    if (microcode == NULL) {
+      printf("Could not allocate microcode for %s\n", jobs[i].eeprom_path);
+      return EXIT_FAILURE;
+    }
+    if (load_microcode(jobs[i].eeprom_path, microcode) == EXIT_FAILURE) {
+      printf("EEPROM file %s is invalid\n", jobs[i].eeprom_path);
+      free(microcode);
+      jobs[i].load_failed = true;
+      continue;
+    }
+    jobs[i].microcode = microcode;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Runs every job in the batch file on threads workers (0 = one per core) and prints each job's final
+// state in file order. max_ticks applies to jobs that don't give their own (0 = no limit).
+int run_batch(const char *path, int threads, __uint64_t max_ticks, bool fused) {
+  if (read_jobs(path, max_ticks) == EXIT_FAILURE) {
+    return EXIT_FAILURE;
+  }
+  if (load_microcodes() == EXIT_FAILURE) {
+    return EXIT_FAILURE;
+  }
+  batch_fused = fused;
+
+  worker_count = threads > 0 ? threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (worker_count < 1) {
+    worker_count = 1;
+  }
+  if (worker_count > job_count && job_count > 0) {
+    worker_count = job_count;
+  }
+  deques = calloc(worker_count, sizeof(struct deque));
+  struct worker *workers = calloc(worker_count, sizeof(struct worker));
+  bool allocated = deques != NULL && workers != NULL;
+  for (int i = 0; i < worker_count && allocated; ++i) {
+    deques[i].jobs = malloc((job_count / worker_count + 1) * sizeof(int));
+    allocated = deques[i].jobs != NULL;
+  }
+  if (!allocated) {
+    printf("Could not allocate %d workers\n", worker_count);
+    for (int i = 0; deques != NULL && i < worker_count; ++i) {
+      free(deques[i].jobs);
+    }
+    free(deques);
+    free(workers);
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < job_count; ++i) {
+    struct deque *deque = &deques[i % worker_count];
+    // Pushed in reverse so each worker takes its share in file order
+    deque->jobs[atomic_load(&deque->bottom)] = job_count - 1 - i;
+    atomic_fetch_add(&deque->bottom, 1);
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int started = 0;
+  for (int i = 0; i < worker_count; ++i) {
+    workers[i].id = i;
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      break;
+    }
+    ++started;
+  }
+  if (started == 0) {
+    // Run everything here, the first deque's owner steals the rest
+    workers[0].id = 0;
+    worker_main(&workers[0]);
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  int halted = 0;
+  for (int i = 0; i < job_count; ++i) {
+    struct job *job = &jobs[i];
+    printf("== Job %d: %s after %llu ticks (%s %s)\n", i + 1, status_names[job->status],
+           (unsigned long long) job->vm.tick_count, job->eeprom_path, job->memory_path);
+    if (job->status == JOB_LOAD_FAILED) {
+      continue;
+    }
+    if (job->vm.errors != 0) {
+      printf("%d errors, first: %s\n", job->vm.errors, job->vm.first_error);
+    }
+    dump_machine(stdout, &job->vm);
+    halted += job->status == JOB_HALTED;
+  }
+  double elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1E9;
+  printf("%d of %d jobs halted cleanly in %.6f s on %d threads (%.0f jobs/s)\n", halted, job_count, elapsed,
+         worker_count, elapsed > 0 ? job_count / elapsed : 0.0);
+
+  for (int i = 0; i < worker_count; ++i) {
+    free(deques[i].jobs);
+  }
+  free(deques);
+  free(workers);
+  return halted == job_count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,12 @@
+#include <stdbool.h>
+
+#ifndef VM_RUNNER_H
+#define VM_RUNNER_H
+
+// A batch file lists one job per line: "EEPROM_file Memory_file [max_ticks]". Blank lines and lines
+// starting with # are skipped.
+#define MAX_JOB_LINE 4096
+
+int run_batch(const char *path, int threads, __uint64_t max_ticks, bool fused);
+
+#endif //VM_RUNNER_H
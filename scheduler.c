@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "scheduler.h"
+#include "main.h"
+
+struct scheduler scheduler;
+
+static void swap_events(struct event *a, struct event *b) {
+  struct event tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static void sift_up(struct scheduler *events, int i) {
+  while (i > 0 && events->heap[(i - 1) / 2].tick > events->heap[i].tick) {
+    swap_events(&events->heap[(i - 1) / 2], &events->heap[i]);
+    i = (i - 1) / 2;
+  }
+}
+
+static void sift_down(struct scheduler *events, int i) {
+  for (;;) {
+    int smallest = i;
+    int left = 2 * i + 1;
+    int right = left + 1;
+    if (left < events->count && events->heap[left].tick < events->heap[smallest].tick) {
+      smallest = left;
+    }
+    if (right < events->count && events->heap[right].tick < events->heap[smallest].tick) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    swap_events(&events->heap[i], &events->heap[smallest]);
+    i = smallest;
+  }
+}
+
+static void update_next_event(struct vm *vm) {
+  struct scheduler *events = vm->scheduler;
+  vm->next_event = events && events->count > 0 ? events->heap[0].tick : UINT64_MAX;
+}
+
+// fire runs at the start of the given tick, before its microword
+int schedule_event(struct vm *vm, __uint64_t tick, event_handler fire) {
+  struct scheduler *events = vm->scheduler;
+  if (events == NULL) {
+    vm_error(vm, "No event scheduler attached");
+    return EXIT_FAILURE;
+  }
+  if (events->count == MAX_EVENTS) {
+    vm_error(vm, "Too many scheduled events");
+    return EXIT_FAILURE;
+  }
+  events->heap[events->count] = (struct event) {tick, fire};
+  sift_up(events, events->count++);
+  update_next_event(vm);
+  return EXIT_SUCCESS;
+}
+
+void cancel_events(struct vm *vm, event_handler fire) {
+  struct scheduler *events = vm->scheduler;
+  if (events == NULL) {
+    return;
+  }
+  int kept = 0;
+  for (int i = 0; i < events->count; ++i) {
+    if (events->heap[i].fire != fire) {
+      events->heap[kept++] = events->heap[i];
+    }
+  }
+  events->count = kept;
+  for (int i = kept / 2 - 1; i >= 0; --i) {
+    sift_down(events, i);
+  }
+  update_next_event(vm);
+}
+
+// Handlers may schedule again, even for the current tick
+void run_due_events(struct vm *vm) {
+  struct scheduler *events = vm->scheduler;
+  while (events && events->count > 0 && events->heap[0].tick <= vm->tick_count) {
+    struct event due = events->heap[0];
+    events->heap[0] = events->heap[--events->count];
+    sift_down(events, 0);
+    due.fire(vm);
+  }
+  update_next_event(vm);
+}
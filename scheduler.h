@@ -0,0 +1,34 @@
+#include <stdbool.h>
+
+#ifndef VM_SCHEDULER_H
+#define VM_SCHEDULER_H
+
+// Devices schedule what they do next at a tick instead of being polled. The machine keeps the
+// earliest tick in vm->next_event, which is all the core looks at per tick.
+#define MAX_EVENTS 64
+
+struct vm;
+
+typedef void (*event_handler)(struct vm *vm);
+
+struct event {
+  __uint64_t tick;
+  event_handler fire;
+};
+
+// Min-heap on tick
+struct scheduler {
+  struct event heap[MAX_EVENTS];
+  int count;
+};
+
+// The interactive machine's events
+extern struct scheduler scheduler;
+
+int schedule_event(struct vm *vm, __uint64_t tick, event_handler fire);
+
+void cancel_events(struct vm *vm, event_handler fire);
+
+void run_due_events(struct vm *vm);
+
+#endif //VM_SCHEDULER_H
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "snapshot.h"
+#include "main.h"
+#include "microcode.h"
+#include "eeprom.h"
+#include "printing.h"
+
+const char SNAPSHOT_MAGIC[] = {0x37, 0x34, 0x6A, 0x75, 0x75, 0x73, 0x6E, 0x70};
+
+#define PAGE_COUNT (MEMORY_SIZE / SNAPSHOT_PAGE_WORDS)
+// Shortest run of one value that is stored as a repeat token
+#define MIN_REPEAT 3
+
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Snapshots require a little-endian host");
+
+// Encodes one page into tokens, returning the number of words used. A page never needs more than
+// one token per word plus the words themselves.
+static __uint16_t encode_page(const __uint16_t *page, __uint16_t tokens[]) {
+  __uint16_t used = 0;
+  int i = 0;
+  while (i < SNAPSHOT_PAGE_WORDS) {
+    int run = 1;
+    while (i + run < SNAPSHOT_PAGE_WORDS && page[i + run] == page[i]) {
+      ++run;
+    }
+    if (run >= MIN_REPEAT) {
+      tokens[used++] = (__uint16_t) (RLE_REPEAT | run);
+      tokens[used++] = page[i];
+      i += run;
+      continue;
+    }
+    // Literal words up to the next repeat
+    int start = i;
+    while (i < SNAPSHOT_PAGE_WORDS) {
+      run = 1;
+      while (i + run < SNAPSHOT_PAGE_WORDS && page[i + run] == page[i] && run < MIN_REPEAT) {
+        ++run;
+      }
+      if (run >= MIN_REPEAT) {
+        break;
+      }
+      i += run;
+    }
+    tokens[used++] = (__uint16_t) (i - start);
+    memcpy(&tokens[used], &page[start], (i - start) * sizeof(__uint16_t));
+    used = (__uint16_t) (used + i - start);
+  }
+  return used;
+}
+
+static bool decode_page(const __uint16_t tokens[], __uint16_t token_words, __uint16_t *page) {
+  int filled = 0;
+  int i = 0;
+  while (i < token_words) {
+    int count = tokens[i] & RLE_COUNT;
+    bool repeat = (tokens[i] & RLE_REPEAT) != 0;
+    ++i;
+    if (filled + count > SNAPSHOT_PAGE_WORDS || i + (repeat ? 1 : count) > token_words) {
+      return false;
+    }
+    if (repeat) {
+      for (int j = 0; j < count; ++j) {
+        page[filled + j] = tokens[i];
+      }
+      ++i;
+    } else {
+      memcpy(&page[filled], &tokens[i], count * sizeof(__uint16_t));
+      i += count;
+    }
+    filled += count;
+  }
+  return filled == SNAPSHOT_PAGE_WORDS;
+}
+
+static bool page_is_zero(const __uint16_t *page) {
+  for (int i = 0; i < SNAPSHOT_PAGE_WORDS; ++i) {
+    if (page[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int save_snapshot(const char *path) {
+  char buf[256];
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    snprintf(buf, sizeof(buf), "Could not open %s for writing", path);
+    error(buf);
+    return EXIT_FAILURE;
+  }
+
+  struct snapshot_header header = {0};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  header.eeprom_checksum = eeprom_checksum(machine.microcode->words, EEPROM_SIZE);
+  header.tick_count = machine.tick_count;
+  memcpy(header.registers, machine.registers, sizeof(header.registers));
+  memcpy(header.segments, machine.segments, sizeof(header.segments));
+  header.alu_a = machine.alu_a;
+  header.alu_b = machine.alu_b;
+  header.mar = machine.mar;
+  header.instruction_register = machine.instruction_register;
+  header.bus = machine.bus;
+  header.u_instruction_register = machine.u_instruction_register;
+  header.u_program_counter = machine.u_program_counter;
+  header.bus_floating = machine.bus_floating;
+  header.running = machine.running;
+  header.flags = peek_flags(&machine);
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+  __uint16_t tokens[2 * SNAPSHOT_PAGE_WORDS];
+  for (int page = 0; ok && page < PAGE_COUNT; ++page) {
+    const __uint16_t *words = &machine.memory[page * SNAPSHOT_PAGE_WORDS];
+    if (page_is_zero(words)) {
+      continue;
+    }
+    struct snapshot_page block = {(__uint16_t) page, encode_page(words, tokens)};
+    ok = fwrite(&block, sizeof(block), 1, out) == 1 &&
+         fwrite(tokens, sizeof(__uint16_t), block.token_words, out) == block.token_words;
+    header.page_count++;
+  }
+  // Patch in the final page count
+  ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+  if (fclose(out) != 0 || !ok) {
+    snprintf(buf, sizeof(buf), "Could not write snapshot %s", path);
+    error(buf);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int load_snapshot(const char *path) {
+  char buf[256];
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    snprintf(buf, sizeof(buf), "Could not open snapshot %s", path);
+    error(buf);
+    return EXIT_FAILURE;
+  }
+  struct snapshot_header header;
+  if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+      (header.version != SNAPSHOT_VERSION && header.version != SNAPSHOT_VERSION_NO_FLAGS)) {
+    snprintf(buf, sizeof(buf), "%s is not a version %d snapshot", path, SNAPSHOT_VERSION);
+    error(buf);
+    fclose(in);
+    return EXIT_FAILURE;
+  }
+  if (header.eeprom_checksum != eeprom_checksum(machine.microcode->words, EEPROM_SIZE)) {
+    snprintf(buf, sizeof(buf), "Snapshot %s was taken with a different EEPROM", path);
+    error(buf);
+    fclose(in);
+    return EXIT_FAILURE;
+  }
+
+  // uIR and uPC index the microcode, and the flags are read back as bools
+  if (header.u_instruction_register >= (EEPROM_SIZE >> 7) || header.u_program_counter >= 128 ||
+      header.running > 1 || header.bus_floating > 1) {
+    snprintf(buf, sizeof(buf), "Snapshot %s is corrupt", path);
+    error(buf);
+    fclose(in);
+    return EXIT_FAILURE;
+  }
+
+  // Decode into a scratch copy first so a corrupt snapshot leaves the machine untouched
+  static __uint16_t restored[MEMORY_SIZE];
+  memset(restored, 0, sizeof(restored));
+  __uint16_t tokens[2 * SNAPSHOT_PAGE_WORDS];
+  bool ok = true;
+  for (__uint32_t i = 0; ok && i < header.page_count; ++i) {
+    struct snapshot_page block;
+    ok = fread(&block, sizeof(block), 1, in) == 1 && block.page < PAGE_COUNT &&
+         block.token_words <= 2 * SNAPSHOT_PAGE_WORDS &&
+         fread(tokens, sizeof(__uint16_t), block.token_words, in) == block.token_words &&
+         decode_page(tokens, block.token_words, &restored[block.page * SNAPSHOT_PAGE_WORDS]);
+  }
+  fclose(in);
+  if (!ok) {
+    snprintf(buf, sizeof(buf), "Snapshot %s is corrupt", path);
+    error(buf);
+    return EXIT_FAILURE;
+  }
+
+  memcpy(machine.memory, restored, sizeof(restored));
+  machine.tick_count = header.tick_count;
+  memcpy(machine.registers, header.registers, sizeof(header.registers));
+  memcpy(machine.segments, header.segments, sizeof(header.segments));
+  refresh_segment_bases(&machine);
+  machine.alu_a = header.alu_a;
+  machine.alu_b = header.alu_b;
+  machine.mar = header.mar;
+  machine.instruction_register = header.instruction_register;
+  machine.bus = header.bus;
+  machine.u_instruction_register = header.u_instruction_register;
+  machine.u_program_counter = header.u_program_counter;
+  machine.bus_floating = header.bus_floating;
+  machine.running = header.running;
+  write_flags(&machine, header.version == SNAPSHOT_VERSION_NO_FLAGS ? 0 : header.flags);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+#include <stdlib.h>
+
+#ifndef VM_SNAPSHOT_H
+#define VM_SNAPSHOT_H
+
+// A snapshot is a header with every register, followed by the non-zero pages of memory, each
+// run-length encoded on its own. Pages that are entirely zero are not stored at all.
+#define SNAPSHOT_VERSION 2
+// Version 1 has no flags, they load as clear
+#define SNAPSHOT_VERSION_NO_FLAGS 1
+#define SNAPSHOT_PAGE_WORDS 256
+
+// Run-length tokens: a token word with RLE_REPEAT set is followed by one word repeated (token &
+// RLE_COUNT) times, otherwise by (token & RLE_COUNT) literal words.
+#define RLE_REPEAT 0x8000
+#define RLE_COUNT 0x7FFF
+
+struct snapshot_header {
+  char magic[8];
+  __uint32_t version;
+  __uint32_t page_count;
+  __uint64_t eeprom_checksum;
+  __uint64_t tick_count;
+  __uint16_t registers[8];
+  __uint16_t segments[4];
+  __uint16_t alu_a;
+  __uint16_t alu_b;
+  __uint16_t mar;
+  __uint16_t instruction_register;
+  __uint16_t bus;
+  __uint8_t u_instruction_register;
+  __uint8_t u_program_counter;
+  __uint8_t bus_floating;
+  __uint8_t running;
+  __uint8_t flags;
+};
+
+struct snapshot_page {
+  __uint16_t page;
+  __uint16_t token_words;
+};
+
+int save_snapshot(const char *path);
+
+int load_snapshot(const char *path);
+
+#endif //VM_SNAPSHOT_H
@@ -0,0 +1,108 @@
+#include <string.h>
+#include "stats.h"
+#include "main.h"
+#include "printing.h"
+
+// Entries shown in each histogram
+#define TOP_ENTRIES 8
+#define OPCODES (EEPROM_SIZE >> 7)
+
+bool stats_enabled;
+__uint64_t stats_counts[EEPROM_SIZE];
+__uint64_t stats_bus_driven;
+// Time spent inside run_ticks() and the ticks it ran, for the host rate
+__uint64_t stats_host_ticks;
+double stats_host_seconds;
+
+void stats_host_time(__uint64_t ticks, double seconds) {
+  stats_host_ticks += ticks;
+  stats_host_seconds += seconds;
+}
+
+void reset_stats(void) {
+  memset(stats_counts, 0, sizeof(stats_counts));
+  stats_bus_driven = 0;
+  stats_host_ticks = 0;
+  stats_host_seconds = 0;
+}
+
+// Indices of the count largest entries of values, largest first
+static int top_entries(const __uint64_t values[], int size, int top[], int count) {
+  int found = 0;
+  for (int i = 0; i < size; ++i) {
+    if (values[i] == 0) {
+      continue;
+    }
+    int position = found < count ? found++ : count;
+    while (position > 0 && values[top[position - 1]] < values[i]) {
+      if (position < count) {
+        top[position] = top[position - 1];
+      }
+      --position;
+    }
+    if (position < count) {
+      top[position] = i;
+    }
+  }
+  return found;
+}
+
+static void report(void (*print_line)(char *msg)) {
+  char buf[128];
+  __uint64_t opcode_counts[OPCODES] = {0};
+  __uint64_t ticks = 0;
+  __uint64_t retired = 0;
+  for (int i = 0; i < EEPROM_SIZE; ++i) {
+    ticks += stats_counts[i];
+    opcode_counts[i >> 7] += stats_counts[i];
+    if (!(machine.microcode->words[i] & neg_uPC_clear)) {
+      retired += stats_counts[i];
+    }
+  }
+  double percent = ticks ? 100.0 / (double) ticks : 0;
+
+  snprintf(buf, sizeof(buf), "Ticks: %llu counted, %llu total", (unsigned long long) ticks,
+           (unsigned long long) machine.tick_count);
+  print_line(buf);
+  snprintf(buf, sizeof(buf), "Instructions retired: %llu (%.2f uops/instruction)", (unsigned long long) retired,
+           retired ? (double) ticks / (double) retired : 0.0);
+  print_line(buf);
+  snprintf(buf, sizeof(buf), "Bus driven: %llu (%.1f%%) idle: %llu", (unsigned long long) stats_bus_driven,
+           (double) stats_bus_driven * percent, (unsigned long long) (ticks - stats_bus_driven));
+  print_line(buf);
+  snprintf(buf, sizeof(buf), "Host rate: %.0f ticks/s",
+           stats_host_seconds > 0 ? (double) stats_host_ticks / stats_host_seconds : 0.0);
+  print_line(buf);
+
+  int top[TOP_ENTRIES];
+  int found = top_entries(stats_counts, EEPROM_SIZE, top, TOP_ENTRIES);
+  print_line("Top microwords (uIR:uPC):");
+  for (int i = 0; i < found && i < TOP_ENTRIES; ++i) {
+    snprintf(buf, sizeof(buf), "  %02x:%-3u %12llu %5.1f%%", top[i] >> 7, top[i] & 0x7F,
+             (unsigned long long) stats_counts[top[i]], (double) stats_counts[top[i]] * percent);
+    print_line(buf);
+  }
+  found = top_entries(opcode_counts, OPCODES, top, TOP_ENTRIES);
+  print_line("Top opcodes (uIR):");
+  for (int i = 0; i < found && i < TOP_ENTRIES; ++i) {
+    snprintf(buf, sizeof(buf), "  %02x     %12llu %5.1f%%", top[i], (unsigned long long) opcode_counts[top[i]],
+             (double) opcode_counts[top[i]] * percent);
+    print_line(buf);
+  }
+}
+
+// Prints the report through info()
+void log_stats(void) {
+  report(info);
+}
+
+FILE *stats_out;
+
+static void print_to_file(char *msg) {
+  fprintf(stats_out, "%s\n", msg);
+}
+
+void dump_stats(FILE *out) {
+  stats_out = out;
+  report(print_to_file);
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "microcode.h"
+
+#ifndef VM_STATS_H
+#define VM_STATS_H
+
+// Performance counters. Only the per-microword counts are kept while running; everything else in
+// the report is derived from them when it is asked for.
+extern bool stats_enabled;
+extern __uint64_t stats_counts[EEPROM_SIZE];
+extern __uint64_t stats_bus_driven;
+
+static inline void count_microword(unsigned index, bool bus_floating) {
+  stats_counts[index]++;
+  stats_bus_driven += !bus_floating;
+}
+
+void stats_host_time(__uint64_t ticks, double seconds);
+
+void reset_stats(void);
+
+void log_stats(void);
+
+void dump_stats(FILE *out);
+
+#endif //VM_STATS_H
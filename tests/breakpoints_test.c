@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+#include "main.h"
+#include "microcode.h"
+#include "breakpoints.h"
+
+// Stops and resumes checked runs on a four microword loop that adds B to A, set up with the same
+// commands the UI takes: a watchpoint stop doesn't hide the breakpoints of the tick it stopped at,
+// resuming from a breakpoint passes it once, and a CS:IP breakpoint only fires when CS:IP moves
+// onto it during the run.
+
+#define NOP do_nothing_bits
+
+static void build_loop(void) {
+  for (int i = 0; i < EEPROM_SIZE; ++i) {
+    loaded_microcode.storage[i] = NOP;
+  }
+  // uPC 0 only runs after reset, uPC clear lands on 1
+  loaded_microcode.storage[1] = (NOP & ~(neg_alu_re | neg_alu_a_W)) | (__uint64_t) 3 << 17;
+  loaded_microcode.storage[4] = NOP & ~neg_uPC_clear;
+  loaded_microcode.words = loaded_microcode.storage;
+  decode_microcode(loaded_microcode.words, loaded_microcode.decoded, EEPROM_SIZE);
+}
+
+static void reset_machine(void) {
+  memset(machine.registers, 0, sizeof(machine.registers));
+  memset(machine.segments, 0, sizeof(machine.segments));
+  refresh_segment_bases(&machine);
+  machine.alu_a = 0;
+  machine.alu_b = 1;
+  machine.u_instruction_register = 0;
+  machine.u_program_counter = 0;
+  machine.tick_count = 0;
+  machine.running = true;
+}
+
+// A checked run that has to stop at tick with a hit message containing what
+static void check_stop(__uint64_t tick, const char *what) {
+  run_ticks_checked(&machine, 100);
+  check(breakpoint_hit);
+  check(machine.tick_count == tick);
+  check(strstr(last_hit(), what) != NULL);
+}
+
+static void test_watch_then_break(void) {
+  reset_machine();
+  debug_command("watch a");
+  debug_command("break uop 0:2");
+  // A changes in the tick that runs uPC 1, which leaves the machine before uPC 2
+  check_stop(2, "watch a");
+  check_stop(2, "break uop");
+  check_stop(6, "watch a");
+  check_stop(6, "break uop");
+  debug_command("delete all");
+}
+
+static void test_csip_edge(void) {
+  reset_machine();
+  debug_command("break csip 0:0x10");
+  // Leaves the last checked CS:IP at 0:0
+  run_ticks_checked(&machine, 10);
+  check(!breakpoint_hit);
+  // Moved there outside of a checked run, like a single step or loading a snapshot would
+  write_segment(&machine, 1, 0x10);
+  run_ticks_checked(&machine, 10);
+  check(!breakpoint_hit);
+  check(machine.tick_count == 20);
+  debug_command("delete all");
+}
+
+int main(void) {
+  build_loop();
+  machine.memory = calloc(MEMORY_SIZE, sizeof(__uint16_t));
+  if (machine.memory == NULL) {
+    printf("Could not allocate memory\n");
+    return EXIT_FAILURE;
+  }
+  test_watch_then_break();
+  test_csip_edge();
+  free(machine.memory);
+  return check_result();
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef VM_TESTS_CHECK_H
+#define VM_TESTS_CHECK_H
+
+// Every test program is one translation unit that counts its failed checks and returns
+// check_result() from main, so ctest sees a failure but every check still runs.
+static int failed_checks;
+
+#define check(condition) do {\
+    if (!(condition)) {\
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);\
+      ++failed_checks;\
+    }\
+  } while (0)
+
+static inline int check_result(void) {
+  if (failed_checks != 0) {
+    printf("%d checks failed\n", failed_checks);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+#endif //VM_TESTS_CHECK_H
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "check.h"
+#include "main.h"
+#include "microcode.h"
+#include "fused.h"
+#include "fastforward.h"
+
+// Runs random microcode stepped, as fused blocks and fast-forwarded from the same random start, and
+// checks that every mode ends in the same state. The fast modes run in uneven budgets so blocks are
+// also cut short. The images come in a few kinds, each asserting what one part of the core cares
+// about, with decodes, uPC clears, micro-jumps and the odd halt mixed in. Every image also runs
+// with an interrupt pending, so decodes enter the interrupt microcode.
+//
+// Built into aot_equivalence_test it loads the image vm_aot was generated from instead, and its
+// fused runs go through the compiled microcode.
+
+#define IMAGES_PER_KIND 8
+#define RUN_TICKS 100000
+#define MAX_BUDGET 5000
+
+#ifdef VM_AOT
+#define FUSED_MODE "compiled"
+#else
+#define FUSED_MODE "fused"
+#endif
+
+static __uint64_t random_state;
+
+static __uint32_t random_next(void) {
+  // splitmix64
+  __uint64_t z = (random_state += 0x9E3779B97F4A7C15);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+  return (__uint32_t) ((z ^ (z >> 31)) >> 32);
+}
+
+#ifndef VM_AOT
+#define NOP do_nothing_bits
+#define with_alu(word, operation) ((word) | (__uint64_t) (operation) << 17)
+#define with_address_mode(word, mode) ((word) | (__uint64_t) (mode) << 22)
+#define with_jump(word, condition) ((word) | (__uint64_t) (condition) << 32)
+#define with_segment(word, segment) ((word) | (__uint64_t) (segment) << 36)
+
+enum kind {
+  // Registers, segments and the ALU only, what fused blocks cover
+  KIND_REGISTERS,
+  // Adds an occasional micro-jump, memory or flags access, out W, interrupt vector read or
+  // acknowledge, and bus conflicts
+  KIND_MIXED,
+  // Memory through every address mode
+  KIND_SEGMENTED,
+  // ALU results into the flags, read back by flag R and tested by micro-jumps
+  KIND_FLAGS
+};
+
+static const char *kind_names[] = {"registers", "mixed", "segmented", "flags"};
+
+enum driver {
+  DRIVER_NONE,
+  DRIVER_SEGMENT,
+  DRIVER_REGISTER,
+  DRIVER_ALU,
+  DRIVER_MEMORY,
+  DRIVER_FLAGS
+};
+
+static const enum driver drivers[][6] = {
+    [KIND_REGISTERS] = {DRIVER_SEGMENT, DRIVER_REGISTER, DRIVER_ALU, DRIVER_NONE, DRIVER_ALU, DRIVER_ALU},
+    [KIND_MIXED] = {DRIVER_SEGMENT, DRIVER_REGISTER, DRIVER_ALU, DRIVER_NONE, DRIVER_ALU, DRIVER_ALU},
+    [KIND_SEGMENTED] = {DRIVER_SEGMENT, DRIVER_REGISTER, DRIVER_ALU, DRIVER_MEMORY, DRIVER_MEMORY, DRIVER_MEMORY},
+    [KIND_FLAGS] = {DRIVER_SEGMENT, DRIVER_REGISTER, DRIVER_ALU, DRIVER_ALU, DRIVER_MEMORY, DRIVER_FLAGS},
+};
+
+// True percent times in a hundred, a tenth of a percent at a time
+static bool chance(double percent) {
+  return random_next() % 1000 < (__uint32_t) (percent * 10);
+}
+
+static __uint64_t random_word(enum kind kind, int index) {
+  __uint64_t word = NOP;
+  enum driver driver = drivers[kind][random_next() % 6];
+  switch (driver) {
+    case DRIVER_SEGMENT:
+      word &= ~neg_seg_en;
+      break;
+    case DRIVER_REGISTER:
+      word &= ~neg_reg_en;
+      word |= chance(50) ? reg_sel : 0;
+      break;
+    case DRIVER_ALU:
+      word &= ~neg_alu_re;
+      break;
+    case DRIVER_MEMORY:
+      word &= ~neg_mem_R;
+      break;
+    case DRIVER_FLAGS:
+      word &= ~neg_flag_R;
+      break;
+    default:
+      break;
+  }
+  word &= chance(30) ? ~neg_mar_W : ~(__uint64_t) 0;
+  word &= chance(30) ? ~neg_alu_a_W : ~(__uint64_t) 0;
+  word &= chance(30) ? ~neg_alu_b_W : ~(__uint64_t) 0;
+  word |= chance(30) ? ir_W : 0;
+  if (driver != DRIVER_SEGMENT && chance(25)) {
+    word = (word & ~neg_seg_en) | seg_W;
+  }
+  if (driver != DRIVER_REGISTER && chance(25)) {
+    word = (word & ~neg_reg_en) | reg_W | (chance(50) ? reg_sel : 0);
+  }
+  if (kind == KIND_SEGMENTED || kind == KIND_FLAGS) {
+    word &= driver != DRIVER_MEMORY && chance(30) ? ~neg_mem_W : ~(__uint64_t) 0;
+    word = with_address_mode(word, random_next() % 4);
+  }
+  if (kind == KIND_FLAGS) {
+    word &= chance(40) ? ~neg_flag_W : ~(__uint64_t) 0;
+    word |= chance(30) ? flag_sel_bus : 0;
+    // Never on the last microword of a program, a skip there would run off its end
+    word &= (index & 0x7F) < 120 && chance(15) ? ~neg_jmp_re : ~(__uint64_t) 0;
+  }
+  if (kind == KIND_MIXED && chance(5)) {
+    static const __uint64_t extras[] = {neg_jmp_re, neg_mem_R, neg_flag_R, neg_out_W, neg_flag_W, neg_int_re};
+    word &= ~extras[random_next() % 6];
+  }
+  word |= kind == KIND_MIXED && chance(1) ? inta : 0;
+  word &= chance(10) ? ~neg_uPC_clear : ~(__uint64_t) 0;
+  word &= chance(3) ? ~neg_uIP_W : ~(__uint64_t) 0;
+  word &= chance(3) ? ~neg_decode_R : ~(__uint64_t) 0;
+  if (chance(20)) {
+    word |= chance(50) ? shift_left : shift_right;
+  }
+  word |= chance(20) ? cin : 0;
+  word |= chance(0.1) ? halt : 0;
+  word = with_alu(word, random_next() % 8);
+  word = with_jump(word, kind == KIND_SEGMENTED ? 0 : random_next() % 16);
+  return with_segment(word, random_next() % 4);
+}
+
+static void build_image(enum kind kind) {
+  for (int i = 0; i < EEPROM_SIZE; ++i) {
+    loaded_microcode.storage[i] = random_word(kind, i);
+  }
+  loaded_microcode.words = loaded_microcode.storage;
+  decode_microcode(loaded_microcode.words, loaded_microcode.decoded, EEPROM_SIZE);
+  build_fused_blocks(&loaded_microcode);
+  build_instructions(&loaded_microcode);
+}
+#endif
+
+static void random_start(struct vm *vm, __uint16_t *memory) {
+  memset(vm, 0, sizeof(*vm));
+  for (int i = 0; i < MEMORY_SIZE; ++i) {
+    memory[i] = (__uint16_t) random_next();
+  }
+  for (int i = 0; i < 8; ++i) {
+    vm->registers[i] = (__uint16_t) random_next();
+  }
+  for (unsigned i = 0; i < 4; ++i) {
+    write_segment(vm, i, (__uint16_t) random_next());
+  }
+  vm->alu_a = (__uint16_t) random_next();
+  vm->alu_b = (__uint16_t) random_next();
+  vm->mar = (__uint16_t) random_next();
+  vm->instruction_register = (__uint16_t) random_next();
+  vm->memory = memory;
+  vm->microcode = &loaded_microcode;
+  vm->next_event = UINT64_MAX;
+  vm->running = true;
+  vm->quiet = true;
+}
+
+// Runs a copy of start for RUN_TICKS, in one call or in random budgets
+static void run_copy(const struct vm *start, struct vm *vm, __uint16_t *memory, bool fused, bool split) {
+  *vm = *start;
+  memcpy(memory, start->memory, MEMORY_SIZE * sizeof(__uint16_t));
+  vm->memory = memory;
+  while (vm->running && vm->tick_count < RUN_TICKS) {
+    __uint64_t budget = split ? 1 + random_next() % MAX_BUDGET : RUN_TICKS;
+    __uint64_t left = RUN_TICKS - vm->tick_count;
+    run_ticks(vm, budget < left ? budget : left, fused);
+  }
+}
+
+static bool same_state(struct vm *a, struct vm *b) {
+  return memcmp(a->registers, b->registers, sizeof(a->registers)) == 0 &&
+         memcmp(a->segments, b->segments, sizeof(a->segments)) == 0 &&
+         memcmp(a->segment_bases, b->segment_bases, sizeof(a->segment_bases)) == 0 && a->alu_a == b->alu_a &&
+         a->alu_b == b->alu_b && a->mar == b->mar && a->instruction_register == b->instruction_register &&
+         a->u_instruction_register == b->u_instruction_register && a->u_program_counter == b->u_program_counter &&
+         a->bus_floating == b->bus_floating && a->bus == b->bus && peek_flags(a) == peek_flags(b) &&
+         a->running == b->running && a->tick_count == b->tick_count && a->errors == b->errors &&
+         a->interrupts_pending == b->interrupts_pending &&
+         memcmp(a->memory, b->memory, MEMORY_SIZE * sizeof(__uint16_t)) == 0;
+}
+
+static void report(const char *mode, const char *image, struct vm *expected, struct vm *actual) {
+  printf("%s differs from stepped on %s\n", mode, image);
+  printf("stepped:\n");
+  dump_machine(stdout, expected);
+  printf("%s:\n", mode);
+  dump_machine(stdout, actual);
+}
+
+// Runs the loaded image from a random start with the given interrupt lines pending in every mode.
+// memory holds four machines' worth.
+static void compare_modes(const char *name, __uint16_t *memory, __uint8_t interrupts) {
+  struct vm start, stepped, fused;
+  random_start(&start, memory);
+  start.interrupts_pending = interrupts;
+
+  fast_forward = false;
+  run_copy(&start, &stepped, memory + MEMORY_SIZE, false, false);
+  run_copy(&start, &fused, memory + 2 * MEMORY_SIZE, true, true);
+  check(stepped.tick_count > 0);
+  if (!same_state(&stepped, &fused)) {
+    report(FUSED_MODE, name, &stepped, &fused);
+    check(false);
+  }
+#ifndef VM_AOT
+  // Compiled microcode runs instead of fast-forward, so only the interpreter has this mode
+  struct vm skipped;
+  fast_forward = true;
+  run_copy(&start, &skipped, memory + 3 * MEMORY_SIZE, true, true);
+  fast_forward = false;
+  if (!same_state(&stepped, &skipped)) {
+    report("fast-forward", name, &stepped, &skipped);
+    check(false);
+  }
+#endif
+}
+
+int main(int argc, char *argv[]) {
+  __uint16_t *memory = malloc(4 * MEMORY_SIZE * sizeof(__uint16_t));
+  if (memory == NULL) {
+    printf("Could not allocate memory\n");
+    return EXIT_FAILURE;
+  }
+  char name[256];
+#ifdef VM_AOT
+  if (argc != 2 || load_microcode(argv[1], &loaded_microcode) == EXIT_FAILURE) {
+    printf("Usage: ./aot_equivalence_test EEPROM_file\n");
+    free(memory);
+    return EXIT_FAILURE;
+  }
+  check(loaded_microcode.aot);
+  for (int i = 0; i < IMAGES_PER_KIND; ++i) {
+    random_state = (__uint64_t) i;
+    snprintf(name, sizeof(name), "%s from start %d", argv[1], i);
+    compare_modes(name, memory, 0);
+    snprintf(name, sizeof(name), "%s from start %d with interrupts", argv[1], i);
+    compare_modes(name, memory, (__uint8_t) (1 + random_next() % 0xFF));
+  }
+#else
+  (void) argc;
+  (void) argv;
+  for (enum kind kind = KIND_REGISTERS; kind <= KIND_FLAGS; ++kind) {
+    for (int image = 0; image < IMAGES_PER_KIND; ++image) {
+      snprintf(name, sizeof(name), "%s image %d", kind_names[kind], image);
+      random_state = (__uint64_t) kind << 32 | (__uint64_t) image;
+      build_image(kind);
+      compare_modes(name, memory, 0);
+      snprintf(name, sizeof(name), "%s image %d with interrupts", kind_names[kind], image);
+      compare_modes(name, memory, (__uint8_t) (1 + random_next() % 0xFF));
+    }
+  }
+#endif
+  free(memory);
+  return check_result();
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "check.h"
+#include "main.h"
+#include "scheduler.h"
+
+// Drives the event heap directly on a bare machine: events fire in tick order however they were
+// scheduled, cancelling keeps the rest in order, and handlers can schedule again.
+
+#define MAX_FIRED 256
+
+struct firing {
+  __uint64_t tick;
+  int handler;
+};
+
+static struct firing fired[MAX_FIRED];
+static int fired_count;
+
+static void record(struct vm *vm, int handler) {
+  if (fired_count < MAX_FIRED) {
+    fired[fired_count++] = (struct firing) {vm->tick_count, handler};
+  }
+}
+
+static void fire_1(struct vm *vm) {
+  record(vm, 1);
+}
+
+static void fire_2(struct vm *vm) {
+  record(vm, 2);
+}
+
+static void fire_3(struct vm *vm) {
+  record(vm, 3);
+}
+
+// Schedules fire_1 again for the tick it runs in
+static void fire_again(struct vm *vm) {
+  record(vm, 4);
+  schedule_event(vm, vm->tick_count, fire_1);
+}
+
+static void reset(struct vm *vm, struct scheduler *events) {
+  memset(events, 0, sizeof(*events));
+  memset(vm, 0, sizeof(*vm));
+  vm->scheduler = events;
+  vm->next_event = UINT64_MAX;
+  vm->quiet = true;
+  fired_count = 0;
+}
+
+// Runs due events every tick up to end, like step() does
+static void run_until(struct vm *vm, __uint64_t end) {
+  for (; vm->tick_count <= end; ++vm->tick_count) {
+    if (vm->tick_count >= vm->next_event) {
+      run_due_events(vm);
+    }
+  }
+}
+
+// A full heap scheduled out of order fires once per event, each at its own tick
+static void test_ordering(void) {
+  struct vm vm;
+  struct scheduler events;
+  reset(&vm, &events);
+  int scheduled[MAX_EVENTS + 1] = {0};
+  __uint32_t seed = 12345;
+  for (int i = 0; i < MAX_EVENTS; ++i) {
+    seed = seed * 1103515245 + 12345;
+    __uint64_t tick = 1 + (seed >> 16) % MAX_EVENTS;
+    ++scheduled[tick];
+    check(schedule_event(&vm, tick, fire_1) == EXIT_SUCCESS);
+  }
+  check(events.count == MAX_EVENTS);
+  __uint64_t first = 1;
+  while (scheduled[first] == 0) {
+    ++first;
+  }
+  check(vm.next_event == first);
+  check(schedule_event(&vm, 1, fire_2) == EXIT_FAILURE);
+  check(vm.errors == 1 && strcmp(vm.first_error, "Too many scheduled events") == 0);
+
+  run_until(&vm, MAX_EVENTS + 1);
+  check(fired_count == MAX_EVENTS);
+  int at_tick[MAX_EVENTS + 2] = {0};
+  for (int i = 0; i < fired_count; ++i) {
+    check(i == 0 || fired[i].tick >= fired[i - 1].tick);
+    check(fired[i].handler == 1);
+    check(fired[i].tick <= MAX_EVENTS + 1);
+    ++at_tick[fired[i].tick];
+  }
+  for (int tick = 0; tick <= MAX_EVENTS; ++tick) {
+    check(at_tick[tick] == scheduled[tick]);
+  }
+  check(events.count == 0);
+  check(vm.next_event == UINT64_MAX);
+}
+
+// Events that all came due while the machine ran on still fire earliest first
+static void test_overdue(void) {
+  struct vm vm;
+  struct scheduler events;
+  reset(&vm, &events);
+  schedule_event(&vm, 30, fire_3);
+  schedule_event(&vm, 10, fire_1);
+  schedule_event(&vm, 20, fire_2);
+  check(vm.next_event == 10);
+  vm.tick_count = 100;
+  run_due_events(&vm);
+  check(fired_count == 3);
+  for (int i = 0; i < fired_count; ++i) {
+    check(fired[i].handler == i + 1);
+  }
+}
+
+static void test_cancel(void) {
+  struct vm vm;
+  struct scheduler events;
+  reset(&vm, &events);
+  for (int i = 0; i < 10; ++i) {
+    schedule_event(&vm, 10 - i, i % 2 ? fire_1 : fire_2);
+  }
+  check(vm.next_event == 1);
+  cancel_events(&vm, fire_1);
+  check(events.count == 5);
+  check(vm.next_event == 2);
+  run_until(&vm, 20);
+  check(fired_count == 5);
+  for (int i = 0; i < fired_count; ++i) {
+    check(fired[i].handler == 2);
+    check(fired[i].tick == (__uint64_t) (2 * i + 2));
+  }
+}
+
+static void test_reschedule(void) {
+  struct vm vm;
+  struct scheduler events;
+  reset(&vm, &events);
+  schedule_event(&vm, 5, fire_again);
+  run_until(&vm, 10);
+  check(fired_count == 2);
+  check(fired[0].handler == 4 && fired[0].tick == 5);
+  check(fired[1].handler == 1 && fired[1].tick == 5);
+  check(vm.next_event == UINT64_MAX);
+}
+
+static void test_no_scheduler(void) {
+  struct vm vm;
+  struct scheduler events;
+  reset(&vm, &events);
+  vm.scheduler = NULL;
+  check(schedule_event(&vm, 1, fire_1) == EXIT_FAILURE);
+  check(vm.errors == 1 && strcmp(vm.first_error, "No event scheduler attached") == 0);
+  run_due_events(&vm);
+  check(vm.next_event == UINT64_MAX);
+}
+
+int main(void) {
+  test_ordering();
+  test_overdue();
+  test_cancel();
+  test_reschedule();
+  test_no_scheduler();
+  return check_result();
+}
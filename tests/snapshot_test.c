@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "check.h"
+#include "main.h"
+#include "microcode.h"
+#include "snapshot.h"
+
+// Saves a machine whose memory covers the run-length encoder's cases, loads it back into a
+// clobbered machine and compares everything. Then the same file as version 1, and corrupted.
+
+#define SNAPSHOT_PATH "snapshot_test.snap"
+
+static __uint16_t expected_memory[MEMORY_SIZE];
+
+static __uint16_t *page(int number) {
+  return &machine.memory[number * SNAPSHOT_PAGE_WORDS];
+}
+
+static void fill_memory(void) {
+  memset(machine.memory, 0, MEMORY_SIZE * sizeof(__uint16_t));
+  // Page 0 stays zero and isn't stored
+  for (int i = 0; i < SNAPSHOT_PAGE_WORDS; ++i) {
+    page(1)[i] = 0xBEEF;               // One repeat
+    page(2)[i] = (__uint16_t) i;       // One literal run
+    page(3)[i] = (__uint16_t) (i / 2); // Pairs are too short to repeat
+  }
+  // Literals, a repeat of exactly the minimum, a repeat to the end of the page
+  __uint16_t *mixed = page(4);
+  mixed[0] = 1;
+  mixed[1] = 2;
+  mixed[2] = mixed[3] = mixed[4] = 7;
+  for (int i = 5; i < SNAPSHOT_PAGE_WORDS; ++i) {
+    mixed[i] = 9;
+  }
+  // A lone word in the last page
+  page(MEMORY_SIZE / SNAPSHOT_PAGE_WORDS - 1)[0] = 0x1234;
+  memcpy(expected_memory, machine.memory, sizeof(expected_memory));
+}
+
+static void set_state(void) {
+  for (int i = 0; i < 8; ++i) {
+    machine.registers[i] = (__uint16_t) (0x1111 * (i + 1));
+  }
+  for (unsigned i = 0; i < 4; ++i) {
+    write_segment(&machine, i, (__uint16_t) (0x0100 + i));
+  }
+  machine.alu_a = 0x7FFF;
+  machine.alu_b = 0x0001;
+  // Pending flags are saved worked out: overflow and sign
+  record_alu_flags(&machine, 3, 0);
+  machine.mar = 0xABCD;
+  machine.instruction_register = 0x0420;
+  machine.bus = 0x00FF;
+  machine.bus_floating = false;
+  machine.u_instruction_register = 0x21;
+  machine.u_program_counter = 0x45;
+  machine.running = true;
+  machine.tick_count = 123456789;
+}
+
+static void clobber_state(void) {
+  memset(machine.memory, 0x55, MEMORY_SIZE * sizeof(__uint16_t));
+  memset(machine.registers, 0xEE, sizeof(machine.registers));
+  for (unsigned i = 0; i < 4; ++i) {
+    write_segment(&machine, i, 0xEEEE);
+  }
+  machine.alu_a = machine.alu_b = machine.mar = machine.instruction_register = machine.bus = 0xEEEE;
+  write_flags(&machine, FLAGS_MASK);
+  machine.bus_floating = true;
+  machine.u_instruction_register = 0;
+  machine.u_program_counter = 0;
+  machine.running = false;
+  machine.tick_count = 0;
+}
+
+static void check_state(__uint8_t flags) {
+  for (int i = 0; i < 8; ++i) {
+    check(machine.registers[i] == (__uint16_t) (0x1111 * (i + 1)));
+  }
+  for (int i = 0; i < 4; ++i) {
+    check(machine.segments[i] == 0x0100 + i);
+    check(machine.segment_bases[i] == (__uint16_t) ((0x0100 + i) << SEGMENT_SHIFT));
+  }
+  check(machine.alu_a == 0x7FFF);
+  check(machine.alu_b == 0x0001);
+  check(read_flags(&machine) == flags);
+  check(machine.mar == 0xABCD);
+  check(machine.instruction_register == 0x0420);
+  check(machine.bus == 0x00FF);
+  check(!machine.bus_floating);
+  check(machine.u_instruction_register == 0x21);
+  check(machine.u_program_counter == 0x45);
+  check(machine.running);
+  check(machine.tick_count == 123456789);
+  check(memcmp(machine.memory, expected_memory, sizeof(expected_memory)) == 0);
+}
+
+// Reads the saved page table back to check the encoder's choices
+static void check_encoding(void) {
+  FILE *in = fopen(SNAPSHOT_PATH, "rb");
+  check(in != NULL);
+  if (in == NULL) {
+    return;
+  }
+  struct snapshot_header header;
+  check(fread(&header, sizeof(header), 1, in) == 1);
+  check(header.page_count == 5);
+  // Token words of pages 1-4 and the last: a repeat, one literal run, one literal run, a literal run
+  // and two repeats, and one literal word then a repeat of the zeros
+  static const struct snapshot_page expected[] = {{1, 2}, {2, 257}, {3, 257}, {4, 3 + 2 + 2},
+                                                  {MEMORY_SIZE / SNAPSHOT_PAGE_WORDS - 1, 2 + 2}};
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+    struct snapshot_page block = {0};
+    __uint16_t tokens[2 * SNAPSHOT_PAGE_WORDS];
+    check(fread(&block, sizeof(block), 1, in) == 1);
+    check(block.page == expected[i].page);
+    check(block.token_words == expected[i].token_words);
+    check(block.token_words <= 2 * SNAPSHOT_PAGE_WORDS &&
+          fread(tokens, sizeof(__uint16_t), block.token_words, in) == block.token_words);
+  }
+  check(fgetc(in) == EOF);
+  fclose(in);
+}
+
+// Overwrites bytes of the saved file in place
+static void patch(long offset, const void *bytes, size_t size) {
+  FILE *file = fopen(SNAPSHOT_PATH, "r+b");
+  check(file != NULL);
+  if (file == NULL) {
+    return;
+  }
+  check(fseek(file, offset, SEEK_SET) == 0);
+  check(fwrite(bytes, size, 1, file) == 1);
+  fclose(file);
+}
+
+int main(void) {
+  for (int i = 0; i < EEPROM_SIZE; ++i) {
+    loaded_microcode.storage[i] = do_nothing_bits;
+  }
+  loaded_microcode.words = loaded_microcode.storage;
+  machine.memory = calloc(MEMORY_SIZE, sizeof(__uint16_t));
+  if (machine.memory == NULL) {
+    printf("Could not allocate memory\n");
+    return EXIT_FAILURE;
+  }
+
+  fill_memory();
+  set_state();
+  __uint8_t flags = peek_flags(&machine);
+  check(flags == (FLAG_SIGN | FLAG_OVERFLOW));
+  check(save_snapshot(SNAPSHOT_PATH) == EXIT_SUCCESS);
+  check_encoding();
+  clobber_state();
+  check(load_snapshot(SNAPSHOT_PATH) == EXIT_SUCCESS);
+  check_state(flags);
+
+  // Version 1 has no flags byte, whatever is there loads as clear
+  __uint32_t version = SNAPSHOT_VERSION_NO_FLAGS;
+  __uint8_t garbage = 0xFF;
+  patch(offsetof(struct snapshot_header, version), &version, sizeof(version));
+  patch(offsetof(struct snapshot_header, flags), &garbage, sizeof(garbage));
+  clobber_state();
+  check(load_snapshot(SNAPSHOT_PATH) == EXIT_SUCCESS);
+  check_state(0);
+
+  // A repeat longer than its page is rejected and leaves the machine as it was
+  __uint16_t token = RLE_REPEAT | (SNAPSHOT_PAGE_WORDS + 1);
+  patch(sizeof(struct snapshot_header) + sizeof(struct snapshot_page), &token, sizeof(token));
+  check(load_snapshot(SNAPSHOT_PATH) == EXIT_FAILURE);
+  check_state(0);
+
+  remove(SNAPSHOT_PATH);
+  free(machine.memory);
+  return check_result();
+}
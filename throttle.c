@@ -0,0 +1,82 @@
+#include <errno.h>
+#include "throttle.h"
+
+// Longest backlog that is caught up on. Anything older (e.g. the host was suspended) is dropped
+// rather than replayed in one burst.
+#define MAX_CATCH_UP 0.1
+#define RATE_WINDOW 0.5
+
+static double seconds_between(const struct timespec *start, const struct timespec *end) {
+  return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) / 1E9;
+}
+
+static struct timespec add_seconds(struct timespec t, double seconds) {
+  time_t whole = (time_t) seconds;
+  t.tv_sec += whole;
+  t.tv_nsec += (long) ((seconds - (double) whole) * 1E9);
+  while (t.tv_nsec >= 1000000000L) {
+    t.tv_nsec -= 1000000000L;
+    t.tv_sec++;
+  }
+  return t;
+}
+
+void throttle_start(struct throttle *throttle, double rate) {
+  throttle->rate = rate;
+  clock_gettime(CLOCK_MONOTONIC, &throttle->start);
+  throttle->ticks_done = 0;
+  throttle->window_start = throttle->start;
+  throttle->window_ticks = 0;
+  throttle->achieved_rate = 0;
+}
+
+__uint64_t throttle_ticks_due(struct throttle *throttle) {
+  if (throttle->rate <= 0) {
+    return UNTHROTTLED_BATCH;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = seconds_between(&throttle->start, &now);
+  __uint64_t target = (__uint64_t) (elapsed * throttle->rate);
+  if (target <= throttle->ticks_done) {
+    return 0;
+  }
+  __uint64_t due = target - throttle->ticks_done;
+  __uint64_t max_due = (__uint64_t) (throttle->rate * MAX_CATCH_UP) + 1;
+  if (due > max_due) {
+    // Rebase so that the dropped ticks aren't owed any more
+    throttle->start = add_seconds(throttle->start, (double) (due - max_due) / throttle->rate);
+    due = max_due;
+  }
+  return due;
+}
+
+void throttle_ticks_done(struct throttle *throttle, __uint64_t ticks) {
+  throttle->ticks_done += ticks;
+  throttle->window_ticks += ticks;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double window = seconds_between(&throttle->window_start, &now);
+  if (window >= RATE_WINDOW) {
+    throttle->achieved_rate = (double) throttle->window_ticks / window;
+    throttle->window_start = now;
+    throttle->window_ticks = 0;
+  }
+}
+
+// Sleeps until the next tick is due, but for at most max_wait seconds so the caller can stay
+// responsive at low rates.
+void throttle_wait(struct throttle *throttle, double max_wait) {
+  if (throttle->rate <= 0) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  struct timespec deadline = add_seconds(throttle->start, (double) (throttle->ticks_done + 1) / throttle->rate);
+  struct timespec latest = add_seconds(now, max_wait);
+  if (seconds_between(&latest, &deadline) > 0) {
+    deadline = latest;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+  }
+}
@@ -0,0 +1,31 @@
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef VM_THROTTLE_H
+#define VM_THROTTLE_H
+
+// Ticks handed out per batch when unthrottled
+#define UNTHROTTLED_BATCH 4096
+
+// Paces the clock against absolute deadlines on the monotonic clock: tick n is due at
+// start + n / rate, so sleeping late or running a batch slowly doesn't accumulate drift.
+struct throttle {
+  double rate; // Target rate in Hz, 0 for unthrottled
+  struct timespec start;
+  __uint64_t ticks_done;
+
+  // Achieved rate, measured over windows of about half a second
+  struct timespec window_start;
+  __uint64_t window_ticks;
+  double achieved_rate;
+};
+
+void throttle_start(struct throttle *throttle, double rate);
+
+__uint64_t throttle_ticks_due(struct throttle *throttle);
+
+void throttle_ticks_done(struct throttle *throttle, __uint64_t ticks);
+
+void throttle_wait(struct throttle *throttle, double max_wait);
+
+#endif //VM_THROTTLE_H
@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include "timer.h"
+#include "main.h"
+#include "scheduler.h"
+#include "interrupts.h"
+
+// The one timer on the interactive machine's bus, read and written only through its registers
+struct timer {
+  __uint16_t period;
+  __uint16_t count;
+};
+
+static struct timer timer;
+
+static void timer_expired(struct vm *vm) {
+  raise_interrupt(vm, TIMER_LINE);
+  timer.count++;
+  schedule_event(vm, vm->tick_count + timer.period, timer_expired);
+}
+
+static void timer_write(struct vm *vm, __uint16_t offset, __uint16_t value) {
+  if (offset == TIMER_PERIOD) {
+    timer.period = value;
+    cancel_events(vm, timer_expired);
+    if (value != 0) {
+      schedule_event(vm, vm->tick_count + value, timer_expired);
+    }
+  } else if (offset == TIMER_COUNT) {
+    timer.count = value;
+  }
+}
+
+static __uint16_t timer_read(struct vm *vm, __uint16_t offset) {
+  (void) vm;
+  return offset == TIMER_PERIOD ? timer.period : timer.count;
+}
+
+int timer_attach(struct io_bus *bus) {
+  struct io_device device = {"timer", TIMER_BASE, TIMER_REGISTERS, timer_read, timer_write};
+  return io_register(bus, &device);
+}
@@ -0,0 +1,17 @@
+#include <stdbool.h>
+#include "io.h"
+
+#ifndef VM_TIMER_H
+#define VM_TIMER_H
+
+// A periodic timer mapped at TIMER_BASE. Writing a period in ticks starts it and 0 stops it. Every
+// period it raises TIMER_LINE and counts the expiry.
+#define TIMER_BASE 0xFF10
+#define TIMER_PERIOD 0
+#define TIMER_COUNT 1
+#define TIMER_REGISTERS 2
+#define TIMER_LINE 0
+
+int timer_attach(struct io_bus *bus);
+
+#endif //VM_TIMER_H
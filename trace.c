@@ -0,0 +1,75 @@
+#include <string.h>
+#include "trace.h"
+#include "microcode.h"
+#include "printing.h"
+
+bool trace_enabled;
+struct trace_record trace_buffer[TRACE_SIZE];
+__uint64_t trace_next;
+
+const char *trace_path;
+bool trace_flushed;
+
+static const char *action_names[32] = {
+    [ACT_MEM_R] = "mem R", [ACT_SEG_R] = "seg R", [ACT_REG_R] = "reg R", [ACT_FLAG_R] = "flag R",
+    [ACT_ALU_RE] = "ALU R", [ACT_JMP_RE] = "jmp", [ACT_INT_RE] = "int R", [ACT_DECODE_R] = "decode",
+    [ACT_INTA] = "inta", [ACT_UIP_W] = "write uIP", [ACT_OUT_W] = "out W", [ACT_MEM_W] = "mem W",
+    [ACT_MAR_W] = "mar W", [ACT_SEG_W] = "seg W", [ACT_REG_W] = "reg W", [ACT_FLAG_W] = "flag W",
+    [ACT_ALU_A_W] = "ALU A W", [ACT_ALU_B_W] = "ALU B W", [ACT_UPC_CLEAR] = "PC CLR", [ACT_IR_W] = "IR W",
+    [ACT_HALT] = "Halt"
+};
+
+void format_trace_record(const struct trace_record *record, char *buf, size_t size) {
+  unsigned index = record->index & (EEPROM_SIZE - 1);
+  int used;
+  if (record->index & TRACE_BUS_FLOATING) {
+    used = snprintf(buf, size, "%8llu uIR %02x uPC %3u bus ----  ", (unsigned long long) record->tick, index >> 7,
+                    index & 0x7F);
+  } else {
+    used = snprintf(buf, size, "%8llu uIR %02x uPC %3u bus %04x  ", (unsigned long long) record->tick, index >> 7,
+                    index & 0x7F, record->bus);
+  }
+  __uint32_t actions = record->actions;
+  while (actions && used > 0 && (size_t) used < size) {
+    int action = __builtin_ctz(actions);
+    actions &= actions - 1;
+    used += snprintf(buf + used, size - used, "[%s]", action_names[action] ? action_names[action] : "?");
+  }
+}
+
+// Prints the last count records through info()
+void log_trace(int count) {
+  __uint64_t available = trace_next < TRACE_SIZE ? trace_next : TRACE_SIZE;
+  if ((__uint64_t) count > available) {
+    count = (int) available;
+  }
+  char buf[256];
+  for (__uint64_t i = trace_next - count; i < trace_next; ++i) {
+    format_trace_record(&trace_buffer[i & (TRACE_SIZE - 1)], buf, sizeof(buf));
+    info(buf);
+  }
+}
+
+void set_trace_file(const char *path) {
+  trace_path = path;
+}
+
+// Writes the whole buffer, oldest record first, to the trace file if one was given. Only the first
+// call (the first error, halt or the end of a headless run) writes anything.
+void flush_trace_once(void) {
+  if (trace_path == NULL || trace_flushed) {
+    return;
+  }
+  trace_flushed = true;
+  FILE *out = fopen(trace_path, "w");
+  if (out == NULL) {
+    return;
+  }
+  __uint64_t first = trace_next < TRACE_SIZE ? 0 : trace_next - TRACE_SIZE;
+  char buf[256];
+  for (__uint64_t i = first; i < trace_next; ++i) {
+    format_trace_record(&trace_buffer[i & (TRACE_SIZE - 1)], buf, sizeof(buf));
+    fprintf(out, "%s\n", buf);
+  }
+  fclose(out);
+}
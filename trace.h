@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdbool.h>
+
+#ifndef VM_TRACE_H
+#define VM_TRACE_H
+
+// Number of records kept, older ones are overwritten. Must be a power of two.
+#define TRACE_SIZE (1 << 16)
+
+// Set in trace_record.index when nothing drove the bus
+#define TRACE_BUS_FLOATING 0x8000
+
+// One executed microword. The actions are the microword's decoded u_op actions, which also tell
+// which of them drove the bus.
+struct trace_record {
+  __uint64_t tick;
+  __uint32_t actions;
+  __uint16_t index;
+  __uint16_t bus;
+};
+
+extern bool trace_enabled;
+extern struct trace_record trace_buffer[TRACE_SIZE];
+extern __uint64_t trace_next;
+// Set if the trace is also written to a file
+extern const char *trace_path;
+
+static inline void trace_microword(__uint64_t tick, unsigned index, __uint32_t actions, __uint16_t bus,
+                                   bool bus_floating) {
+  struct trace_record *record = &trace_buffer[trace_next++ & (TRACE_SIZE - 1)];
+  record->tick = tick;
+  record->actions = actions;
+  record->index = (__uint16_t) (index | (bus_floating ? TRACE_BUS_FLOATING : 0));
+  record->bus = bus;
+}
+
+// Fills in the bus of the latest record, once the unclocked phase has driven it. Recording the
+// microword before it runs keeps it in the trace when it raises an error.
+static inline void trace_bus(__uint16_t bus, bool bus_floating) {
+  struct trace_record *record = &trace_buffer[(trace_next - 1) & (TRACE_SIZE - 1)];
+  record->index = (__uint16_t) ((record->index & ~TRACE_BUS_FLOATING) | (bus_floating ? TRACE_BUS_FLOATING : 0));
+  record->bus = bus;
+}
+
+void format_trace_record(const struct trace_record *record, char *buf, size_t size);
+
+void log_trace(int count);
+
+void set_trace_file(const char *path);
+
+void flush_trace_once(void);
+
+#endif //VM_TRACE_H
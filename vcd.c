@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "vcd.h"
+#include "main.h"
+#include "ring.h"
+
+// The simulation thread only copies state into the current chunk. Full chunks go to the writer
+// thread, which diffs consecutive samples, formats the value changes and hands them to stdio in
+// large blocks. Empty chunks are passed back through a second ring.
+
+#define WRITE_BUFFER_SIZE (1 << 20)
+// Enough for every signal changing in one tick
+#define MAX_SAMPLE_TEXT 2048
+#define WAIT_NS 100000L
+
+bool vcd_enabled;
+
+struct vcd_chunk {
+  size_t count;
+  struct vcd_sample samples[VCD_CHUNK_SAMPLES];
+};
+
+struct vcd_chunk *chunks;
+struct vcd_chunk *current;
+struct spsc_ring full_chunks;
+struct spsc_ring free_chunks;
+_Atomic bool writer_done;
+pthread_t writer_thread;
+FILE *vcd_file;
+
+struct vcd_signal {
+  const char *name;
+  int lsb;
+  int width;
+};
+
+// Fields of the 40 bit microword, named after the control lines
+static const struct vcd_signal control_signals[] = {
+    {"neg_uIP_W", 0, 1}, {"neg_out_W", 1, 1}, {"neg_mem_R", 2, 1}, {"neg_mem_W", 3, 1}, {"neg_mar_W", 4, 1},
+    {"neg_seg_en", 6, 1}, {"seg_W", 7, 1}, {"neg_reg_en", 8, 1}, {"reg_W", 9, 1}, {"neg_flag_W", 10, 1},
+    {"flag_sel_bus", 11, 1}, {"neg_flag_R", 12, 1}, {"neg_alu_b_W", 13, 1}, {"neg_alu_a_W", 14, 1},
+    {"shift_right", 15, 1}, {"shift_left", 16, 1}, {"alu_s", 17, 3}, {"neg_alu_re", 20, 1}, {"cin", 21, 1},
+    {"addr_mode", 22, 2}, {"reg_sel", 24, 1}, {"neg_jmp_re", 25, 1}, {"inta", 26, 1}, {"neg_int_re", 27, 1},
+    {"halt", 28, 1}, {"neg_decode_R", 29, 1}, {"neg_uPC_clear", 31, 1}, {"jsel", 32, 4}, {"seg_sel", 36, 2},
+    {"ir_W", 38, 1}
+};
+#define CONTROL_SIGNALS (int) (sizeof(control_signals) / sizeof(control_signals[0]))
+
+static const char *register_signals[8] = {"AX", "BX", "CX", "DX", "SP", "BP", "SI", "BI"};
+static const char *segment_signals[4] = {"CS", "IP", "SS", "DS"};
+
+// Signal ids, in declaration order
+enum {
+  ID_BUS = CONTROL_SIGNALS,
+  ID_ALU_A,
+  ID_ALU_B,
+  ID_MAR,
+  ID_IR,
+  ID_UIR,
+  ID_UPC,
+  ID_REGISTERS,
+  ID_SEGMENTS = ID_REGISTERS + 8,
+  SIGNAL_COUNT = ID_SEGMENTS + 4
+};
+
+// VCD identifier codes: one or two printable characters
+static char *signal_id(int id, char *buf) {
+  if (id < 94) {
+    buf[0] = (char) ('!' + id);
+    buf[1] = '\0';
+  } else {
+    buf[0] = (char) ('!' + id / 94 - 1);
+    buf[1] = (char) ('!' + id % 94);
+    buf[2] = '\0';
+  }
+  return buf;
+}
+
+// Identifier codes, generated once when the header is written
+char signal_ids[SIGNAL_COUNT][4];
+
+static void declare(int id, const char *name, int width) {
+  signal_id(id, signal_ids[id]);
+  fprintf(vcd_file, "$var wire %d %s %s $end\n", width, signal_ids[id], name);
+}
+
+static void write_header(void) {
+  fprintf(vcd_file, "$version 74juu vm $end\n$timescale 1ns $end\n");
+  fprintf(vcd_file, "$comment one time unit per clock tick $end\n");
+  fprintf(vcd_file, "$scope module control $end\n");
+  for (int i = 0; i < CONTROL_SIGNALS; ++i) {
+    declare(i, control_signals[i].name, control_signals[i].width);
+  }
+  fprintf(vcd_file, "$upscope $end\n$scope module cpu $end\n");
+  declare(ID_BUS, "bus", 16);
+  declare(ID_ALU_A, "alu_a", 16);
+  declare(ID_ALU_B, "alu_b", 16);
+  declare(ID_MAR, "mar", 16);
+  declare(ID_IR, "ir", 16);
+  declare(ID_UIR, "uIR", 8);
+  declare(ID_UPC, "uPC", 8);
+  for (int i = 0; i < 8; ++i) {
+    declare(ID_REGISTERS + i, register_signals[i], 16);
+  }
+  for (int i = 0; i < 4; ++i) {
+    declare(ID_SEGMENTS + i, segment_signals[i], 16);
+  }
+  fprintf(vcd_file, "$upscope $end\n$enddefinitions $end\n");
+}
+
+// Appends a value change to out, returning the new end. Vectors drop their leading zeros, which
+// VCD readers extend back.
+static char *emit(char *out, int id, unsigned value, int width) {
+  if (width == 1) {
+    *out++ = (char) ('0' + (value & 1));
+  } else {
+    *out++ = 'b';
+    for (int bit = value ? 31 - __builtin_clz(value) : 0; bit >= 0; --bit) {
+      *out++ = (char) ('0' + ((value >> bit) & 1));
+    }
+    *out++ = ' ';
+  }
+  for (const char *c = signal_ids[id]; *c; ++c) {
+    *out++ = *c;
+  }
+  *out++ = '\n';
+  return out;
+}
+
+static char *emit_bus(char *out, const struct vcd_sample *sample) {
+  if (!sample->bus_floating) {
+    return emit(out, ID_BUS, sample->bus, 16);
+  }
+  out += sprintf(out, "bz %s\n", signal_ids[ID_BUS]);
+  return out;
+}
+
+#define changed(field) (first || sample->field != last->field)
+
+// Formats the changes from last to sample at out, returning the new end. Needs at most
+// MAX_SAMPLE_TEXT bytes.
+static char *write_sample(char *out, const struct vcd_sample *sample, const struct vcd_sample *last, bool first) {
+  char *block = out;
+  char digits[24];
+  int length = 0;
+  __uint64_t tick = sample->tick;
+  do {
+    digits[length++] = (char) ('0' + tick % 10);
+    tick /= 10;
+  } while (tick);
+  *out++ = '#';
+  while (length) {
+    *out++ = digits[--length];
+  }
+  *out++ = '\n';
+  char *start = out;
+  __uint64_t toggled = first ? ~(__uint64_t) 0 : sample->control_bits ^ last->control_bits;
+  if (toggled) {
+    for (int i = 0; i < CONTROL_SIGNALS; ++i) {
+      __uint64_t mask = (((__uint64_t) 1 << control_signals[i].width) - 1) << control_signals[i].lsb;
+      if (toggled & mask) {
+        out = emit(out, i, (unsigned) ((sample->control_bits & mask) >> control_signals[i].lsb),
+                   control_signals[i].width);
+      }
+    }
+  }
+  if (changed(bus) || changed(bus_floating)) { out = emit_bus(out, sample); }
+  if (changed(alu_a)) { out = emit(out, ID_ALU_A, sample->alu_a, 16); }
+  if (changed(alu_b)) { out = emit(out, ID_ALU_B, sample->alu_b, 16); }
+  if (changed(mar)) { out = emit(out, ID_MAR, sample->mar, 16); }
+  if (changed(instruction_register)) { out = emit(out, ID_IR, sample->instruction_register, 16); }
+  if (changed(u_instruction_register)) { out = emit(out, ID_UIR, sample->u_instruction_register, 8); }
+  if (changed(u_program_counter)) { out = emit(out, ID_UPC, sample->u_program_counter, 8); }
+  for (int i = 0; i < 8; ++i) {
+    if (changed(registers[i])) { out = emit(out, ID_REGISTERS + i, sample->registers[i], 16); }
+  }
+  for (int i = 0; i < 4; ++i) {
+    if (changed(segments[i])) { out = emit(out, ID_SEGMENTS + i, sample->segments[i], 16); }
+  }
+  // Nothing changed, drop the timestamp again
+  return out == start ? block : out;
+}
+
+#undef changed
+
+static void *writer_main(void *unused) {
+  (void) unused;
+  struct vcd_sample last = {0};
+  bool first = true;
+  struct vcd_chunk *chunk;
+  char *text = malloc(WRITE_BUFFER_SIZE);
+  char *out = text;
+  while (true) {
+    if (!ring_pop(&full_chunks, &chunk)) {
+      if (atomic_load(&writer_done) && !ring_pop(&full_chunks, &chunk)) {
+        break;
+      }
+      struct timespec wait = {0, WAIT_NS};
+      nanosleep(&wait, NULL);
+      continue;
+    }
+    for (size_t i = 0; i < chunk->count; ++i) {
+      if (out - text > WRITE_BUFFER_SIZE - MAX_SAMPLE_TEXT) {
+        fwrite(text, 1, (size_t) (out - text), vcd_file);
+        out = text;
+      }
+      out = write_sample(out, &chunk->samples[i], &last, first);
+      last = chunk->samples[i];
+      first = false;
+    }
+    chunk->count = 0;
+    ring_push(&free_chunks, &chunk);
+  }
+  fwrite(text, 1, (size_t) (out - text), vcd_file);
+  free(text);
+  return NULL;
+}
+
+int vcd_open(const char *path) {
+  vcd_file = fopen(path, "w");
+  if (vcd_file == NULL) {
+    printf("Could not open %s for writing\n", path);
+    return EXIT_FAILURE;
+  }
+  chunks = malloc(VCD_CHUNKS * sizeof(struct vcd_chunk));
+  if (chunks == NULL || ring_init(&full_chunks, VCD_CHUNKS, sizeof(struct vcd_chunk *)) == EXIT_FAILURE ||
+      ring_init(&free_chunks, VCD_CHUNKS, sizeof(struct vcd_chunk *)) == EXIT_FAILURE) {
+    printf("Could not allocate VCD buffers\n");
+    return EXIT_FAILURE;
+  }
+  for (int i = 1; i < VCD_CHUNKS; ++i) {
+    struct vcd_chunk *chunk = &chunks[i];
+    chunk->count = 0;
+    ring_push(&free_chunks, &chunk);
+  }
+  current = &chunks[0];
+  current->count = 0;
+  write_header();
+  atomic_init(&writer_done, false);
+  if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+    printf("Could not start the VCD writer\n");
+    return EXIT_FAILURE;
+  }
+  vcd_enabled = true;
+  return EXIT_SUCCESS;
+}
+
+static void hand_over_current(void) {
+  ring_push(&full_chunks, &current);
+  // Only blocks if the writer has fallen a whole pool of chunks behind
+  while (!ring_pop(&free_chunks, &current)) {
+    struct timespec wait = {0, WAIT_NS};
+    nanosleep(&wait, NULL);
+  }
+}
+
+// Records the machine at the end of a tick in which control_bits ran
+void vcd_sample(const struct vm *vm, __uint64_t control_bits) {
+  struct vcd_sample *sample = &current->samples[current->count];
+  sample->tick = vm->tick_count;
+  sample->control_bits = control_bits;
+  memcpy(sample->registers, vm->registers, sizeof(sample->registers));
+  memcpy(sample->segments, vm->segments, sizeof(sample->segments));
+  sample->bus = vm->bus;
+  sample->bus_floating = vm->bus_floating;
+  sample->alu_a = vm->alu_a;
+  sample->alu_b = vm->alu_b;
+  sample->mar = vm->mar;
+  sample->instruction_register = vm->instruction_register;
+  sample->u_instruction_register = vm->u_instruction_register;
+  sample->u_program_counter = vm->u_program_counter;
+  if (++current->count == VCD_CHUNK_SAMPLES) {
+    hand_over_current();
+  }
+}
+
+// Flushes everything recorded so far and stops the writer
+void vcd_close(void) {
+  if (!vcd_enabled) {
+    return;
+  }
+  vcd_enabled = false;
+  if (current->count > 0) {
+    ring_push(&full_chunks, &current);
+  }
+  atomic_store(&writer_done, true);
+  pthread_join(writer_thread, NULL);
+  fclose(vcd_file);
+  ring_destroy(&full_chunks);
+  ring_destroy(&free_chunks);
+  free(chunks);
+}
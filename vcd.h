@@ -0,0 +1,36 @@
+#include <stdbool.h>
+
+#ifndef VM_VCD_H
+#define VM_VCD_H
+
+// Samples are handed to the writer thread in chunks of this many ticks
+#define VCD_CHUNK_SAMPLES 4096
+#define VCD_CHUNKS 16
+
+// Machine state at the end of one tick, along with the microword that ran in it
+struct vcd_sample {
+  __uint64_t tick;
+  __uint64_t control_bits;
+  __uint16_t registers[8];
+  __uint16_t segments[4];
+  __uint16_t bus;
+  __uint16_t alu_a;
+  __uint16_t alu_b;
+  __uint16_t mar;
+  __uint16_t instruction_register;
+  __uint8_t u_instruction_register;
+  __uint8_t u_program_counter;
+  bool bus_floating;
+};
+
+extern bool vcd_enabled;
+
+int vcd_open(const char *path);
+
+struct vm;
+
+void vcd_sample(const struct vm *vm, __uint64_t control_bits);
+
+void vcd_close(void);
+
+#endif //VM_VCD_H
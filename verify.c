@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "main.h"
+#include "microcode.h"
+#include "verify.h"
+#include "interrupts.h"
+
+// Static checks over the whole EEPROM. Problems the core would report at runtime (two bus drivers,
+// both shifts, running off the end of a sequence) are errors, suspicious but harmless microwords are
+// warnings. Only microwords that can be reached from reset are checked; the rest of the ROM is
+// usually filler.
+
+// Actions that put a value on the bus
+#define BUS_DRIVERS (action_bit(ACT_MEM_R) | action_bit(ACT_SEG_R) | action_bit(ACT_REG_R) | action_bit(ACT_FLAG_R) |\
+    action_bit(ACT_ALU_RE) | action_bit(ACT_INT_RE))
+// Actions that latch the bus. flag W only reads it with flag_sel_bus.
+#define BUS_READERS (action_bit(ACT_OUT_W) | action_bit(ACT_MEM_W) | action_bit(ACT_MAR_W) | action_bit(ACT_SEG_W) |\
+    action_bit(ACT_REG_W) | action_bit(ACT_ALU_A_W) | action_bit(ACT_ALU_B_W) | action_bit(ACT_IR_W))
+#define MEMORY_ACTIONS (action_bit(ACT_MEM_R) | action_bit(ACT_MEM_W))
+#define SEGMENT_ACTIONS (action_bit(ACT_SEG_R) | action_bit(ACT_SEG_W))
+
+#define UPC_LIMIT 128
+// decode R loads uIR from IR >> 11, uIP W from IR >> 10
+#define DECODE_OPCODES 32
+#define UIP_OPCODES 64
+
+static const char *driver_names[] = {[ACT_MEM_R] = "mem R", [ACT_SEG_R] = "seg R", [ACT_REG_R] = "reg R",
+                                     [ACT_FLAG_R] = "flag R", [ACT_ALU_RE] = "ALU R", [ACT_INT_RE] = "int R"};
+
+struct report {
+  int errors;
+  int warnings;
+};
+
+static void finding(struct report *report, bool is_error, unsigned index, const char *text) {
+  printf("%s: uIR %02x uPC %3u: %s\n", is_error ? "error" : "warning", index >> 7, index & 0x7F, text);
+  if (is_error) {
+    report->errors++;
+  } else {
+    report->warnings++;
+  }
+}
+
+static void check_microword(struct report *report, unsigned index, const struct u_op *op, __uint64_t word) {
+  char text[128];
+  __uint32_t drivers = op->actions & BUS_DRIVERS;
+  if ((drivers & (drivers - 1)) != 0) {
+    int used = snprintf(text, sizeof(text), "bus driven by");
+    while (drivers && (size_t) used < sizeof(text)) {
+      int action = __builtin_ctz(drivers);
+      drivers &= drivers - 1;
+      used += snprintf(text + used, sizeof(text) - used, " [%s]", driver_names[action]);
+    }
+    finding(report, true, index, text);
+  }
+  bool reads_bus = (op->actions & BUS_READERS) ||
+                   ((op->actions & action_bit(ACT_FLAG_W)) && (op->modifiers & MOD_FLAG_SEL_BUS));
+  if (reads_bus && (op->actions & BUS_DRIVERS) == 0) {
+    finding(report, false, index, "bus latched while nothing drives it, reads 0");
+  }
+  if ((op->modifiers & (MOD_SHL | MOD_SHR)) == (MOD_SHL | MOD_SHR)) {
+    finding(report, (op->actions & action_bit(ACT_ALU_RE)) != 0, index, "both shift_left and shift_right set");
+  }
+  if ((word & seg_sel) && !(op->actions & (SEGMENT_ACTIONS | MEMORY_ACTIONS))) {
+    finding(report, false, index, "seg_sel set without a segment or memory access");
+  }
+  if ((word & addr_mode) && !(op->actions & MEMORY_ACTIONS)) {
+    finding(report, false, index, "addr_mode set without a memory access");
+  }
+  if ((word & jsel) && !(op->actions & action_bit(ACT_JMP_RE))) {
+    finding(report, false, index, "jsel set without jmp_re");
+  }
+}
+
+static void visit(bool reached[], unsigned stack[], int *depth, unsigned index) {
+  if (!reached[index]) {
+    reached[index] = true;
+    stack[(*depth)++] = index;
+  }
+}
+
+// Follows every path from reset. uIR changes (decode R, uIP W) can lead to any opcode, so they fan
+// out to all of them. decode R can also enter the interrupt microcode.
+static void find_reachable(const struct u_op decoded[], bool reached[], bool runaway[]) {
+  unsigned *stack = malloc(EEPROM_SIZE * sizeof(unsigned));
+  int depth = 0;
+  reached[0] = true;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    unsigned index = stack[--depth];
+    __uint32_t actions = decoded[index].actions;
+    if (actions & action_bit(ACT_HALT)) {
+      continue;
+    }
+    // jmp_re may skip the next microword, unless its condition is fixed or uPC_clear wins
+    unsigned next_upcs[2];
+    int successors = 0;
+    if (actions & action_bit(ACT_UPC_CLEAR)) {
+      next_upcs[successors++] = 1;
+    } else {
+      bool jumps = (actions & action_bit(ACT_JMP_RE)) != 0;
+      __uint8_t condition = decoded[index].jump_select;
+      if (!jumps || condition != JUMP_ALWAYS) {
+        next_upcs[successors++] = (index & 0x7F) + 1;
+      }
+      if (jumps && condition != (JUMP_ALWAYS | JUMP_NEGATE)) {
+        next_upcs[successors++] = (index & 0x7F) + 2;
+      }
+    }
+    // uIP W is latched after decode R, so it wins if both are set
+    unsigned first = index >> 7;
+    unsigned last = first;
+    bool decodes = false;
+    if (actions & action_bit(ACT_UIP_W)) {
+      first = 0;
+      last = UIP_OPCODES - 1;
+    } else if (actions & action_bit(ACT_DECODE_R)) {
+      first = 0;
+      last = DECODE_OPCODES - 1;
+      decodes = true;
+    }
+    for (int successor = 0; successor < successors; ++successor) {
+      unsigned next_upc = next_upcs[successor];
+      if (next_upc >= UPC_LIMIT) {
+        runaway[index >> 7] = true;
+        continue;
+      }
+      if (decodes) {
+        visit(reached, stack, &depth, INTERRUPT_UIR << 7 | next_upc);
+      }
+      for (unsigned opcode = first; opcode <= last; ++opcode) {
+        visit(reached, stack, &depth, opcode << 7 | next_upc);
+      }
+    }
+  }
+  free(stack);
+}
+
+// Marks every microword that can run after reset
+void reachable_microwords(const struct microcode *microcode, bool reached[]) {
+  bool runaway[EEPROM_SIZE >> 7] = {false};
+  find_reachable(microcode->decoded, reached, runaway);
+}
+
+// Prints every finding and a summary. Fails if there were any errors.
+int verify_microcode(const struct microcode *microcode) {
+  struct report report = {0, 0};
+  bool *reached = calloc(EEPROM_SIZE, sizeof(bool));
+  bool runaway[EEPROM_SIZE >> 7] = {false};
+  find_reachable(microcode->decoded, reached, runaway);
+
+  // Filler decodes to no actions. do_nothing_bits used to leave neg_flag_R low, and images built
+  // with that have flag R as their filler.
+  __uint32_t idle_actions = decode_microword(do_nothing_bits & ~neg_flag_R).actions;
+  int reachable = 0;
+  for (unsigned index = 0; index < EEPROM_SIZE; ++index) {
+    if (reached[index]) {
+      ++reachable;
+      check_microword(&report, index, &microcode->decoded[index], microcode->words[index]);
+    }
+  }
+  for (unsigned opcode = 0; opcode < (EEPROM_SIZE >> 7); ++opcode) {
+    char text[96];
+    if (runaway[opcode]) {
+      finding(&report, true, opcode << 7 | (UPC_LIMIT - 1), "sequence runs past the last uPC without uPC_clear");
+    }
+    int unreachable = 0;
+    unsigned first = 0;
+    for (unsigned upc = 0; upc < UPC_LIMIT; ++upc) {
+      unsigned index = opcode << 7 | upc;
+      if (!reached[index] && microcode->decoded[index].actions != 0 &&
+          microcode->decoded[index].actions != idle_actions) {
+        first = unreachable++ == 0 ? index : first;
+      }
+    }
+    if (unreachable > 0) {
+      snprintf(text, sizeof(text), "%d microwords from here on can never run", unreachable);
+      finding(&report, false, first, text);
+    }
+  }
+  free(reached);
+  printf("%d errors, %d warnings in %d reachable microwords\n", report.errors, report.warnings, reachable);
+  return report.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,13 @@
+#include <stdbool.h>
+
+#ifndef VM_VERIFY_H
+#define VM_VERIFY_H
+
+struct microcode;
+
+// Checks every microword reachable from reset and prints what it finds
+int verify_microcode(const struct microcode *microcode);
+
+void reachable_microwords(const struct microcode *microcode, bool reached[]);
+
+#endif //VM_VERIFY_H